@@ -33,49 +33,54 @@ namespace gen
 	{
 		Matrix().Scale(CVector3(0.25f, 0.25f, 0.25f));
 
-		int IDMessage = GetTankUID(0);
-		for (int i = 0; IDMessage > -1; ++i)
-		{
-			IDMessage = GetTankUID(i);
-
-			SMessage Msg;
+		//Let every tank know there is ammo available
+		SMessage Msg;
 
-			Msg.from = this->GetUID();
-			Msg.type = Msg_Ammo;
+		Msg.from = this->GetUID();
+		Msg.type = Msg_Ammo;
+		Msg.SetPosition(Position());
 
-			Messenger.SendMessageA(IDMessage, Msg);
-		}
+		Messenger.SendGroupMessage(Group_Tanks, Msg);
     }
 
+	// Crates are allocated from the entity manager's crate pool
+	void* CCrateEntity::operator new(size_t size)
+	{
+		return EntityManager.CratePool().Allocate(size);
+	}
+
+	void CCrateEntity::operator delete(void* block, size_t size)
+	{
+		EntityManager.CratePool().Free(block, size);
+	}
+
 	bool CCrateEntity::Update(TFloat32 updateTime)
 	{
 		if (isDestroyed)
 		{
 			return false;
 		}
-		SMessage msg;
-		while (Messenger.FetchMessage(GetUID(), &msg))
+		for (const SMessage& msg : Messenger.DrainMessages(GetUID()))
 		{
 			if (msg.type == Msg_Stop)
 			{
-				int IDMessage = GetTankUID(0);
-				for (int i = 0; IDMessage > -1; ++i)
-				{
-					IDMessage = GetTankUID(i);
-
-					SMessage Msg;
+				SMessage Msg;
 
-					Msg.from = this->GetUID();
-					Msg.type = Msg_AmmoNull;
+				Msg.from = this->GetUID();
+				Msg.type = Msg_AmmoNull;
 
-					Messenger.SendMessageA(IDMessage, Msg);
-				}
+				Messenger.SendGroupMessage(Group_Tanks, Msg);
 
 				isDestroyed = true; //Destroy on next update
 			}
 
 		}
 
+		//Nothing to do until a tank reaches the crate
+		if (!isDestroyed)
+		{
+			Sleep();
+		}
 		return true;
 	}
 }
@@ -32,6 +32,10 @@ namespace gen
 
 		// No destructor needed
 
+		// Crates are allocated from the entity manager's crate pool
+		static void* operator new(size_t size);
+		static void operator delete(void* block, size_t size);
+
 
 	/////////////////////////////////////
 	//	Public interface
@@ -5,10 +5,15 @@
 ********************************************/
 
 #include "Entity.h"
+#include "EntityManager.h"
 
 namespace gen
 {
 
+// The entity manager owns the storage for entity matrices
+extern CEntityManager EntityManager;
+
+
 /*-----------------------------------------------------------------------------------------
 -------------------------------------------------------------------------------------------
 	Base Entity Class
@@ -30,41 +35,47 @@ CEntity::CEntity
 	m_Template = entityTemplate;
 	m_UID = UID;
 	m_Name = name;
+	m_Asleep = false;
+	m_Thinks = false;
+	m_Engaged = false;
+	m_Thinking = true;
+	m_ThinkWait = 0.0f;
+	m_Handle = NullEntityHandle; // Set when added to the entity manager
 
-	// Allocate space for matrices
-	TUInt32 numNodes = m_Template->Mesh()->GetNumNodes();
-	m_RelMatrices = new CMatrix4x4[numNodes];
-	m_Matrices = new CMatrix4x4[numNodes];
+	// Get space for matrices from the transform store, relative matrices then absolute ones
+	m_NumNodes = m_Template->Mesh()->GetNumNodes();
+	m_RelMatrices = EntityManager.Transforms().Allocate( m_NumNodes * 2 );
+	m_Matrices = m_RelMatrices + m_NumNodes;
 
 	// Set initial matrices from mesh defaults
-	for (TUInt32 node = 0; node < numNodes; ++node)
+	for (TUInt32 node = 0; node < m_NumNodes; ++node)
 	{
 		m_RelMatrices[node] = m_Template->Mesh()->GetNode( node ).positionMatrix;
 	}
 
 	// Override root matrix with constructor parameters
 	m_RelMatrices[0] = CMatrix4x4( position, rotation, kZXY, scale );
+
+	// Absolute matrices are calculated by the next transform update
+	m_DirtyNodes = ~0ull;
 }
 
+// Destructor returns the matrices to the transform store
+CEntity::~CEntity()
+{
+	EntityManager.Transforms().Free( m_RelMatrices, m_NumNodes * 2 );
+}
 
-// Render the model
+
+// Render the model. The absolute matrices are calculated from the relative node matrices and
+// node heirarchy by the entity manager's transform update, which must be done first
 void CEntity::Render()
 {
-	// Get pointer to mesh to simplify code
-	CMesh* Mesh = m_Template->Mesh();
-
-	// Calculate absolute matrices from relative node matrices & node heirarchy
-	m_Matrices[0] = m_RelMatrices[0];
-	TUInt32 numNodes = Mesh->GetNumNodes();
-	for (TUInt32 node = 1; node < numNodes; ++node)
-	{
-		m_Matrices[node] = m_RelMatrices[node] * m_Matrices[Mesh->GetNode( node ).parent];
-	}
 	// Incorporate any bone<->mesh offsets (only relevant for skinning)
 	// Don't need this step for this exercise
 
 	// Render with absolute matrices
-	Mesh->Render( m_Matrices );
+	m_Template->Mesh()->Render( m_Matrices );
 }
 
 
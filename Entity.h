@@ -25,6 +25,30 @@ namespace gen
 typedef TUInt32 TEntityUID;
 const TEntityUID SystemUID = 0xffffffff;
 
+// An entity handle is the entity's slot in the entity manager and the generation of that slot.
+// A slot is reused after its entity is destroyed, but with a new generation, so a handle to a
+// destroyed entity is detected rather than finding whatever entity is now in the slot
+struct SEntityHandle
+{
+	TUInt32 slot;
+	TUInt32 generation;
+};
+
+inline bool operator==( const SEntityHandle& a, const SEntityHandle& b )
+{
+	return a.slot == b.slot && a.generation == b.generation;
+}
+inline bool operator!=( const SEntityHandle& a, const SEntityHandle& b )
+{
+	return !(a == b);
+}
+
+// Handle that never refers to an entity (slot generations start at 1)
+const SEntityHandle NullEntityHandle = { 0, 0 };
+
+// Template type and name IDs are given out by the entity manager, this value is never used
+const TUInt32 kNoTemplateID = 0xffffffff;
+
 
 /*-----------------------------------------------------------------------------------------
 -------------------------------------------------------------------------------------------
@@ -46,6 +70,8 @@ public:
 	{
 		m_Type = type;
 		m_Name = name;
+		m_TypeID = kNoTemplateID;
+		m_NameID = kNoTemplateID;
 
 		// Load mesh
 		m_Mesh = new CMesh();
@@ -91,6 +117,18 @@ public:
 		return m_Mesh;
 	}
 
+	// Small integer IDs for the type and name, given by the entity manager when the template is
+	// created. Compare these rather than the strings in code that runs every frame
+	TUInt32 GetTypeID()
+	{
+		return m_TypeID;
+	}
+
+	TUInt32 GetNameID()
+	{
+		return m_NameID;
+	}
+
 
 /////////////////////////////////////
 //	Private interface
@@ -100,6 +138,11 @@ private:
 	string m_Type;
 	string m_Name;
 
+	// Interned type and name, set by the entity manager
+	friend class CEntityManager;
+	TUInt32 m_TypeID;
+	TUInt32 m_NameID;
+
 	// The mesh representing this entity
 	CMesh* m_Mesh;
 };
@@ -133,11 +176,7 @@ public:
 	);
 
 	// Destructor - base class destructors should always be virtual
-	virtual ~CEntity()
-	{
-		delete[] m_Matrices;
-		delete[] m_RelMatrices;
-	}
+	virtual ~CEntity();
 
 private:
 	// Prevent use of copy constructor and assignment operator (private and not defined)
@@ -157,6 +196,11 @@ public:
 		return m_UID;
 	}
 
+	SEntityHandle GetHandle()
+	{
+		return m_Handle;
+	}
+
 	CEntityTemplate* const Template()
 	{
 	 
@@ -176,16 +220,27 @@ public:
 	/////////////////////////////////////
 	// Matrix access
 
-	// Direct access to position and matrix
+	// Direct access to position and matrix. These mark the node's matrix as changed, so its
+	// absolute matrix and those of the nodes below it are recomputed by the next transform update
+	// (see CEntityManager::UpdateTransforms)
 	CVector3& Position( TUInt32 node = 0 )
 	{
+		m_DirtyNodes |= NodeBit( node );
 		return m_RelMatrices[node].Position();
 	}
 	CMatrix4x4& Matrix( TUInt32 node = 0 )
 	{
+		m_DirtyNodes |= NodeBit( node );
 		return m_RelMatrices[node];
 	}
 
+	// Read-only access to position, does not mark the matrix as changed
+	CVector3 GetPosition( TUInt32 node = 0 ) const
+	{
+		const CMatrix4x4& matrix = m_RelMatrices[node];
+		return CVector3( matrix.e30, matrix.e31, matrix.e32 );
+	}
+
 
 	/////////////////////////////////////
 	// Update / Render
@@ -195,10 +250,55 @@ public:
 	// Virtual function, base version does nothing
 	virtual bool Update( TFloat32 updateTime ) { return true; }
 	
-	// Render the entity
+	// Render the entity, its absolute matrices must be up to date
 	void Render();
 
 
+	/////////////////////////////////////
+	// Sleeping
+
+	// A sleeping entity is not updated until a message arrives for it, which wakes it. Entities
+	// that are idle until told otherwise can sleep rather than polling for messages each frame
+	void Sleep()
+	{
+		m_Asleep = true;
+	}
+	void Wake()
+	{
+		m_Asleep = false;
+	}
+	bool IsAsleep()
+	{
+		return m_Asleep;
+	}
+
+
+	/////////////////////////////////////
+	// Thinking
+
+	// Entities with expensive decisions to make, such as searching for targets, make them only
+	// when told to think rather than on every update. Before each update the entity manager
+	// chooses which entities think, by how long they have gone without thinking and how far they
+	// are from the viewpoint, within a budget for the frame (see CEntityManager::SetThinkBudget).
+	// Movement and other cheap work should still be done on every update. An engaged entity (e.g.
+	// one in combat) thinks on every update wherever it is
+	void EnableThinking()
+	{
+		m_Thinks = true;
+	}
+	void SetEngaged( bool engaged )
+	{
+		m_Engaged = engaged;
+	}
+
+	// Return true if the entity should think during this update. Always true for entities that
+	// have not enabled thinking
+	bool IsThinking()
+	{
+		return m_Thinking;
+	}
+
+
 /////////////////////////////////////
 //	Private interface
 private:
@@ -210,9 +310,35 @@ private:
 	TEntityUID  m_UID;
 	string      m_Name;
 
-	// Relative and absolute world matrices for each node in the template's mesh
-	CMatrix4x4* m_RelMatrices; // Dynamically allocated arrays
+	// Handle for the entity, set by the entity manager when the entity is added
+	friend class CEntityManager;
+	SEntityHandle m_Handle;
+
+	// Entity is not updated until it receives a message
+	bool        m_Asleep;
+
+	// Whether the entity thinks at all, is engaged and thinks this update, and the time since it
+	// last thought. All but m_Engaged are set by the entity manager
+	bool        m_Thinks;
+	bool        m_Engaged;
+	bool        m_Thinking;
+	TFloat32    m_ThinkWait;
+
+	// Relative and absolute world matrices for each node in the template's mesh. Both arrays are
+	// in a single block from the entity manager's transform store
+	TUInt32     m_NumNodes;
+	CMatrix4x4* m_RelMatrices;
 	CMatrix4x4* m_Matrices;
+
+	// One bit per node whose relative matrix may have changed since the absolute matrices were
+	// last updated. Nodes beyond the 64th share the last bit
+	TUInt64     m_DirtyNodes;
+
+	// Return the dirty bit for a node
+	static TUInt64 NodeBit( TUInt32 node )
+	{
+		return 1ull << (node < 63 ? node : 63);
+	}
 };
 
 
@@ -5,24 +5,55 @@
 	destruction
 ********************************************/
 
+#include <algorithm>
+#include <chrono>
+using namespace std;
+
 #include "EntityManager.h"
+#include "Messenger.h"
 
 namespace gen
 {
 
+// Messenger class for sending messages to and between entities
+extern CMessenger Messenger;
+
+
 /////////////////////////////////////
 // Constructors/Destructors
 
-// Constructor reserves space for entities and UID hash map, also sets first UID
-CEntityManager::CEntityManager()
+// Constructor sizes the entity pools, reserves space for entities, slots and UID hash map, also
+// sets first UID
+CEntityManager::CEntityManager() :
+	m_TankPool( sizeof(CTankEntity) ), m_CratePool( sizeof(CCrateEntity) )
 {
-	// Initialise list of entities and UID hash map
+	// Initialise list of entities, positions, slot array and UID hash map
 	m_Entities.reserve( 1024 );
+	m_Positions.reserve( 1024 );
+	m_Slots.reserve( 1024 );
 	m_EntityUIDMap = new CHashTable<TEntityUID, TUInt32>( 2048, JOneAtATimeHash ); 
 
 	// Set first entity UID that will be used
 	m_NextUID = 0;
 
+	// No tank templates yet
+	m_TankTypeID = kNoTemplateID;
+
+	// Update on the calling thread until told otherwise
+	m_Jobs = 0;
+
+	m_ShotScenery = 0;
+
+	// All entities think on every update until told otherwise
+	m_ThinkBudget = 0;
+	m_ThinkViewpoint = CVector3::kOrigin;
+	m_HasThinkViewpoint = false;
+
+	// A list of tanks for each state
+	m_TankStates.resize( CTankEntity::kNumStates );
+	m_TankStateTimes.resize( CTankEntity::kNumStates, 0.0f );
+	m_StateFrame = 0;
+
 	m_IsEnumerating = false;
 }
 
@@ -31,6 +62,7 @@ CEntityManager::~CEntityManager()
 {
 	DestroyAllEntities();
 	delete m_EntityUIDMap;
+	delete m_Jobs;
 }
 
 
@@ -46,6 +78,7 @@ CEntityTemplate* CEntityManager::CreateTemplate( const string& type, const strin
 
 	// Add the template name / template pointer pair to the map
     m_Templates[name] = newTemplate;
+	InternTemplate( newTemplate );
 
 	return newTemplate;
 }
@@ -63,6 +96,10 @@ CTankTemplate* CEntityManager::CreateTankTemplate(const string& type, const stri
 
 	// Add the template name / template pointer pair to the map
 	m_Templates[name] = newTemplate;
+	InternTemplate( newTemplate );
+
+	// Look up the type shells hit once rather than for every shell
+	m_TankTypeID = FindTemplateTypeID( "Tank" );
 
 	return newTemplate;
 }
@@ -101,6 +138,28 @@ void CEntityManager::DestroyAllTemplates()
 }
 
 
+// Give a new template IDs for its type and name, adding entity lists for any new type or name
+void CEntityManager::InternTemplate( CEntityTemplate* newTemplate )
+{
+	TIDIter typeID = m_TypeIDs.find( newTemplate->GetType() );
+	if (typeID == m_TypeIDs.end())
+	{
+		typeID = m_TypeIDs.insert( make_pair( newTemplate->GetType(), static_cast<TUInt32>(m_TypeLists.size()) ) ).first;
+		m_TypeLists.push_back( vector<TUInt32>() );
+	}
+	newTemplate->m_TypeID = typeID->second;
+
+	// A template that replaces one of the same name keeps the name's ID
+	TIDIter nameID = m_TemplateNameIDs.find( newTemplate->GetName() );
+	if (nameID == m_TemplateNameIDs.end())
+	{
+		nameID = m_TemplateNameIDs.insert( make_pair( newTemplate->GetName(), static_cast<TUInt32>(m_TemplateLists.size()) ) ).first;
+		m_TemplateLists.push_back( vector<TUInt32>() );
+	}
+	newTemplate->m_NameID = nameID->second;
+}
+
+
 /////////////////////////////////////
 // Entity creation / destruction
 
@@ -121,17 +180,8 @@ TEntityUID CEntityManager::CreateEntity
 	// Create new entity with next UID
 	CEntity* newEntity = new CEntity( entityTemplate, m_NextUID, name, position, rotation, scale );
 
-	// Get vector index for new entity and add it to vector
-	TUInt32 entityIndex = static_cast<TUInt32>(m_Entities.size());
-	m_Entities.push_back( newEntity );
-
-	// Add mapping from UID to entity index into hash map
-	m_EntityUIDMap->SetKeyValue( m_NextUID, entityIndex );
-	
-	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
-
-	// Return UID of new entity then increase it ready for next entity
-	return m_NextUID++;
+	// Add to the entity list and slot array, returning its UID
+	return AddEntity( newEntity );
 }
 
 
@@ -154,52 +204,63 @@ TEntityUID CEntityManager::CreateTank
 	CTankTemplate* tankTemplate = static_cast<CTankTemplate*>(GetTemplate(templateName));
 
 	// Create new tank entity with next UID
-	CEntity* newEntity = new CTankEntity(tankTemplate, m_NextUID, team, patrolList, name, position, rotation, scale);
-
-
-	// Get vector index for new entity and add it to vector
-	TUInt32 entityIndex = static_cast<int>(m_Entities.size());
-	m_Entities.push_back(newEntity);
+	CTankEntity* newEntity = new CTankEntity(tankTemplate, m_NextUID, team, patrolList, name, position, rotation, scale);
 
-	// Add mapping from UID to entity index into hash map
-	m_EntityUIDMap->SetKeyValue(m_NextUID, entityIndex);
-
-	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
 
-							 // Return UID of new entity then increase it ready for next entity
-	return m_NextUID++;
+	// Add to the entity list and slot array, and to the list for its starting state, returning its UID
+	TEntityUID UID = AddEntity( newEntity, team );
+	vector<CTankEntity*>& stateList = m_TankStates[newEntity->m_State];
+	m_Slots[newEntity->GetHandle().slot].statePos = static_cast<TUInt32>(stateList.size());
+	stateList.push_back( newEntity );
+	return UID;
 }
 
 
-// Create a shell, requires a shell template name, may supply entity name and position
-// Returns the UID of the new entity
-TEntityUID CEntityManager::CreateShell
+// Create a shell fired by the given tank, requires a shell template name, the tank's handle,
+// team and shell damage, and the shell's position and rotation. The shell travels in the
+// direction given by the Y rotation and hits tanks on other teams
+void CEntityManager::CreateShell
 (
 	const string&   templateName,
-	const string&   name /*= ""*/,
-	const CVector3& position /*= CVector3::kOrigin*/,
-	const CVector3& rotation /*= CVector3( 0.0f, 0.0f, 0.0f )*/,
-	const CVector3& scale /*= CVector3( 1.0f, 1.0f, 1.0f )*/
+	SEntityHandle   owner,
+	TUInt32         team,
+	TFloat32        damage,
+	const CVector3& position,
+	const CVector3& rotation
 	)
 {
-	// Get template associated with the template name
-	CEntityTemplate* entityTemplate = GetTemplate(templateName);
-
-	// Create new tank entity with next UID
-	CEntity* newEntity = new CShellEntity(entityTemplate, m_NextUID, 
-		name, position, rotation, scale);
-
-	// Get vector index for new entity and add it to vector
-	TUInt32 entityIndex = static_cast<int>(m_Entities.size());
-	m_Entities.push_back(newEntity);
-
-	// Add mapping from UID to entity index into hash map
-	m_EntityUIDMap->SetKeyValue(m_NextUID, entityIndex);
-
-	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
+	// Travel along the Z axis turned by the Y rotation
+	CMatrix4x4 facing = CMatrix4x4::kIdentity;
+	facing.RotateY( rotation.y );
+
+	SShellCommand shell;
+	shell.shellTemplate = GetTemplate( templateName );
+	shell.owner = owner;
+	shell.damage = damage;
+	shell.targets.typeID = m_TankTypeID;
+
+	// Only enemy tanks are hit. Shells used to hit any tank but the one firing, including team
+	// mates, but a team-filtered query touches only the enemies near the shell
+	shell.targets.team = team;
+	shell.targets.otherTeams = true;
+	shell.position = position;
+	shell.velocity = Normalise( facing.ZAxis() ) * SHELL_SPEED;
+
+	// During an update, record the shell to create it after the update
+	SEntityCommands* commands = ThreadCommands();
+	if (commands)
+	{
+		commands->shells.push_back( shell );
+		return;
+	}
+	AddShell( shell );
+}
 
-							 // Return UID of new entity then increase it ready for next entity
-	return m_NextUID++;
+// Add a shell described by a shell command to the projectiles
+void CEntityManager::AddShell( const SShellCommand& shell )
+{
+	m_Projectiles.Add( shell.shellTemplate, shell.position, shell.velocity, SHELL_LIFESPAN,
+	                   SHELL_SIZE + TANK_RADIUS, shell.damage, shell.owner, shell.targets );
 }
 
 
@@ -214,6 +275,12 @@ TEntityUID CEntityManager::CreateCrate
 	const CVector3& scale /*= CVector3( 1.0f, 1.0f, 1.0f )*/
 )
 {
+	// During an update, record the crate to create it after the update
+	if (RecordCreate( Create_Crate, templateName, name, position, rotation, scale ))
+	{
+		return SystemUID;
+	}
+
 	// Get template associated with the template name
 	CEntityTemplate* entityTemplate = GetTemplate(templateName);
 
@@ -221,86 +288,780 @@ TEntityUID CEntityManager::CreateCrate
 	CEntity* newEntity = new CCrateEntity(entityTemplate, m_NextUID,
 		name, position, rotation, scale);
 
-	// Get vector index for new entity and add it to vector
-	TUInt32 entityIndex = static_cast<int>(m_Entities.size());
-	m_Entities.push_back(newEntity);
-
-	// Add mapping from UID to entity index into hash map
-	m_EntityUIDMap->SetKeyValue(m_NextUID, entityIndex);
-
-	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
+	// A stopped tank sleeps until a message arrives, so wake those in reach to collect the crate
+	SGridFilter tankFilter = { m_TankTypeID, kNoTeam, false };
+	m_CrateTanks.clear();
+	QueryRadius( position, AMMO_RADIUS + TANK_RADIUS, tankFilter, m_CrateTanks );
+	for (TUInt32 tank = 0; tank < m_CrateTanks.size(); ++tank)
+	{
+		CEntity* tankEntity = GetEntity( m_CrateTanks[tank] );
+		if (tankEntity)
+		{
+			tankEntity->Wake();
+		}
+	}
 
-							 // Return UID of new entity then increase it ready for next entity
-	return m_NextUID++;
+	// Add to the entity list and slot array, returning its UID
+	return AddEntity( newEntity );
 }
 
 
 
-// Destroy the given entity - returns true if the entity existed and was destroyed
+// Destroy the given entity - returns true if the entity existed and was destroyed. During an
+// update the entity is destroyed after all entities are updated
 bool CEntityManager::DestroyEntity( TEntityUID UID )
 {
-	// Find the vector index of the given UID
-	TUInt32 entityIndex;
-	if (!m_EntityUIDMap->LookUpKey( UID, &entityIndex ))
+	// Find the slot of the given UID
+	TUInt32 slot;
+	if (!m_EntityUIDMap->LookUpKey( UID, &slot ))
 	{
 		// Quit if not found
 		return false;
 	}
 
-	// Delete the given entity and remove from UID map
-	delete m_Entities[entityIndex];
-	m_EntityUIDMap->RemoveKey( UID );
+	// During an update, record the entity to destroy it after the update
+	SEntityCommands* commands = ThreadCommands();
+	if (commands)
+	{
+		commands->destroys.push_back( UID );
+		return true;
+	}
+
+	TUInt32 entityIndex = m_Slots[slot].index;
+
+	// Remove from its type and template lists, moving the last entry of each list into the gap
+	CEntityTemplate* entityTemplate = m_Entities[entityIndex]->Template();
+	vector<TUInt32>& typeList = m_TypeLists[entityTemplate->GetTypeID()];
+	typeList[m_Slots[slot].typePos] = typeList.back();
+	m_Slots[m_Entities[typeList.back()]->GetHandle().slot].typePos = m_Slots[slot].typePos;
+	typeList.pop_back();
+
+	vector<TUInt32>& templateList = m_TemplateLists[entityTemplate->GetNameID()];
+	templateList[m_Slots[slot].templatePos] = templateList.back();
+	m_Slots[m_Entities[templateList.back()]->GetHandle().slot].templatePos = m_Slots[slot].templatePos;
+	templateList.pop_back();
+
+	// Delete the given entity and free its slot
+	FreeEntity( slot );
 
 	// If not removing last entity...
 	if (entityIndex != m_Entities.size() - 1)
 	{
-		// ...put the last entity into the empty entity slot and update UID map
+		// ...put the last entity into the empty entity space and update its slot and lists
 		m_Entities[entityIndex] = m_Entities.back();
-		m_EntityUIDMap->SetKeyValue( m_Entities.back()->GetUID(), entityIndex );
+		m_Positions[entityIndex] = m_Positions.back();
+		SEntitySlot& movedSlot = m_Slots[m_Entities.back()->GetHandle().slot];
+		movedSlot.index = entityIndex;
+		m_TypeLists[m_Entities.back()->Template()->GetTypeID()][movedSlot.typePos] = entityIndex;
+		m_TemplateLists[m_Entities.back()->Template()->GetNameID()][movedSlot.templatePos] = entityIndex;
 	}
 	m_Entities.pop_back(); // Remove last entity
+	m_Positions.pop_back();
 
 	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
 	return true;
 }
 
 
-// Destroy all entities held by the manager
+// Destroy all entities and projectiles held by the manager
 void CEntityManager::DestroyAllEntities()
 {
+	m_Projectiles.RemoveAll();
+
 	m_EntityUIDMap->RemoveAllKeys();
+	m_Grid.Clear();
 	while (m_Entities.size())
 	{
+		Messenger.EntityDestroyed( m_Entities.back()->GetUID() );
+
+		TUInt32 slot = m_Entities.back()->GetHandle().slot;
+		m_Slots[slot].entity = 0;
+		++m_Slots[slot].generation;
+		m_FreeSlots.push_back( slot );
+
 		delete m_Entities.back();
 		m_Entities.pop_back();
 	}
+	m_Positions.clear();
+	for (TUInt32 type = 0; type < m_TypeLists.size(); ++type)
+	{
+		m_TypeLists[type].clear();
+	}
+	for (TUInt32 name = 0; name < m_TemplateLists.size(); ++name)
+	{
+		m_TemplateLists[name].clear();
+	}
+	for (TUInt32 state = 0; state < m_TankStates.size(); ++state)
+	{
+		m_TankStates[state].clear();
+	}
 
 	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
 }
 
 
+// Add a newly created entity to the entity list and spatial grid and give it a slot and
+// handle. The entity must have been created with the next UID, which is returned
+TEntityUID CEntityManager::AddEntity( CEntity* newEntity, TUInt32 team /*= kNoTeam*/ )
+{
+	// Reuse a free slot if there is one. Generations start at 1 so the null handle never matches
+	TUInt32 slot;
+	if (!m_FreeSlots.empty())
+	{
+		slot = m_FreeSlots.back();
+		m_FreeSlots.pop_back();
+	}
+	else
+	{
+		slot = static_cast<TUInt32>(m_Slots.size());
+		SEntitySlot newSlot = { 0, 1, 0, 0, 0, kNoStatePos };
+		m_Slots.push_back( newSlot );
+	}
+	TUInt32 entityIndex = static_cast<TUInt32>(m_Entities.size());
+	m_Slots[slot].entity = newEntity;
+	m_Slots[slot].index = entityIndex;
+	m_Slots[slot].statePos = kNoStatePos;
+	SEntityHandle handle = { slot, m_Slots[slot].generation };
+	newEntity->m_Handle = handle;
+
+	// Add entity to its type and template lists
+	vector<TUInt32>& typeList = m_TypeLists[newEntity->Template()->GetTypeID()];
+	m_Slots[slot].typePos = static_cast<TUInt32>(typeList.size());
+	typeList.push_back( entityIndex );
+
+	vector<TUInt32>& templateList = m_TemplateLists[newEntity->Template()->GetNameID()];
+	m_Slots[slot].templatePos = static_cast<TUInt32>(templateList.size());
+	templateList.push_back( entityIndex );
+
+	// Add entity to vector and mapping from UID to slot into hash map
+	m_Entities.push_back( newEntity );
+	m_Positions.push_back( newEntity->GetPosition() );
+	m_Grid.Insert( handle, m_Positions.back(), newEntity->Template()->GetTypeID(), team );
+	m_EntityUIDMap->SetKeyValue( m_NextUID, slot );
+
+	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
+
+	// Return UID of new entity then increase it ready for next entity
+	return m_NextUID++;
+}
+
+// Remove the entity in the given slot from the spatial grid, messenger, UID map and its tank
+// state list, delete it and free the slot. The entity, type and template lists are not changed
+void CEntityManager::FreeEntity( TUInt32 slot )
+{
+	CEntity* entity = m_Slots[slot].entity;
+	if (m_Slots[slot].statePos != kNoStatePos)
+	{
+		RemoveTankState( static_cast<CTankEntity*>(entity) );
+	}
+	m_Grid.Remove( entity->GetHandle() );
+	Messenger.EntityDestroyed( entity->GetUID() );
+	m_EntityUIDMap->RemoveKey( entity->GetUID() );
+	delete entity;
+
+	// Free the slot for reuse, a new generation makes any remaining handles to it stale
+	m_Slots[slot].entity = 0;
+	++m_Slots[slot].generation;
+	m_FreeSlots.push_back( slot );
+}
+
+
 /////////////////////////////////////
 // Update / Rendering
 
-// Call all entity update functions. Pass the time since last update
+// Call all entity update functions. Pass the time since last update. Sleeping entities are
+// skipped unless they have messages waiting
 void CEntityManager::UpdateAllEntities( float updateTime )
 {
-	TUInt32 entity = 0;
-	while (entity < m_Entities.size())
+	// Choose who thinks before any entity is updated, so the choice doesn't depend on update order
+	ScheduleThinks( updateTime );
+
+	// Update in chunks, on the job system if there is one, otherwise in order on this thread
+	TUInt32 numChunks = (static_cast<TUInt32>(m_Entities.size()) + kUpdateChunkSize - 1) / kUpdateChunkSize;
+	if (m_ChunkCommands.size() < numChunks)
+	{
+		m_ChunkCommands.resize( numChunks );
+	}
+	if (m_Jobs)
 	{
-		// Update entity, if it returns false, then destroy it
+		m_Jobs->ParallelFor( numChunks, [&]( TUInt32 chunk ) { UpdateChunk( chunk, updateTime ); } );
+	}
+	else
+	{
+		for (TUInt32 chunk = 0; chunk < numChunks; ++chunk)
+		{
+			UpdateChunk( chunk, updateTime );
+		}
+	}
+	Messenger.NextSendPass();
+
+	// Tanks have read their messages, move those that changed state then update each state's
+	// tanks together. The entity list has not changed during the updates, now destroy and create
+	// entities
+	ApplyStateChanges( numChunks );
+	TUInt32 numStateChunks = UpdateTankStates( updateTime );
+	ApplyCommands( max( numChunks, numStateChunks ) );
+
+	// Copy the new positions into the packed array and the spatial grid, once per frame for all
+	// readers. Entities only change grid cell when they have moved out of their cell
+	for (TUInt32 entity = 0; entity < m_Entities.size(); ++entity)
+	{
+		m_Positions[entity] = m_Entities[entity]->GetPosition();
+		m_Grid.Move( m_Entities[entity]->GetHandle(), m_Positions[entity] );
+	}
+
+	// Everything has moved, now move the projectiles and see what they hit
+	UpdateProjectiles( updateTime );
+}
+
+// Set the number of threads entities are updated on. 1 (the default) updates the chunks in
+// order on the calling thread, 0 uses one thread per hardware thread. Ignored unless the
+// messenger is thread-safe
+void CEntityManager::SetUpdateThreads( TUInt32 numThreads )
+{
+#if GEN_MESSENGER_THREAD_SAFE
+	delete m_Jobs;
+	m_Jobs = 0;
+	if (numThreads != 1)
+	{
+		m_Jobs = new CJobSystem( numThreads );
+		if (m_Jobs->NumThreads() == 1)
+		{
+			delete m_Jobs;
+			m_Jobs = 0;
+		}
+	}
+#endif
+}
+
+
+// Return the command list for the chunk being updated on the calling thread, or 0 if there
+// is no update on this thread
+CEntityManager::SEntityCommands*& CEntityManager::ThreadCommands()
+{
+	static thread_local SEntityCommands* threadCommands = 0;
+	return threadCommands;
+}
+
+// Record an entity to create if there is an update on the calling thread. Returns false if
+// the entity should be created immediately
+bool CEntityManager::RecordCreate( ECreateKind kind, const string& templateName, const string& name,
+                                   const CVector3& position, const CVector3& rotation, const CVector3& scale )
+{
+	SEntityCommands* commands = ThreadCommands();
+	if (!commands)
+	{
+		return false;
+	}
+	SCreateCommand create = { kind, templateName, name, position, rotation, scale };
+	commands->creates.push_back( create );
+	return true;
+}
+
+// Update the given chunk of entities, recording entities to destroy in its command list
+void CEntityManager::UpdateChunk( TUInt32 chunk, float updateTime )
+{
+	SEntityCommands& commands = m_ChunkCommands[chunk];
+	ThreadCommands() = &commands;
+	Messenger.BeginSendChunk( chunk );
+
+	TUInt32 end = min( (chunk + 1) * kUpdateChunkSize, static_cast<TUInt32>(m_Entities.size()) );
+	for (TUInt32 entity = chunk * kUpdateChunkSize; entity < end; ++entity)
+	{
+		if (m_Entities[entity]->IsAsleep())
+		{
+			if (!Messenger.HasMessages( m_Entities[entity]->GetUID() ))
+			{
+				continue;
+			}
+			m_Entities[entity]->Wake();
+		}
+
 		if (!m_Entities[entity]->Update( updateTime ))
 		{
-			DestroyEntity(m_Entities[entity]->GetUID());
+			commands.destroys.push_back( m_Entities[entity]->GetUID() );
+		}
+	}
+
+	Messenger.EndSendChunk();
+	ThreadCommands() = 0;
+}
+
+// Apply the command lists of the given number of chunks, in chunk order. All destroys are done
+// before any creates
+void CEntityManager::ApplyCommands( TUInt32 numChunks )
+{
+	// Free all the destroyed entities, leaving gaps in the entity list, then close the gaps in
+	// one pass rather than moving an entity into each gap as DestroyEntity does
+	bool anyDestroyed = false;
+	TUInt32 numCreates = 0;
+	for (TUInt32 chunk = 0; chunk < numChunks; ++chunk)
+	{
+		vector<TEntityUID>& destroys = m_ChunkCommands[chunk].destroys;
+		for (TUInt32 destroy = 0; destroy < destroys.size(); ++destroy)
+		{
+			// An entity may be recorded more than once
+			TUInt32 slot;
+			if (m_EntityUIDMap->LookUpKey( destroys[destroy], &slot ))
+			{
+				m_Entities[m_Slots[slot].index] = 0;
+				FreeEntity( slot );
+				anyDestroyed = true;
+			}
+		}
+		destroys.clear();
+		numCreates += static_cast<TUInt32>(m_ChunkCommands[chunk].creates.size());
+	}
+	if (anyDestroyed)
+	{
+		CompactEntities();
+	}
+
+	// Create the new entities, making room for them all first, and add the new shells
+	if (numCreates > 0)
+	{
+		m_Entities.reserve( m_Entities.size() + numCreates );
+		m_Positions.reserve( m_Positions.size() + numCreates );
+	}
+	for (TUInt32 chunk = 0; chunk < numChunks; ++chunk)
+	{
+		vector<SCreateCommand>& creates = m_ChunkCommands[chunk].creates;
+		for (TUInt32 create = 0; create < creates.size(); ++create)
+		{
+			const SCreateCommand& command = creates[create];
+			if (command.kind == Create_Crate)
+			{
+				CreateCrate( command.templateName, command.name, command.position, command.rotation, command.scale );
+			}
+		}
+		creates.clear();
+
+		vector<SShellCommand>& shells = m_ChunkCommands[chunk].shells;
+		for (TUInt32 shell = 0; shell < shells.size(); ++shell)
+		{
+			AddShell( shells[shell] );
+		}
+		shells.clear();
+	}
+}
+
+// Close the gaps left in the entity list by entities freed by ApplyCommands, keeping the order
+// of the remaining entities, and rebuild the type and template lists to match
+void CEntityManager::CompactEntities()
+{
+	for (TUInt32 type = 0; type < m_TypeLists.size(); ++type)
+	{
+		m_TypeLists[type].clear();
+	}
+	for (TUInt32 name = 0; name < m_TemplateLists.size(); ++name)
+	{
+		m_TemplateLists[name].clear();
+	}
+
+	TUInt32 numKept = 0;
+	for (TUInt32 entity = 0; entity < m_Entities.size(); ++entity)
+	{
+		CEntity* keptEntity = m_Entities[entity];
+		if (!keptEntity)
+		{
+			continue;
+		}
+		m_Entities[numKept] = keptEntity;
+		m_Positions[numKept] = m_Positions[entity];
+
+		SEntitySlot& slot = m_Slots[keptEntity->GetHandle().slot];
+		slot.index = numKept;
+		vector<TUInt32>& typeList = m_TypeLists[keptEntity->Template()->GetTypeID()];
+		slot.typePos = static_cast<TUInt32>(typeList.size());
+		typeList.push_back( numKept );
+		vector<TUInt32>& templateList = m_TemplateLists[keptEntity->Template()->GetNameID()];
+		slot.templatePos = static_cast<TUInt32>(templateList.size());
+		templateList.push_back( numKept );
+		++numKept;
+	}
+	m_Entities.resize( numKept );
+	m_Positions.resize( numKept );
+
+	m_IsEnumerating = false; // Cancel any entity enumeration (entity list has changed)
+}
+
+
+/////////////////////////////////////
+// Tank state update
+
+// Move the given tank to the given state's list. During an update the change is recorded and
+// made after the update or state pass
+void CEntityManager::ChangeTankState( CTankEntity* tank, TUInt32 state )
+{
+	SEntityCommands* commands = ThreadCommands();
+	if (commands)
+	{
+		SStateChange change = { tank, state };
+		commands->stateChanges.push_back( change );
+		return;
+	}
+	SetTankState( tank, state );
+}
+
+// Move the given tank from its state's list to the given state's list
+void CEntityManager::SetTankState( CTankEntity* tank, TUInt32 state )
+{
+	if (tank->m_State == state)
+	{
+		return;
+	}
+	RemoveTankState( tank );
+
+	vector<CTankEntity*>& stateList = m_TankStates[state];
+	m_Slots[tank->GetHandle().slot].statePos = static_cast<TUInt32>(stateList.size());
+	stateList.push_back( tank );
+	tank->m_State = static_cast<CTankEntity::EState>(state);
+}
+
+// Remove the given tank from its state's list, moving the last tank in the list into the gap
+void CEntityManager::RemoveTankState( CTankEntity* tank )
+{
+	SEntitySlot& slot = m_Slots[tank->GetHandle().slot];
+	vector<CTankEntity*>& stateList = m_TankStates[tank->m_State];
+	stateList[slot.statePos] = stateList.back();
+	m_Slots[stateList.back()->GetHandle().slot].statePos = slot.statePos;
+	stateList.pop_back();
+	slot.statePos = kNoStatePos;
+}
+
+// Make the tank state changes recorded by the given number of chunks, in chunk order
+void CEntityManager::ApplyStateChanges( TUInt32 numChunks )
+{
+	for (TUInt32 chunk = 0; chunk < numChunks; ++chunk)
+	{
+		vector<SStateChange>& changes = m_ChunkCommands[chunk].stateChanges;
+		for (TUInt32 change = 0; change < changes.size(); ++change)
+		{
+			SetTankState( changes[change].tank, changes[change].state );
+		}
+		changes.clear();
+	}
+}
+
+// Update each state's list of tanks in turn, timing each pass, and make the state changes
+// recorded in each pass before the next. Returns the number of chunks used, whose command lists
+// need applying
+TUInt32 CEntityManager::UpdateTankStates( float updateTime )
+{
+	++m_StateFrame;
+	TUInt32 maxChunks = 0;
+	for (TUInt32 state = 0; state < CTankEntity::kNumStates; ++state)
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+		// The lists do not change during a pass, state changes and destroys are recorded
+		TUInt32 numChunks = (static_cast<TUInt32>(m_TankStates[state].size()) + kUpdateChunkSize - 1) / kUpdateChunkSize;
+		if (m_ChunkCommands.size() < numChunks)
+		{
+			m_ChunkCommands.resize( numChunks );
+		}
+		if (m_Jobs && numChunks > 1)
+		{
+			m_Jobs->ParallelFor( numChunks, [&]( TUInt32 chunk ) { UpdateStateChunk( state, chunk, updateTime ); } );
 		}
 		else
 		{
-			++entity;
+			for (TUInt32 chunk = 0; chunk < numChunks; ++chunk)
+			{
+				UpdateStateChunk( state, chunk, updateTime );
+			}
 		}
+		Messenger.NextSendPass();
+		ApplyStateChanges( numChunks );
+		maxChunks = max( maxChunks, numChunks );
+
+		m_TankStateTimes[state] = chrono::duration<TFloat32>( chrono::steady_clock::now() - start ).count();
 	}
+	return maxChunks;
+}
+
+// Update the given chunk of the given state's list of tanks, recording commands in the chunk's
+// command list
+void CEntityManager::UpdateStateChunk( TUInt32 state, TUInt32 chunk, float updateTime )
+{
+	ThreadCommands() = &m_ChunkCommands[chunk];
+	Messenger.BeginSendChunk( chunk );
+
+	vector<CTankEntity*>& stateList = m_TankStates[state];
+	TUInt32 first = chunk * kUpdateChunkSize;
+	TUInt32 end = min( first + kUpdateChunkSize, static_cast<TUInt32>(stateList.size()) );
+	CTankEntity::UpdateStates( state, &stateList[first], end - first, m_StateFrame, updateTime );
+
+	Messenger.EndSendChunk();
+	ThreadCommands() = 0;
 }
 
-// Render all entities
+
+/////////////////////////////////////
+// Projectile update
+
+// Remove expired projectiles, test the movement of the rest over the given time as shots, move
+// them, then send the hits and remove the projectiles that hit something
+void CEntityManager::UpdateProjectiles( float updateTime )
+{
+	m_Projectiles.Age( updateTime );
+
+	m_ShotHits.clear();
+	for (TUInt32 projectile = 0; projectile < m_Projectiles.NumProjectiles(); ++projectile)
+	{
+		SShot shot;
+		shot.owner = m_Projectiles.GetOwner( projectile );
+		shot.start = m_Projectiles.GetPosition( projectile );
+		shot.end = shot.start + m_Projectiles.GetVelocity( projectile ) * updateTime;
+		shot.hitRadius = m_Projectiles.GetHitRadius( projectile );
+		shot.targets = m_Projectiles.GetTargets( projectile );
+
+		SShotHit hit;
+		if (FindShotHit( shot, hit.target ))
+		{
+			hit.projectile = projectile;
+			m_ShotHits.push_back( hit );
+		}
+	}
+
+	m_Projectiles.Move( updateTime );
+
+	// Hits are in projectile order, remove from the last so the indexes of the others are unchanged
+	for (TUInt32 hit = static_cast<TUInt32>(m_ShotHits.size()); hit > 0; --hit)
+	{
+		const SShotHit& shotHit = m_ShotHits[hit - 1];
+		if (shotHit.target != SystemUID)
+		{
+			// The owner may have been destroyed since firing
+			CEntity* owner = GetEntity( m_Projectiles.GetOwner( shotHit.projectile ) );
+
+			SMessage msg;
+			msg.from = owner ? owner->GetUID() : SystemUID;
+			msg.type = Msg_Hit;
+			msg.hit.damage = m_Projectiles.GetDamage( shotHit.projectile );
+			Messenger.SendMessage( shotHit.target, msg );
+		}
+		m_Projectiles.Remove( shotHit.projectile );
+	}
+}
+
+
+// Return true if the line from start to end passes within the given radius of a point, also
+// returning how far along the line (0 to 1) it first comes within the radius
+static bool LineHitsSphere( const CVector3& start, const CVector3& end, const CVector3& centre,
+                            TFloat32 radius, TFloat32& along )
+{
+	// Solve |start + line * t - centre| = radius for the smaller t
+	CVector3 line = end - start;
+	CVector3 offset = start - centre;
+	TFloat32 c = Dot( offset, offset ) - radius * radius;
+	if (c <= 0.0f)
+	{
+		along = 0.0f; // Starts inside
+		return true;
+	}
+	TFloat32 a = Dot( line, line );
+	TFloat32 b = Dot( offset, line );
+	if (a == 0.0f || b >= 0.0f)
+	{
+		return false; // Not moving towards the point
+	}
+	TFloat32 discriminant = b * b - a * c;
+	if (discriminant < 0.0f)
+	{
+		return false;
+	}
+	along = (-b - sqrt( discriminant )) / a;
+	return along <= 1.0f;
+}
+
+// Find what a shot hits first, returns false if it hits nothing. The target is SystemUID if
+// the shot hit scenery
+bool CEntityManager::FindShotHit( const SShot& shot, TEntityUID& target )
+{
+	// Candidates are the targets in the box around the shot's line, grown by the hit radius
+	CVector3 extent( shot.hitRadius, shot.hitRadius, shot.hitRadius );
+	CVector3 minBounds( min( shot.start.x, shot.end.x ), min( shot.start.y, shot.end.y ), min( shot.start.z, shot.end.z ) );
+	CVector3 maxBounds( max( shot.start.x, shot.end.x ), max( shot.start.y, shot.end.y ), max( shot.start.z, shot.end.z ) );
+	m_ShotCandidates.clear();
+	m_Grid.QueryBox( minBounds - extent, maxBounds + extent, shot.targets, m_ShotCandidates );
+
+	// Take the candidate the line reaches first
+	TFloat32 firstAlong = 1.0f;
+	target = SystemUID;
+	for (TUInt32 candidate = 0; candidate < m_ShotCandidates.size(); ++candidate)
+	{
+		if (m_ShotCandidates[candidate] == shot.owner)
+		{
+			continue;
+		}
+		TUInt32 entityIndex = m_Slots[m_ShotCandidates[candidate].slot].index;
+		TFloat32 along;
+		if (LineHitsSphere( shot.start, shot.end, m_Positions[entityIndex], shot.hitRadius, along ) &&
+		    (target == SystemUID || along < firstAlong))
+		{
+			firstAlong = along;
+			target = m_Entities[entityIndex]->GetUID();
+		}
+	}
+
+	// Scenery before the hit (or anywhere on the line if nothing was hit) stops the shot
+	if (m_ShotScenery && !m_ShotScenery->IsClearExact( shot.start, shot.start + (shot.end - shot.start) * firstAlong ))
+	{
+		target = SystemUID;
+		return true;
+	}
+	return target != SystemUID;
+}
+
+
+/////////////////////////////////////
+// Think scheduling
+
+// Choose the entities that think in the coming update, given the time since the last one
+void CEntityManager::ScheduleThinks( float updateTime )
+{
+	m_ThinkCandidates.clear();
+	for (TUInt32 entity = 0; entity < m_Entities.size(); ++entity)
+	{
+		CEntity* thinker = m_Entities[entity];
+		if (!thinker->m_Thinks)
+		{
+			continue;
+		}
+
+		// Sleepers are woken by their messages during the update (see UpdateChunk), so those with
+		// messages are scheduled now. The rest stay asleep, not thinking, rather than keeping
+		// whatever they were told before they slept
+		thinker->m_Thinking = false;
+		if (thinker->IsAsleep() && !Messenger.HasMessages( thinker->GetUID() ))
+		{
+			continue;
+		}
+		thinker->m_ThinkWait += updateTime;
+
+		// Engaged entities and those near the viewpoint are due on every update
+		TFloat32 interval = 0.0f;
+		if (!thinker->m_Engaged && m_HasThinkViewpoint)
+		{
+			TFloat32 distance = Distance( m_Positions[entity], m_ThinkViewpoint );
+			if (distance > kThinkFarDistance)
+			{
+				interval = kThinkFarInterval;
+			}
+			else if (distance > kThinkMidDistance)
+			{
+				interval = kThinkMidInterval;
+			}
+		}
+		if (thinker->m_ThinkWait >= interval)
+		{
+			SThinkCandidate candidate = { entity, thinker->m_ThinkWait - interval, thinker->m_Engaged };
+			m_ThinkCandidates.push_back( candidate );
+		}
+	}
+
+	// Over budget, only the candidates that go first think
+	if (m_ThinkBudget > 0 && m_ThinkCandidates.size() > m_ThinkBudget)
+	{
+		nth_element( m_ThinkCandidates.begin(), m_ThinkCandidates.begin() + m_ThinkBudget,
+		             m_ThinkCandidates.end(), ThinksBefore );
+		m_ThinkCandidates.resize( m_ThinkBudget );
+	}
+	for (TUInt32 candidate = 0; candidate < m_ThinkCandidates.size(); ++candidate)
+	{
+		CEntity* thinker = m_Entities[m_ThinkCandidates[candidate].entity];
+		thinker->m_Thinking = true;
+		thinker->m_ThinkWait = 0.0f;
+	}
+}
+
+// Return true if the first candidate should think before the second - engaged first, then the
+// longest overdue, then in entity order so the choice is the same however it is sorted
+bool CEntityManager::ThinksBefore( const SThinkCandidate& a, const SThinkCandidate& b )
+{
+	if (a.engaged != b.engaged)
+	{
+		return a.engaged;
+	}
+	if (a.overdue != b.overdue)
+	{
+		return a.overdue > b.overdue;
+	}
+	return a.entity < b.entity;
+}
+
+
+/////////////////////////////////////
+// Transforms / Rendering
+
+// Bring the absolute matrices of all entities up to date with their relative matrices, only
+// recomputing nodes whose relative matrix, or an ancestor's, may have changed
+void CEntityManager::UpdateTransforms()
+{
+	for (TUInt32 name = 0; name < m_TemplateLists.size(); ++name)
+	{
+		// Find the entities of this template with changed matrices
+		const vector<TUInt32>& templateList = m_TemplateLists[name];
+		m_TransformEntities.clear();
+		for (TUInt32 entity = 0; entity < templateList.size(); ++entity)
+		{
+			if (m_Entities[templateList[entity]]->m_DirtyNodes)
+			{
+				m_TransformEntities.push_back( m_Entities[templateList[entity]] );
+			}
+		}
+		if (m_TransformEntities.empty())
+		{
+			continue;
+		}
+
+		// The root node has no parent, its absolute matrix is its relative one
+		for (TUInt32 entity = 0; entity < m_TransformEntities.size(); ++entity)
+		{
+			CEntity* changed = m_TransformEntities[entity];
+			if (changed->m_DirtyNodes & CEntity::NodeBit( 0 ))
+			{
+				changed->m_Matrices[0] = changed->m_RelMatrices[0];
+			}
+		}
+
+		// Mesh nodes come after their parents, so each parent's absolute matrix is ready before its
+		// children's. A node is recomputed if it or its parent changed, marking it as changed in
+		// turn so the change is passed down to its own children
+		CMesh* mesh = m_TransformEntities[0]->Template()->Mesh();
+		TUInt32 numNodes = mesh->GetNumNodes();
+		for (TUInt32 node = 1; node < numNodes; ++node)
+		{
+			TUInt32 parent = mesh->GetNode( node ).parent;
+			TUInt64 changedBits = CEntity::NodeBit( node ) | CEntity::NodeBit( parent );
+			m_TransformRelatives.clear();
+			m_TransformParents.clear();
+			m_TransformResults.clear();
+			for (TUInt32 entity = 0; entity < m_TransformEntities.size(); ++entity)
+			{
+				CEntity* changed = m_TransformEntities[entity];
+				if (changed->m_DirtyNodes & changedBits)
+				{
+					changed->m_DirtyNodes |= CEntity::NodeBit( node );
+					m_TransformRelatives.push_back( &changed->m_RelMatrices[node] );
+					m_TransformParents.push_back( &changed->m_Matrices[parent] );
+					m_TransformResults.push_back( &changed->m_Matrices[node] );
+				}
+			}
+			ComposeMatrices( static_cast<TUInt32>(m_TransformResults.size()), m_TransformRelatives.data(),
+			                 m_TransformParents.data(), m_TransformResults.data() );
+		}
+
+		for (TUInt32 entity = 0; entity < m_TransformEntities.size(); ++entity)
+		{
+			m_TransformEntities[entity]->m_DirtyNodes = 0;
+		}
+	}
+}
+
+
+// Render all entities and projectiles
 void CEntityManager::RenderAllEntities()
 {
 	TEntityIter entity = m_Entities.begin();
@@ -309,6 +1070,7 @@ void CEntityManager::RenderAllEntities()
 		(*entity)->Render();
 		++entity;
 	}
+	m_Projectiles.Render();
 }
 
 
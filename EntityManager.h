@@ -14,15 +14,23 @@ using namespace std;
 #include "CHashTable.h"
 #include "Entity.h"
 #include "TankEntity.h"
-#include "ShellEntity.h"
 #include "CrateEntity.h"
+#include "TransformStore.h"
+#include "EntityPool.h"
+#include "MatrixBatch.h"
+#include "LineOfSight.h"
+#include "SpatialGrid.h"
+#include "ProjectileSystem.h"
+#include "JobSystem.h"
 #include "Camera.h"
 
 namespace gen
 {
 
 // The entity manager is responsible for creation, update, rendering and deletion of
-// entities. It also manages UIDs for entities using a hash table
+// entities. Entities are held in a slot array and referred to by handles (see SEntityHandle),
+// which are resolved with a single array lookup. The manager also manages UIDs for entities,
+// using a hash table from UID to slot
 class CEntityManager
 {
 /////////////////////////////////////
@@ -94,17 +102,25 @@ public:
 		const CVector3& scale = CVector3(1.0f, 1.0f, 1.0f)
 	);
 
-	// Create a shell, requires a shell template name, may supply entity name and position
-	// Returns the UID of the new entity
-	TEntityUID CreateShell
+	// Create a shell fired by the given tank, requires a shell template name, the tank's handle,
+	// team and shell damage, and the shell's position and rotation. The shell travels in the
+	// direction given by the Y rotation and hits tanks on other teams, found with the spatial
+	// grid - there is no friendly fire. Shells are projectiles rather than entities (see
+	// CProjectileSystem) so have no UID.
+	// During an update (see UpdateAllEntities) the shell is created after all entities are updated
+	void CreateShell
 	(
 		const string&   templateName,
-		const string&   name = "",
-		const CVector3& position = CVector3::kOrigin,
-		const CVector3& rotation = CVector3(0.0f, 0.0f, 0.0f),
-		const CVector3& scale = CVector3(1.0f, 1.0f, 1.0f)
+		SEntityHandle   owner,
+		TUInt32         team,
+		TFloat32        damage,
+		const CVector3& position,
+		const CVector3& rotation
 	);
 
+	// Create a crate, requires a crate template name, may supply entity name and position
+	// Returns the UID of the new entity, or SystemUID during an update as above. Sleeping tanks
+	// close enough to pick the crate up are woken so they collect it
 	TEntityUID CreateCrate
 	(
 		const string& templateName,
@@ -113,10 +129,11 @@ public:
 		const CVector3& rotation = CVector3(0.0f, 0.0f, 0.0f),
 		const CVector3& scale = CVector3(1.0f, 1.0f, 1.0f)
 	);
-	// Destroy the given entity - returns true if the entity existed and was destroyed
+	// Destroy the given entity - returns true if the entity existed and was destroyed. During an
+	// update the entity is destroyed after all entities are updated
 	bool DestroyEntity( TEntityUID UID );
 
-	// Destroy all entities held by the manager
+	// Destroy all entities and projectiles held by the manager
 	void DestroyAllEntities();
 
 
@@ -137,29 +154,105 @@ public:
 	}
 
 
+	// Return the ID for a template type or template name, or kNoTemplateID if no template has
+	// been created with it. Look IDs up once, then use them in place of strings in loops
+	TUInt32 FindTemplateTypeID( const string& type )
+	{
+		TIDIter typeID = m_TypeIDs.find( type );
+		return typeID != m_TypeIDs.end() ? typeID->second : kNoTemplateID;
+	}
+	TUInt32 FindTemplateNameID( const string& name )
+	{
+		TIDIter nameID = m_TemplateNameIDs.find( name );
+		return nameID != m_TemplateNameIDs.end() ? nameID->second : kNoTemplateID;
+	}
+
+
 	// Return the number of entities
 	TUInt32 NumEntities() 
 	{
 		return static_cast<TUInt32>(m_Entities.size());
 	}
 
+	// Return the number of entities whose template has the given type ID, and the entity index
+	// (for GetEntityAtIndex / GetEntityPosition) of one of them. Visits only entities of that type
+	TUInt32 NumEntitiesOfType( TUInt32 typeID )
+	{
+		return typeID < m_TypeLists.size() ? static_cast<TUInt32>(m_TypeLists[typeID].size()) : 0;
+	}
+	TUInt32 GetIndexOfType( TUInt32 typeID, TUInt32 n )
+	{
+		return m_TypeLists[typeID][n];
+	}
+
+	// Return the number of entities using the template with the given name ID, and the entity
+	// index of one of them
+	TUInt32 NumEntitiesOfTemplate( TUInt32 nameID )
+	{
+		return nameID < m_TemplateLists.size() ? static_cast<TUInt32>(m_TemplateLists[nameID].size()) : 0;
+	}
+	TUInt32 GetIndexOfTemplate( TUInt32 nameID, TUInt32 n )
+	{
+		return m_TemplateLists[nameID][n];
+	}
+
 	// Return the entities at the given array index
 	CEntity* GetEntityAtIndex( TUInt32 index )
 	{
 		return m_Entities[index];
 	}
 
+	// Return the position of the entity at the given array index. Positions are copied into a
+	// packed array at the end of each UpdateAllEntities, so sweeps over many entities read them
+	// linearly rather than visiting each entity's matrices. An entity moved since then (e.g.
+	// during an update) is not reflected until the next copy
+	const CVector3& GetEntityPosition( TUInt32 index )
+	{
+		return m_Positions[index];
+	}
+
+	// Return the packed position of the entity with the given handle, which must not be stale.
+	// Entities should read other entities' positions this way during their update - the packed
+	// positions do not change until all entities are updated
+	const CVector3& GetEntityPosition( SEntityHandle handle )
+	{
+		return m_Positions[m_Slots[handle.slot].index];
+	}
+
+	// Return the entity with the given handle, or 0 if it has been destroyed
+	CEntity* GetEntity( SEntityHandle handle )
+	{
+		// A stale handle's generation no longer matches its slot
+		if (handle.slot >= m_Slots.size() || m_Slots[handle.slot].generation != handle.generation)
+		{
+			return 0;
+		}
+		return m_Slots[handle.slot].entity;
+	}
+
+	// Return the handle of the entity with the given UID, or NullEntityHandle if there is none
+	SEntityHandle GetHandle( TEntityUID UID )
+	{
+		// Find the entity UID in the entity hash map
+		TUInt32 slot;
+		if (!m_EntityUIDMap->LookUpKey( UID, &slot ))
+		{
+			return NullEntityHandle;
+		}
+		SEntityHandle handle = { slot, m_Slots[slot].generation };
+		return handle;
+	}
+
 	// Return the entity with the given UID
 	CEntity* GetEntity( TEntityUID UID )
 	{
 		// Find the entity UID in the entity hash map
-		TUInt32 entityIndex;
-
-		if (!m_EntityUIDMap->LookUpKey( UID, &entityIndex ))
+		TUInt32 slot;
+		if (!m_EntityUIDMap->LookUpKey( UID, &slot ))
 		{
 			return 0;
 		}
-		return m_Entities[entityIndex];
+		return m_Slots[slot].entity;
 	}
 
 	// Return the entity with the given name & optionally the given template name & type
@@ -234,16 +327,313 @@ public:
 
 	// Call all entity update functions - not the ideal method, OK for this example
 	// Pass the time since last update
+	// Entities are updated in chunks. Entities destroyed, and shells and crates created, during
+	// the update are recorded in a command list for each chunk and destroyed / created together
+	// once all chunks are done, in chunk order, so the entity list does not change during the
+	// update. Tank behaviour is then updated in one pass per tank state (see Tank states below).
+	// Messages sent in each pass are delivered in pass then chunk order (see Send order in
+	// Messenger.h), so the result is the same however many threads are used. Projectiles are
+	// moved after the entities (see Projectiles below)
 	void UpdateAllEntities( float updateTime );
 
-	// Render all entities - not the ideal method, OK for this example
+	// Set the number of threads entities are updated on. 1 (the default) updates the chunks in
+	// order on the calling thread, 0 uses one thread per hardware thread. Ignored unless the
+	// messenger is thread-safe (see GEN_MESSENGER_THREAD_SAFE)
+	// With several threads, the chunks are updated on a job system. Entities must not change
+	// other entities during their update, they should send them messages instead
+	void SetUpdateThreads( TUInt32 numThreads );
+
+	// Set the greatest number of entities that think in each update (see CEntity::IsThinking), 0
+	// (the default) for no limit. Entities due to think beyond the budget wait for a later update,
+	// engaged entities go first then those that have waited longest
+	void SetThinkBudget( TUInt32 maxThinks )
+	{
+		m_ThinkBudget = maxThinks;
+	}
+
+	// Set the point entities' think rates depend on, usually the active camera's position. Entities
+	// near it think on every update and those further away less often (see kThinkFarDistance etc.)
+	// Until a viewpoint is set all entities think on every update
+	void SetThinkViewpoint( const CVector3& viewpoint )
+	{
+		m_ThinkViewpoint = viewpoint;
+		m_HasThinkViewpoint = true;
+	}
+
+	// Bring the absolute matrices of all entities up to date with their relative matrices. Call
+	// after entities are updated and before they are rendered. Only nodes whose relative matrix,
+	// or an ancestor's, may have changed are recomputed (see CEntity::Matrix), so scenery that
+	// never moves costs nothing. Entities of one template share a mesh hierarchy, so their
+	// matrices are composed together a node at a time
+	void UpdateTransforms();
+
+	// Render all entities and projectiles - not the ideal method, OK for this example
 	void RenderAllEntities();
 
+
+	/////////////////////////////////////
+	// Proximity queries
+
+	// Add handles of entities matching the filter within the given distance of a point to the
+	// given list. Uses the spatial grid, whose positions are updated with the packed positions at
+	// the end of each UpdateAllEntities (see GetEntityPosition)
+	void QueryRadius( const CVector3& centre, TFloat32 radius, const SGridFilter& filter,
+	                  vector<SEntityHandle>& found )
+	{
+		m_Grid.QueryRadius( centre, radius, filter, found );
+	}
+
+	// Add handles of entities matching the filter inside the given axis-aligned box to the given
+	// list. Uses the spatial grid, see above
+	void QueryBox( const CVector3& minBounds, const CVector3& maxBounds, const SGridFilter& filter,
+	               vector<SEntityHandle>& found )
+	{
+		m_Grid.QueryBox( minBounds, maxBounds, filter, found );
+	}
+
+
+	/////////////////////////////////////
+	// Tank states
+
+	// The manager keeps a list of the tanks in each state (see CTankEntity::EState). After the
+	// entity update, which reads the tanks' messages, each list is updated in its own pass with
+	// the state's update function (see CTankEntity::UpdateStates), split into chunks as above. A
+	// state change made during an update takes effect after the update or pass it was made in, so
+	// a tank that changes state while reading its messages runs its new state in the same frame.
+	// A tank runs only one state update each frame, one that changes state in a pass runs its new
+	// state from the next frame, even if that state's pass is still to come
+
+	// Return the number of tanks in the given state
+	TUInt32 NumTanksInState( TUInt32 state )
+	{
+		return static_cast<TUInt32>(m_TankStates[state].size());
+	}
+
+	// Return the time in seconds taken by the given state's pass in the last update
+	TFloat32 GetTankStateTime( TUInt32 state )
+	{
+		return m_TankStateTimes[state];
+	}
+
+	// Move the given tank to the given state's list. During an update the change is recorded and
+	// made after the update or state pass
+	void ChangeTankState( CTankEntity* tank, TUInt32 state );
+
+
+	/////////////////////////////////////
+	// Projectiles
+
+	// Projectiles (shells) are held in a projectile system rather than the entity list. At the
+	// end of each UpdateAllEntities, expired projectiles are removed, then each projectile's
+	// movement over the frame is tested as a shot. A shot hits the first entity matching the
+	// projectile's targets whose position comes within the hit radius of the line it moves along,
+	// unless scenery is in the way. Testing the whole line means fast projectiles can't pass
+	// through targets between frames. The targets hit are sent Msg_Hit (from the projectile's
+	// owner) and the projectiles removed
+
+	// Return the number of projectiles
+	TUInt32 NumProjectiles()
+	{
+		return m_Projectiles.NumProjectiles();
+	}
+
+	// Set the scenery that stops shots, 0 (the default) for none
+	void SetShotScenery( CLineOfSight* scenery )
+	{
+		m_ShotScenery = scenery;
+	}
+
+
+	/////////////////////////////////////
+	// Memory
+
+	// Return the store holding all entity matrices
+	CTransformStore& Transforms()
+	{
+		return m_Transforms;
+	}
+
+	// Return the pools tanks and crates are allocated from (see their operator new)
+	CEntityPool& TankPool()
+	{
+		return m_TankPool;
+	}
+	CEntityPool& CratePool()
+	{
+		return m_CratePool;
+	}
+
 		
 /////////////////////////////////////
 //	Private interface
 private:
 
+	// Add a newly created entity to the entity list and spatial grid and give it a slot and
+	// handle. The entity must have been created with the next UID, which is returned
+	TEntityUID AddEntity( CEntity* newEntity, TUInt32 team = kNoTeam );
+
+	// Give a new template IDs for its type and name, adding entity lists for any new type or name
+	void InternTemplate( CEntityTemplate* newTemplate );
+
+	// Remove the entity in the given slot from the spatial grid, messenger and UID map, delete
+	// it and free the slot. The entity, type and template lists are not changed
+	void FreeEntity( TUInt32 slot );
+
+
+	/////////////////////////////////////
+	// Update commands
+
+	// Number of entities in each update chunk (each job in a parallel update)
+	static const TUInt32 kUpdateChunkSize = 32;
+
+	// Kinds of entity that can be created during an update
+	enum ECreateKind
+	{
+		Create_Crate
+	};
+
+	// An entity to create after an update
+	struct SCreateCommand
+	{
+		ECreateKind kind;
+		string      templateName;
+		string      name;
+		CVector3    position;
+		CVector3    rotation;
+		CVector3    scale;
+	};
+
+	// A shell to add to the projectiles after an update
+	struct SShellCommand
+	{
+		CEntityTemplate* shellTemplate;
+		SEntityHandle    owner;
+		TFloat32         damage;
+		SGridFilter      targets;
+		CVector3         position;
+		CVector3         velocity;
+	};
+
+	// A tank state change to make after an update
+	struct SStateChange
+	{
+		CTankEntity* tank;
+		TUInt32      state;
+	};
+
+	// Entities to create and destroy, shells to add and tank state changes to make after an
+	// update, recorded by one chunk
+	struct SEntityCommands
+	{
+		vector<SCreateCommand> creates;
+		vector<TEntityUID>     destroys;
+		vector<SShellCommand>  shells;
+		vector<SStateChange>   stateChanges;
+	};
+
+	// Return the command list for the chunk being updated on the calling thread, or 0 if there
+	// is no update on this thread
+	static SEntityCommands*& ThreadCommands();
+
+	// Record an entity to create if there is an update on the calling thread. Returns false if
+	// the entity should be created immediately
+	bool RecordCreate( ECreateKind kind, const string& templateName, const string& name,
+	                   const CVector3& position, const CVector3& rotation, const CVector3& scale );
+
+	// Update the given chunk of entities, recording entities to destroy in its command list
+	void UpdateChunk( TUInt32 chunk, float updateTime );
+
+	// Apply the command lists of the given number of chunks, in chunk order. All destroys are
+	// done before any creates
+	void ApplyCommands( TUInt32 numChunks );
+
+	// Add a shell described by a shell command to the projectiles
+	void AddShell( const SShellCommand& shell );
+
+	// Close the gaps left in the entity list by entities freed by ApplyCommands, keeping the order
+	// of the remaining entities, and rebuild the type and template lists to match
+	void CompactEntities();
+
+
+	/////////////////////////////////////
+	// Think scheduling
+
+	// Distances from the think viewpoint beyond which entities think less often, and the longest
+	// time they go without thinking. Nearer entities, and engaged ones, think on every update
+	static constexpr TFloat32 kThinkMidDistance = 60.0f;
+	static constexpr TFloat32 kThinkMidInterval = 0.1f;
+	static constexpr TFloat32 kThinkFarDistance = 150.0f;
+	static constexpr TFloat32 kThinkFarInterval = 0.5f;
+
+	// An entity due to think and how long it is overdue
+	struct SThinkCandidate
+	{
+		TUInt32  entity;
+		TFloat32 overdue;
+		bool     engaged;
+	};
+
+	// Choose the entities that think in the coming update, given the time since the last one
+	void ScheduleThinks( float updateTime );
+
+	// Return true if the first candidate should think before the second - engaged first, then the
+	// longest overdue, then in entity order so the choice is the same however it is sorted
+	static bool ThinksBefore( const SThinkCandidate& a, const SThinkCandidate& b );
+
+
+	/////////////////////////////////////
+	// Tank state update
+
+	// Position in a state list of entities that are not tanks
+	static const TUInt32 kNoStatePos = 0xffffffff;
+
+	// Move the given tank from its state's list to the given state's list
+	void SetTankState( CTankEntity* tank, TUInt32 state );
+
+	// Remove the given tank from its state's list
+	void RemoveTankState( CTankEntity* tank );
+
+	// Make the tank state changes recorded by the given number of chunks, in chunk order
+	void ApplyStateChanges( TUInt32 numChunks );
+
+	// Update each state's list of tanks in turn, timing each pass, and make the state changes
+	// recorded in each pass before the next. Returns the number of chunks used, whose command
+	// lists need applying
+	TUInt32 UpdateTankStates( float updateTime );
+
+	// Update the given chunk of the given state's list of tanks, recording commands in the chunk's
+	// command list
+	void UpdateStateChunk( TUInt32 state, TUInt32 chunk, float updateTime );
+
+
+	/////////////////////////////////////
+	// Projectile update
+
+	// A shot is a projectile's movement over one frame
+	struct SShot
+	{
+		SEntityHandle owner;     // Never hit by its own projectiles
+		CVector3      start;
+		CVector3      end;
+		TFloat32      hitRadius; // Projectile radius plus target radius
+		SGridFilter   targets;
+	};
+
+	// A shot's result - the index of the projectile and the target it hit, SystemUID if it hit
+	// scenery
+	struct SShotHit
+	{
+		TUInt32    projectile;
+		TEntityUID target;
+	};
+
+	// Remove expired projectiles, test the movement of the rest over the given time as shots,
+	// move them, then send the hits and remove the projectiles that hit something
+	void UpdateProjectiles( float updateTime );
+
+	// Find what a shot hits first, returns false if it hits nothing
+	bool FindShotHit( const SShot& shot, TEntityUID& target );
+
 	/////////////////////////////////////
 	// Types
 
@@ -255,6 +645,10 @@ private:
 	typedef vector<CEntity*> TEntities;
 	typedef TEntities::iterator TEntityIter;
 
+	// Template types and names are interned with maps from string to ID
+	typedef map<string, TUInt32> TIDs;
+	typedef TIDs::iterator TIDIter;
+
 
 	/////////////////////////////////////
 	// Template Data
@@ -262,18 +656,94 @@ private:
 	// The map of template names / templates
 	TTemplates m_Templates;
 
+	// Interned template types and names
+	TIDs m_TypeIDs;
+	TIDs m_TemplateNameIDs;
+
+	// Type ID of tank templates, which shells hit. Set when the first tank template is created,
+	// IDs are never removed
+	TUInt32 m_TankTypeID;
+
 
 	/////////////////////////////////////
 	// Entity Data
 
 	// The main list of entities. This vector is kept packed - i.e. with no gaps. If an
 	// entity is removed from the middle of the list, the last entity is moved down to
-	// fill its space
+	// fill its space. Entities destroyed during an update are removed together afterwards,
+	// moving the remaining entities down in one pass
 	TEntities m_Entities;
 
-	// A mapping from UIDs to indexes into the above array
+	// Slot array - a slot holds an entity, its index in the list above and its positions in its
+	// type and template lists below. When the entity is destroyed the slot's generation is
+	// increased and the slot is put on the free list
+	struct SEntitySlot
+	{
+		CEntity* entity;
+		TUInt32  generation;
+		TUInt32  index;
+		TUInt32  typePos;
+		TUInt32  templatePos;
+		TUInt32  statePos; // Position in its state's list, kNoStatePos if not a tank
+	};
+	vector<SEntitySlot> m_Slots;
+	vector<TUInt32>     m_FreeSlots;
+
+	// A mapping from UIDs to slots
 	CHashTable<TEntityUID, TUInt32>* m_EntityUIDMap;
 
+	// Storage for entity matrices and the packed positions of the entities in the list above
+	CTransformStore  m_Transforms;
+	vector<CVector3> m_Positions;
+
+	// Working lists for the transform update, kept to reuse their memory
+	vector<CEntity*>          m_TransformEntities;
+	vector<const CMatrix4x4*> m_TransformRelatives;
+	vector<const CMatrix4x4*> m_TransformParents;
+	vector<CMatrix4x4*>       m_TransformResults;
+
+	// Pools for the entity classes created during play
+	CEntityPool m_TankPool;
+	CEntityPool m_CratePool;
+
+	// Entity indexes for each template type and for each template, indexed by type/name ID.
+	// Kept packed like the main list
+	vector< vector<TUInt32> > m_TypeLists;
+	vector< vector<TUInt32> > m_TemplateLists;
+
+	// Spatial grid of all entities for proximity queries
+	CSpatialGrid m_Grid;
+
+	// Job system for parallel updates (0 to update on the calling thread) and the command list
+	// for each chunk
+	CJobSystem*             m_Jobs;
+	vector<SEntityCommands> m_ChunkCommands;
+
+	// Projectiles, the scenery that stops their shots, and working lists for testing shots, kept
+	// to reuse their memory
+	CProjectileSystem     m_Projectiles;
+	CLineOfSight*         m_ShotScenery;
+	vector<SEntityHandle> m_ShotCandidates;
+	vector<SShotHit>      m_ShotHits;
+
+	// Working list of the tanks near a new crate, kept to reuse its memory
+	vector<SEntityHandle> m_CrateTanks;
+
+	// Think budget and viewpoint, and the working list of candidates, kept to reuse its memory
+	TUInt32                 m_ThinkBudget;
+	CVector3                m_ThinkViewpoint;
+	bool                    m_HasThinkViewpoint;
+	vector<SThinkCandidate> m_ThinkCandidates;
+
+	// The tanks in each state and the time taken by each state's pass in the last update, indexed
+	// by state
+	vector< vector<CTankEntity*> > m_TankStates;
+	vector<TFloat32>               m_TankStateTimes;
+
+	// Count of updates that ran the state passes. Tanks record the count when their state is
+	// updated, so a tank moved to a later pass is not updated twice in one update
+	TUInt32 m_StateFrame;
+
 	// Entity IDs are provided using a single increasing integer
 	TEntityUID m_NextUID;
 
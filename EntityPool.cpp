@@ -0,0 +1,126 @@
+/*******************************************
+	EntityPool.cpp
+
+	Fixed-size block pools for entities
+********************************************/
+
+#include <cstdlib>
+#include <new>
+#include <atomic>
+using namespace std;
+
+#include "EntityPool.h"
+
+namespace gen
+{
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Constructor sets the size of the blocks, no slabs are allocated until needed
+CEntityPool::CEntityPool( size_t blockSize )
+{
+	if (blockSize < sizeof(SFreeBlock))
+	{
+		blockSize = sizeof(SFreeBlock);
+	}
+	m_BlockSize = (blockSize + kAlignment - 1) & ~(kAlignment - 1);
+	m_FreeList = 0;
+}
+
+// Destructor releases all slabs, all blocks must have been freed
+CEntityPool::~CEntityPool()
+{
+	for (TUInt32 slab = 0; slab < m_Slabs.size(); ++slab)
+	{
+		delete[] m_Slabs[slab];
+	}
+}
+
+
+/////////////////////////////////////
+// Public interface
+
+// Return a block for an object of the given size
+void* CEntityPool::Allocate( size_t size )
+{
+	if (size > m_BlockSize)
+	{
+		return ::operator new( size );
+	}
+
+	// Add a new slab when all blocks are in use. Its blocks are put on the free list in reverse so
+	// they are handed out in address order
+	if (!m_FreeList)
+	{
+		char* slab = new char[kBlocksPerSlab * m_BlockSize];
+		m_Slabs.push_back( slab );
+		for (TUInt32 block = kBlocksPerSlab; block > 0; --block)
+		{
+			SFreeBlock* freeBlock = reinterpret_cast<SFreeBlock*>(slab + (block - 1) * m_BlockSize);
+			freeBlock->next = m_FreeList;
+			m_FreeList = freeBlock;
+		}
+	}
+
+	SFreeBlock* block = m_FreeList;
+	m_FreeList = block->next;
+	return block;
+}
+
+// Return a block from Allocate to the pool, passing the same size
+void CEntityPool::Free( void* block, size_t size )
+{
+	if (!block)
+	{
+		return;
+	}
+	if (size > m_BlockSize)
+	{
+		::operator delete( block );
+		return;
+	}
+
+	SFreeBlock* freeBlock = static_cast<SFreeBlock*>(block);
+	freeBlock->next = m_FreeList;
+	m_FreeList = freeBlock;
+}
+
+
+#if GEN_COUNT_ALLOCATIONS
+/////////////////////////////////////
+// Allocation counting
+
+// Number of calls to the global operator new
+static atomic<TUInt64> NumHeapAllocations( 0 );
+
+// Return the number of general heap allocations made so far, on all threads
+TUInt64 GetNumHeapAllocations()
+{
+	return NumHeapAllocations.load();
+}
+#endif
+
+
+} // namespace gen
+
+
+#if GEN_COUNT_ALLOCATIONS
+// Replacement global operator new and delete, counting allocations. The array forms and the
+// sized delete call these
+void* operator new( size_t size )
+{
+	++gen::NumHeapAllocations;
+	void* memory = malloc( size ? size : 1 );
+	if (!memory)
+	{
+		throw bad_alloc();
+	}
+	return memory;
+}
+
+void operator delete( void* memory ) noexcept
+{
+	free( memory );
+}
+#endif
@@ -0,0 +1,94 @@
+/*******************************************
+	EntityPool.h
+
+	Fixed-size block pools for entities
+********************************************/
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+using namespace std;
+
+#include "Defines.h"
+
+// Set to 1 to count general heap allocations (global operator new), to check that creating and
+// destroying entities makes no heap allocations once the pools and buffers have warmed up (see
+// GetNumHeapAllocations). Replaces the global operator new and delete, so leave at 0 normally
+#ifndef GEN_COUNT_ALLOCATIONS
+#define GEN_COUNT_ALLOCATIONS 0
+#endif
+
+namespace gen
+{
+
+#if GEN_COUNT_ALLOCATIONS
+// Return the number of general heap allocations made so far, on all threads
+TUInt64 GetNumHeapAllocations();
+#endif
+
+
+// An entity pool hands out blocks of one size for entities of one class, taken from slabs of
+// blocks rather than from the general heap. Freed blocks go on a free list and are reused by the
+// next entity, so creating and destroying entities only allocates when every slab is in use
+// Entity classes use a pool through their own operator new and delete. Objects larger than the
+// block size (from a derived class) are passed on to the general heap. Pools are not thread-safe,
+// entities must be created and destroyed on one thread at a time
+class CEntityPool
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Constructor sets the size of the blocks, no slabs are allocated until needed
+	CEntityPool( size_t blockSize );
+
+	// Destructor releases all slabs, all blocks must have been freed
+	~CEntityPool();
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CEntityPool( const CEntityPool& );
+	CEntityPool& operator=( const CEntityPool& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	// Return a block for an object of the given size
+	void* Allocate( size_t size );
+
+	// Return a block from Allocate to the pool, passing the same size
+	void Free( void* block, size_t size );
+
+	// Return the number of slabs allocated
+	TUInt32 NumSlabs()
+	{
+		return static_cast<TUInt32>(m_Slabs.size());
+	}
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Number of blocks in each slab, and block alignment (as general heap allocations)
+	static const TUInt32 kBlocksPerSlab = 64;
+	static const size_t kAlignment = 16;
+
+	// A free block holds the next block in the free list
+	struct SFreeBlock
+	{
+		SFreeBlock* next;
+	};
+
+	// Block size, rounded up to the alignment
+	size_t m_BlockSize;
+
+	// Slabs of blocks and the list of free blocks in them
+	vector<char*> m_Slabs;
+	SFreeBlock*   m_FreeList;
+};
+
+
+} // namespace gen
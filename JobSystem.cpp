@@ -0,0 +1,171 @@
+/*******************************************
+	JobSystem.cpp
+
+	Work-stealing thread pool for running
+	independent jobs in parallel
+********************************************/
+
+#include "JobSystem.h"
+
+namespace gen
+{
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Constructor starts the given number of threads in total, including the calling thread (so
+// one less worker is started). Pass 0 for one thread per hardware thread
+CJobSystem::CJobSystem( TUInt32 numThreads /*= 0*/ ) : m_Run( 0 ), m_NumUnfinished( 0 ), m_Batch( 0 ), m_Quit( false )
+{
+	if (numThreads == 0)
+	{
+		numThreads = thread::hardware_concurrency();
+	}
+	if (numThreads == 0)
+	{
+		numThreads = 1;
+	}
+
+	for (TUInt32 queue = 0; queue < numThreads; ++queue)
+	{
+		m_Queues.push_back( new SJobQueue );
+	}
+	for (TUInt32 worker = 1; worker < numThreads; ++worker)
+	{
+		m_Workers.push_back( thread( &CJobSystem::WorkerMain, this, worker ) );
+	}
+}
+
+// Destructor stops the worker threads
+CJobSystem::~CJobSystem()
+{
+	{
+		lock_guard<mutex> lock( m_BatchLock );
+		m_Quit = true;
+	}
+	m_BatchStarted.notify_all();
+	for (TUInt32 worker = 0; worker < m_Workers.size(); ++worker)
+	{
+		m_Workers[worker].join();
+	}
+	for (TUInt32 queue = 0; queue < m_Queues.size(); ++queue)
+	{
+		delete m_Queues[queue];
+	}
+}
+
+
+/////////////////////////////////////
+// Public interface
+
+// Run the given function for each job number from 0 to numJobs - 1, spread over all threads.
+// Returns when all the jobs have finished
+void CJobSystem::ParallelFor( TUInt32 numJobs, const function<void( TUInt32 job )>& run )
+{
+	if (numJobs == 0)
+	{
+		return;
+	}
+
+	// Without workers, or with a single job, run on this thread
+	if (m_Workers.empty() || numJobs == 1)
+	{
+		for (TUInt32 job = 0; job < numJobs; ++job)
+		{
+			run( job );
+		}
+		return;
+	}
+
+	// Give each thread a run of neighbouring jobs, they are likely to use neighbouring data
+	m_Run = &run;
+	m_NumUnfinished = numJobs;
+	TUInt32 numThreads = NumThreads();
+	for (TUInt32 queue = 0; queue < numThreads; ++queue)
+	{
+		lock_guard<mutex> lock( m_Queues[queue]->lock );
+		m_Queues[queue]->first = numJobs * queue / numThreads;
+		m_Queues[queue]->end = numJobs * (queue + 1) / numThreads;
+	}
+
+	// Wake the workers and join in
+	{
+		lock_guard<mutex> lock( m_BatchLock );
+		++m_Batch;
+	}
+	m_BatchStarted.notify_all();
+	RunJobs( 0 );
+
+	// Jobs taken by other threads may still be running
+	while (m_NumUnfinished.load() != 0)
+	{
+		this_thread::yield();
+	}
+}
+
+
+/////////////////////////////////////
+// Private interface
+
+// Main function for worker threads
+void CJobSystem::WorkerMain( TUInt32 thread )
+{
+	TUInt32 batch = 0;
+	while (true)
+	{
+		// Sleep until a batch starts
+		{
+			unique_lock<mutex> lock( m_BatchLock );
+			m_BatchStarted.wait( lock, [&]() { return m_Quit || m_Batch != batch; } );
+			if (m_Quit)
+			{
+				return;
+			}
+			batch = m_Batch;
+		}
+		RunJobs( thread );
+	}
+}
+
+// Run jobs from the given thread's queue, then stolen from other queues, until none are left
+void CJobSystem::RunJobs( TUInt32 thread )
+{
+	TUInt32 job;
+	while (TakeJob( thread, job ))
+	{
+		(*m_Run)( job );
+		--m_NumUnfinished;
+	}
+}
+
+// Take a job for the given thread, returning false if there are none left in any queue
+bool CJobSystem::TakeJob( TUInt32 thread, TUInt32& job )
+{
+	// Own queue first, from the back
+	{
+		SJobQueue& queue = *m_Queues[thread];
+		lock_guard<mutex> lock( queue.lock );
+		if (queue.first != queue.end)
+		{
+			job = --queue.end;
+			return true;
+		}
+	}
+
+	// Then steal from the front of the other queues, starting with the next thread along
+	TUInt32 numThreads = NumThreads();
+	for (TUInt32 offset = 1; offset < numThreads; ++offset)
+	{
+		SJobQueue& queue = *m_Queues[(thread + offset) % numThreads];
+		lock_guard<mutex> lock( queue.lock );
+		if (queue.first != queue.end)
+		{
+			job = queue.first++;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+} // namespace gen
@@ -0,0 +1,101 @@
+/*******************************************
+	JobSystem.h
+
+	Work-stealing thread pool for running
+	independent jobs in parallel
+********************************************/
+
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+using namespace std;
+
+#include "Defines.h"
+
+namespace gen
+{
+
+// The job system runs a batch of numbered jobs on a pool of worker threads and waits for them
+// all to finish. The calling thread works on the batch too. The jobs of a batch are shared out
+// between the threads' own queues; a thread takes jobs from the back of its own queue and, when
+// that is empty, steals from the front of another thread's queue, so threads that finish early
+// take work from those still busy
+// Jobs in a batch must be independent of each other. There is no ordering between them
+class CJobSystem
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Constructor starts the given number of threads in total, including the calling thread (so
+	// one less worker is started). Pass 0 for one thread per hardware thread
+	CJobSystem( TUInt32 numThreads = 0 );
+
+	// Destructor stops the worker threads
+	~CJobSystem();
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CJobSystem( const CJobSystem& );
+	CJobSystem& operator=( const CJobSystem& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	// Return the number of threads that run jobs, including the calling thread
+	TUInt32 NumThreads()
+	{
+		return static_cast<TUInt32>(m_Queues.size());
+	}
+
+	// Run the given function for each job number from 0 to numJobs - 1, spread over all threads.
+	// Returns when all the jobs have finished. Must be called from the thread that created the
+	// job system and not from inside a job
+	void ParallelFor( TUInt32 numJobs, const function<void( TUInt32 job )>& run );
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// A thread's queue of job numbers, a run of neighbouring jobs from first up to end
+	struct SJobQueue
+	{
+		SJobQueue() : first( 0 ), end( 0 ) {}
+
+		mutex   lock;
+		TUInt32 first;
+		TUInt32 end;
+	};
+
+	// Main function for worker threads
+	void WorkerMain( TUInt32 thread );
+
+	// Run jobs from the given thread's queue, then stolen from other queues, until none are left
+	void RunJobs( TUInt32 thread );
+
+	// Take a job for the given thread, returning false if there are none left in any queue
+	bool TakeJob( TUInt32 thread, TUInt32& job );
+
+	// One queue per thread, the calling thread uses queue 0
+	vector<SJobQueue*> m_Queues;
+	vector<thread>     m_Workers;
+
+	// The current batch - its function (the caller's, which waits for the batch), the number of
+	// jobs not yet finished and a count of batches started, which wakes the workers
+	const function<void( TUInt32 job )>* m_Run;
+	atomic<TUInt32>               m_NumUnfinished;
+	TUInt32                       m_Batch;
+	bool                          m_Quit;
+	mutex                         m_BatchLock;
+	condition_variable            m_BatchStarted;
+};
+
+
+} // namespace gen
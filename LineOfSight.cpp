@@ -0,0 +1,304 @@
+/*******************************************
+	LineOfSight.cpp
+
+	Line of sight tests against static
+	scenery
+********************************************/
+
+#include <algorithm>
+#include <atomic>
+using namespace std;
+
+#include "LineOfSight.h"
+
+namespace gen
+{
+
+// Grid cell size and cache cell size in world units
+const TFloat32 CLineOfSight::kCellSize = 8.0f;
+const TFloat32 CLineOfSight::kCacheCellSize = 2.0f;
+
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Default constructor, there are no occluders
+CLineOfSight::CLineOfSight()
+{
+	Bake();
+}
+
+
+/////////////////////////////////////
+// Occluders
+
+// Add an occluder with the given centre and radius (only X and Z are used)
+void CLineOfSight::AddOccluder( const CVector3& centre, TFloat32 radius )
+{
+	SOccluder occluder = { centre.x, centre.z, radius };
+	m_Occluders.push_back( occluder );
+}
+
+// Remove all occluders, tests then find every line clear
+void CLineOfSight::Clear()
+{
+	m_Occluders.clear();
+	Bake();
+}
+
+
+// Bake the occluders into the grid used by tests. Call after adding occluders, before testing
+void CLineOfSight::Bake()
+{
+	// A new version invalidates every thread's cached results
+	m_Version = NewVersion();
+	m_CellStart.clear();
+	m_CellOccluders.clear();
+	if (m_Occluders.empty())
+	{
+		m_NumCellsX = m_NumCellsZ = 0;
+		return;
+	}
+
+	// Grid covers the bounds of all occluders
+	m_MinX = m_Occluders[0].x - m_Occluders[0].radius;
+	m_MinZ = m_Occluders[0].z - m_Occluders[0].radius;
+	TFloat32 maxX = m_Occluders[0].x + m_Occluders[0].radius;
+	TFloat32 maxZ = m_Occluders[0].z + m_Occluders[0].radius;
+	for (TUInt32 occluder = 1; occluder < m_Occluders.size(); ++occluder)
+	{
+		const SOccluder& o = m_Occluders[occluder];
+		m_MinX = min( m_MinX, o.x - o.radius );
+		m_MinZ = min( m_MinZ, o.z - o.radius );
+		maxX = max( maxX, o.x + o.radius );
+		maxZ = max( maxZ, o.z + o.radius );
+	}
+	m_NumCellsX = static_cast<TInt32>(floor( (maxX - m_MinX) / kCellSize )) + 1;
+	m_NumCellsZ = static_cast<TInt32>(floor( (maxZ - m_MinZ) / kCellSize )) + 1;
+
+	// Count the occluders overlapping each cell, then place them - two passes so the lists can
+	// be packed into one array
+	m_CellStart.resize( m_NumCellsX * m_NumCellsZ + 1, 0 );
+	for (TUInt32 pass = 0; pass < 2; ++pass)
+	{
+		for (TUInt32 occluder = 0; occluder < m_Occluders.size(); ++occluder)
+		{
+			const SOccluder& o = m_Occluders[occluder];
+			TInt32 minCellX = static_cast<TInt32>((o.x - o.radius - m_MinX) / kCellSize);
+			TInt32 maxCellX = min( static_cast<TInt32>((o.x + o.radius - m_MinX) / kCellSize), m_NumCellsX - 1 );
+			TInt32 minCellZ = static_cast<TInt32>((o.z - o.radius - m_MinZ) / kCellSize);
+			TInt32 maxCellZ = min( static_cast<TInt32>((o.z + o.radius - m_MinZ) / kCellSize), m_NumCellsZ - 1 );
+			for (TInt32 cellZ = minCellZ; cellZ <= maxCellZ; ++cellZ)
+			{
+				for (TInt32 cellX = minCellX; cellX <= maxCellX; ++cellX)
+				{
+					TUInt32 cell = cellZ * m_NumCellsX + cellX;
+					if (pass == 0)
+					{
+						++m_CellStart[cell + 1];
+					}
+					else
+					{
+						m_CellOccluders[m_CellStart[cell]++] = occluder;
+					}
+				}
+			}
+		}
+
+		if (pass == 0)
+		{
+			// Turn counts into the start of each cell's list
+			for (TUInt32 cell = 1; cell < m_CellStart.size(); ++cell)
+			{
+				m_CellStart[cell] += m_CellStart[cell - 1];
+			}
+			m_CellOccluders.resize( m_CellStart.back() );
+		}
+	}
+
+	// Placing moved each start on to the next cell's start, move them back
+	for (TUInt32 cell = static_cast<TUInt32>(m_CellStart.size()) - 1; cell > 0; --cell)
+	{
+		m_CellStart[cell] = m_CellStart[cell - 1];
+	}
+	m_CellStart[0] = 0;
+}
+
+
+/////////////////////////////////////
+// Tests
+
+// Return true if no occluder crosses the line between the two points
+bool CLineOfSight::IsClear( const CVector3& from, const CVector3& to )
+{
+	TInt32 fromCellX = CacheCellCoord( from.x );
+	TInt32 fromCellZ = CacheCellCoord( from.z );
+	TInt32 toCellX = CacheCellCoord( to.x );
+	TInt32 toCellZ = CacheCellCoord( to.z );
+
+	// Look up the pair of cache cells
+	TUInt64 key = static_cast<TUInt64>(static_cast<TUInt16>(fromCellX)) |
+	              static_cast<TUInt64>(static_cast<TUInt16>(fromCellZ)) << 16 |
+	              static_cast<TUInt64>(static_cast<TUInt16>(toCellX)) << 32 |
+	              static_cast<TUInt64>(static_cast<TUInt16>(toCellZ)) << 48;
+	TUInt64 hash = key * 0x9E3779B97F4A7C15ull;
+	SCacheEntry& entry = GetThreadCache()[static_cast<TUInt32>(hash >> (64 - kCacheBits))];
+	if (entry.version == m_Version && entry.key == key)
+	{
+		return entry.isClear;
+	}
+
+	// Not cached, test between the cell centres
+	entry.key = key;
+	entry.version = m_Version;
+	entry.isClear = TestLine( (fromCellX + 0.5f) * kCacheCellSize, (fromCellZ + 0.5f) * kCacheCellSize,
+	                          (toCellX + 0.5f) * kCacheCellSize, (toCellZ + 0.5f) * kCacheCellSize );
+	return entry.isClear;
+}
+
+
+// Return true if no occluder crosses the line between the two points, testing the actual
+// points rather than using the cache
+bool CLineOfSight::IsClearExact( const CVector3& from, const CVector3& to )
+{
+	return TestLine( from.x, from.z, to.x, to.z );
+}
+
+
+/////////////////////////////////////
+// Private functions
+
+// Return a new version, never 0
+TUInt32 CLineOfSight::NewVersion()
+{
+	static atomic<TUInt32> numVersions( 0 );
+	return ++numVersions;
+}
+
+// Return the result cache for the calling thread. Entries are tagged with the version they were
+// tested at, and versions are unique, so one cache serves every line of sight object
+CLineOfSight::SCacheEntry* CLineOfSight::GetThreadCache()
+{
+	// Entries start at version 0 so none are valid
+	static thread_local SCacheEntry threadCache[kCacheSize] = {};
+	return threadCache;
+}
+
+// Return true if no occluder crosses the line between the two points, using the grid
+bool CLineOfSight::TestLine( TFloat32 fromX, TFloat32 fromZ, TFloat32 toX, TFloat32 toZ ) const
+{
+	if (m_NumCellsX == 0)
+	{
+		return true;
+	}
+
+	// Line in grid space, one unit per cell
+	TFloat32 startX = (fromX - m_MinX) / kCellSize;
+	TFloat32 startZ = (fromZ - m_MinZ) / kCellSize;
+	TFloat32 deltaX = (toX - m_MinX) / kCellSize - startX;
+	TFloat32 deltaZ = (toZ - m_MinZ) / kCellSize - startZ;
+
+	// Clip the line to the grid, giving the part inside as the range tStart to tEnd
+	TFloat32 tStart = 0.0f;
+	TFloat32 tEnd = 1.0f;
+	const TFloat32 starts[2] = { startX, startZ };
+	const TFloat32 deltas[2] = { deltaX, deltaZ };
+	const TFloat32 sizes[2] = { static_cast<TFloat32>(m_NumCellsX), static_cast<TFloat32>(m_NumCellsZ) };
+	for (TUInt32 axis = 0; axis < 2; ++axis)
+	{
+		if (deltas[axis] == 0.0f)
+		{
+			if (starts[axis] < 0.0f || starts[axis] > sizes[axis])
+			{
+				return true;
+			}
+		}
+		else
+		{
+			TFloat32 t0 = -starts[axis] / deltas[axis];
+			TFloat32 t1 = (sizes[axis] - starts[axis]) / deltas[axis];
+			tStart = max( tStart, min( t0, t1 ) );
+			tEnd = min( tEnd, max( t0, t1 ) );
+		}
+	}
+	if (tStart > tEnd)
+	{
+		return true;
+	}
+
+	// Walk the cells the line passes through in order (a 2D DDA), from the cell at tStart to the
+	// cell at tEnd
+	TFloat32 entryX = startX + deltaX * tStart;
+	TFloat32 entryZ = startZ + deltaZ * tStart;
+	TInt32 cellX = min( max( static_cast<TInt32>(floor( entryX )), 0 ), m_NumCellsX - 1 );
+	TInt32 cellZ = min( max( static_cast<TInt32>(floor( entryZ )), 0 ), m_NumCellsZ - 1 );
+	TInt32 endCellX = min( max( static_cast<TInt32>(floor( startX + deltaX * tEnd )), 0 ), m_NumCellsX - 1 );
+	TInt32 endCellZ = min( max( static_cast<TInt32>(floor( startZ + deltaZ * tEnd )), 0 ), m_NumCellsZ - 1 );
+
+	TInt32 stepX = deltaX > 0.0f ? 1 : -1;
+	TInt32 stepZ = deltaZ > 0.0f ? 1 : -1;
+	const TFloat32 kNever = 1e30f;
+	TFloat32 tNextX = deltaX != 0.0f ? ((cellX + (stepX > 0 ? 1 : 0)) - startX) / deltaX : kNever;
+	TFloat32 tNextZ = deltaZ != 0.0f ? ((cellZ + (stepZ > 0 ? 1 : 0)) - startZ) / deltaZ : kNever;
+	TFloat32 tStepX = deltaX != 0.0f ? stepX / deltaX : kNever;
+	TFloat32 tStepZ = deltaZ != 0.0f ? stepZ / deltaZ : kNever;
+
+	// The walk takes at most one step per cell boundary crossed
+	TInt32 maxSteps = abs( endCellX - cellX ) + abs( endCellZ - cellZ );
+	for (TInt32 step = 0; ; ++step)
+	{
+		if (!TestCell( cellZ * m_NumCellsX + cellX, fromX, fromZ, toX, toZ ))
+		{
+			return false;
+		}
+		if (step >= maxSteps || (cellX == endCellX && cellZ == endCellZ))
+		{
+			return true;
+		}
+
+		if (tNextX < tNextZ)
+		{
+			cellX += stepX;
+			tNextX += tStepX;
+		}
+		else
+		{
+			cellZ += stepZ;
+			tNextZ += tStepZ;
+		}
+		if (cellX < 0 || cellX >= m_NumCellsX || cellZ < 0 || cellZ >= m_NumCellsZ)
+		{
+			return true;
+		}
+	}
+}
+
+// Return true if no occluder in the given grid cell crosses the line
+bool CLineOfSight::TestCell( TUInt32 cell, TFloat32 fromX, TFloat32 fromZ, TFloat32 toX, TFloat32 toZ ) const
+{
+	TFloat32 lineX = toX - fromX;
+	TFloat32 lineZ = toZ - fromZ;
+	TFloat32 lengthSquared = lineX * lineX + lineZ * lineZ;
+
+	for (TUInt32 n = m_CellStart[cell]; n < m_CellStart[cell + 1]; ++n)
+	{
+		const SOccluder& occluder = m_Occluders[m_CellOccluders[n]];
+
+		// Find the closest point on the line to the occluder centre, the line is blocked if it is
+		// inside the occluder
+		TFloat32 offsetX = occluder.x - fromX;
+		TFloat32 offsetZ = occluder.z - fromZ;
+		TFloat32 t = lengthSquared > 0.0f ? (offsetX * lineX + offsetZ * lineZ) / lengthSquared : 0.0f;
+		t = min( max( t, 0.0f ), 1.0f );
+		TFloat32 distX = offsetX - lineX * t;
+		TFloat32 distZ = offsetZ - lineZ * t;
+		if (distX * distX + distZ * distZ <= occluder.radius * occluder.radius)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+} // namespace gen
@@ -0,0 +1,142 @@
+/*******************************************
+	LineOfSight.h
+
+	Line of sight tests against static
+	scenery
+********************************************/
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+using namespace std;
+
+#include "Defines.h"
+#include "CVector3.h"
+
+namespace gen
+{
+
+// The line of sight class answers whether static scenery blocks the view between two points.
+// Scenery is added as occluders - vertical cylinders given by a centre and radius on the ground
+// plane (XZ) - which are baked into a uniform grid by Bake. A test walks the cells under the line
+// and checks each occluder found against the line exactly
+// Results are cached by the pair of small cells the two points are in, and the cache is
+// invalidated by a version number that changes whenever the occluders are baked. Points in the
+// same pair of cache cells share a result (tested between the cell centres), so the cache
+// cell size is the precision of the tests
+// Tests only read the baked grid and each thread has its own cache, so tests may be made from
+// several threads at once without a lock. Occluders must not be changed or baked during tests
+class CLineOfSight
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Default constructor, there are no occluders
+	CLineOfSight();
+
+	// No destructor needed
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CLineOfSight( const CLineOfSight& );
+	CLineOfSight& operator=( const CLineOfSight& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	/////////////////////////////////////
+	// Occluders
+
+	// Add an occluder with the given centre and radius (only X and Z are used). Tests do not see
+	// it until the occluders are baked
+	void AddOccluder( const CVector3& centre, TFloat32 radius );
+
+	// Bake the occluders into the grid used by tests. Call after adding occluders, before testing
+	void Bake();
+
+	// Remove all occluders, tests then find every line clear
+	void Clear();
+
+	// Return the version of the baked occluders, which changes whenever they are baked or cleared.
+	// Versions are unique across all line of sight objects
+	TUInt32 GetVersion()
+	{
+		return m_Version;
+	}
+
+
+	/////////////////////////////////////
+	// Tests
+
+	// Return true if no occluder crosses the line between the two points
+	bool IsClear( const CVector3& from, const CVector3& to );
+
+	// Return true if no occluder crosses the line between the two points, testing the actual
+	// points rather than using the cache. For short lines needing an exact answer, such as the
+	// path of a shell over one frame
+	bool IsClearExact( const CVector3& from, const CVector3& to );
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Grid cell size, cache cell size and number of cache entries (as a power of two)
+	static const TFloat32 kCellSize;
+	static const TFloat32 kCacheCellSize;
+	static const TUInt32 kCacheBits = 12;
+	static const TUInt32 kCacheSize = 1 << kCacheBits;
+
+	// An occluder. One overlapping several cells under a line is checked against it for each
+	struct SOccluder
+	{
+		TFloat32 x;
+		TFloat32 z;
+		TFloat32 radius;
+	};
+
+	// A cached result for a pair of cache cells, valid if its version is the current one
+	struct SCacheEntry
+	{
+		TUInt64 key;
+		TUInt32 version;
+		bool    isClear;
+	};
+
+	// Return the cache cell coordinate containing the given world coordinate
+	TInt32 CacheCellCoord( TFloat32 coord )
+	{
+		return static_cast<TInt32>(floor( coord / kCacheCellSize ));
+	}
+
+	// Return a new version, never 0
+	static TUInt32 NewVersion();
+
+	// Return the result cache for the calling thread
+	static SCacheEntry* GetThreadCache();
+
+	// Return true if no occluder crosses the line between the two points, using the grid
+	bool TestLine( TFloat32 fromX, TFloat32 fromZ, TFloat32 toX, TFloat32 toZ ) const;
+
+	// Return true if no occluder in the given grid cell crosses the line
+	bool TestCell( TUInt32 cell, TFloat32 fromX, TFloat32 fromZ, TFloat32 toX, TFloat32 toZ ) const;
+
+	// Occluders, with those baked into the grid first and any added since after them
+	vector<SOccluder> m_Occluders;
+	TUInt32           m_Version;
+
+	// Grid over the baked occluders' bounds, with the list of occluders in each cell packed into
+	// one array - cell n's occluders run from m_CellStart[n] up to m_CellStart[n + 1]
+	TFloat32        m_MinX;
+	TFloat32        m_MinZ;
+	TInt32          m_NumCellsX;
+	TInt32          m_NumCellsZ;
+	vector<TUInt32> m_CellStart;
+	vector<TUInt32> m_CellOccluders;
+};
+
+
+} // namespace gen
@@ -0,0 +1,67 @@
+/*******************************************
+	MatrixBatch.cpp
+
+	Batched matrix composition for entity
+	node hierarchies
+********************************************/
+
+#include "MatrixBatch.h"
+
+#if GEN_MATRIX_SIMD
+#include <xmmintrin.h>
+#endif
+
+namespace gen
+{
+
+#if GEN_MATRIX_SIMD
+
+// The SSE version reads matrices as 16 floats in row order
+static_assert( sizeof(CMatrix4x4) == 16 * sizeof(TFloat32), "CMatrix4x4 must be 16 floats" );
+
+// Set each result matrix to the product of a relative matrix and its parent's absolute matrix
+// (results[n] = *relatives[n] * *parents[n]) for the given number of matrices
+void ComposeMatrices( TUInt32 numMatrices, const CMatrix4x4* const* relatives,
+                      const CMatrix4x4* const* parents, CMatrix4x4* const* results )
+{
+	for (TUInt32 matrix = 0; matrix < numMatrices; ++matrix)
+	{
+		const TFloat32* relative = &relatives[matrix]->e00;
+		const TFloat32* parent = &parents[matrix]->e00;
+		TFloat32* result = &results[matrix]->e00;
+
+		// Matrices are not necessarily 16-byte aligned
+		__m128 parentRow0 = _mm_loadu_ps( parent );
+		__m128 parentRow1 = _mm_loadu_ps( parent + 4 );
+		__m128 parentRow2 = _mm_loadu_ps( parent + 8 );
+		__m128 parentRow3 = _mm_loadu_ps( parent + 12 );
+
+		for (TUInt32 row = 0; row < 4; ++row)
+		{
+			const TFloat32* relativeRow = relative + row * 4;
+			__m128 resultRow = _mm_mul_ps( _mm_set1_ps( relativeRow[0] ), parentRow0 );
+			resultRow = _mm_add_ps( resultRow, _mm_mul_ps( _mm_set1_ps( relativeRow[1] ), parentRow1 ) );
+			resultRow = _mm_add_ps( resultRow, _mm_mul_ps( _mm_set1_ps( relativeRow[2] ), parentRow2 ) );
+			resultRow = _mm_add_ps( resultRow, _mm_mul_ps( _mm_set1_ps( relativeRow[3] ), parentRow3 ) );
+			_mm_storeu_ps( result + row * 4, resultRow );
+		}
+	}
+}
+
+#else
+
+// Set each result matrix to the product of a relative matrix and its parent's absolute matrix
+// (results[n] = *relatives[n] * *parents[n]) for the given number of matrices
+void ComposeMatrices( TUInt32 numMatrices, const CMatrix4x4* const* relatives,
+                      const CMatrix4x4* const* parents, CMatrix4x4* const* results )
+{
+	for (TUInt32 matrix = 0; matrix < numMatrices; ++matrix)
+	{
+		*results[matrix] = *relatives[matrix] * *parents[matrix];
+	}
+}
+
+#endif
+
+
+} // namespace gen
@@ -0,0 +1,35 @@
+/*******************************************
+	MatrixBatch.h
+
+	Batched matrix composition for entity
+	node hierarchies
+********************************************/
+
+#pragma once
+
+#include "Defines.h"
+#include "CMatrix4x4.h"
+
+// Set to 1 to compose matrices with SSE, or 0 to use CMatrix4x4 multiplication. Defaults to SSE
+// wherever SSE2 is available (always on x64)
+#ifndef GEN_MATRIX_SIMD
+#if defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define GEN_MATRIX_SIMD 1
+#else
+#define GEN_MATRIX_SIMD 0
+#endif
+#endif
+
+namespace gen
+{
+
+// Set each result matrix to the product of a relative matrix and its parent's absolute matrix
+// (results[n] = *relatives[n] * *parents[n]) for the given number of matrices. Results must
+// not be any of the inputs
+// The SSE version builds each result row as the sum of the parent's rows weighted by the
+// elements of the relative matrix's row, four elements at once
+void ComposeMatrices( TUInt32 numMatrices, const CMatrix4x4* const* relatives,
+                      const CMatrix4x4* const* parents, CMatrix4x4* const* results );
+
+
+} // namespace gen
@@ -4,6 +4,14 @@
 	Entity messenger class implementation
 ********************************************/
 
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#if GEN_MESSENGER_THREAD_SAFE
+#include <atomic>
+#endif
+using namespace std;
+
 #include "Messenger.h"
 
 namespace gen
@@ -16,37 +24,937 @@ namespace gen
 CMessenger Messenger;
 
 
+/////////////////////////////////////
+// Message priorities
+
+// Properties of each message type
+struct SMessageTypeInfo
+{
+	EMessagePriority priority;
+	bool             idempotent;
+	const char*      name;
+};
+
+// Properties indexed by EMessageType. Messages that change what an entity is doing are critical.
+// Advisory messages only inform, so can arrive a frame or two late - Msg_AmmoNull shares the
+// advisory lane with Msg_Ammo so it cannot overtake it. Idempotent messages set a flag or state
+// in the receiver, so repeats from the same sender can be discarded
+static const SMessageTypeInfo MessageTypes[Msg_NumTypes] =
+{
+	{ Priority_Critical, false, "Msg_Go" },
+	{ Priority_Critical, false, "Msg_Evade" },
+	{ Priority_Critical, false, "Msg_Stop" },
+	{ Priority_Critical, false, "Msg_Hit" },
+	{ Priority_Critical, true,  "Msg_Selected" },
+	{ Priority_Advisory, true,  "Msg_Ammo" },
+	{ Priority_Advisory, true,  "Msg_AmmoNull" },
+	{ Priority_Advisory, false, "Msg_AmmoIncrease" },
+	{ Priority_Advisory, true,  "Msg_Help" },
+	{ Priority_Critical, false, "Msg_Fire" },
+	{ Priority_Critical, false, "Msg_Expire" },
+	{ Priority_Critical, false, "Msg_Formation" },
+};
+
+// Return the priority lane for a message type
+EMessagePriority GetMessagePriority( EMessageType type )
+{
+	return MessageTypes[type].priority;
+}
+
+// Returns true if a message type is idempotent
+bool IsMessageIdempotent( EMessageType type )
+{
+	return MessageTypes[type].idempotent;
+}
+
+// Return the name of a message type
+const char* GetMessageTypeName( EMessageType type )
+{
+	return MessageTypes[type].name;
+}
+
+
+/////////////////////////////////////
+// Static constants
+
+// Resolution of delayed message times in seconds
+const TFloat32 CMessenger::kTickLength = 0.01f;
+
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Destructor releases mailbox buffers
+CMessenger::~CMessenger()
+{
+	for (TUInt32 page = 0; page < m_MailboxPages.size(); ++page)
+	{
+		if (m_MailboxPages[page].mailboxes)
+		{
+			for (TUInt32 mailbox = 0; mailbox < kMailboxPageSize; ++mailbox)
+			{
+				FreeMailbox( m_MailboxPages[page].mailboxes[mailbox] );
+			}
+			delete[] m_MailboxPages[page].mailboxes;
+		}
+	}
+	for (TUInt32 page = 0; page < m_FreePages.size(); ++page)
+	{
+		delete[] m_FreePages[page];
+	}
+	for (TUInt32 buffer = 0; buffer < m_FreeBuffers.size(); ++buffer)
+	{
+		delete[] m_FreeBuffers[buffer];
+	}
+#if GEN_MESSENGER_THREAD_SAFE
+	for (TUInt32 thread = 0; thread < m_ThreadBuffers.size(); ++thread)
+	{
+		delete m_ThreadBuffers[thread];
+	}
+#endif
+}
+
+
 /////////////////////////////////////
 // Message sending/receiving
 
-// Send the given message to a particular UID, does not check if the UID exists
+// Send the given message to a particular UID, does not check if the UID exists. Messages
+// sent to the SystemUID are discarded - nothing can fetch them
 void CMessenger::SendMessage( TEntityUID to, const SMessage& msg )
 {
-	// Simply insert the UID/message pair into the message map. It will be inserted next
-	// to any other pairs with the same UID
-	m_Messages.insert( UIDMsgPair( to, msg ) );
+	if (to == SystemUID)
+	{
+		return;
+	}
+#if GEN_MESSENGER_STATS
+	++m_Stats.sent[msg.type];
+#endif
+
+	SPendingMessage pending = MakePending( to, 0, 0, msg );
+	if (m_FramePhased)
+	{
+		GetOutbox().push_back( pending );
+	}
+	else if (!Coalesce( to, msg ))
+	{
+		DeliverMessage( pending );
+	}
+}
+
+
+// Send the given message to every member of a group. The message is stored once however many
+// members the group has
+void CMessenger::SendGroupMessage( TMessageGroup group, const SMessage& msg )
+{
+#if GEN_MESSENGER_STATS
+	++m_Stats.sent[msg.type];
+#endif
+
+	if (m_FramePhased)
+	{
+		GetOutbox().push_back( MakePending( SystemUID, group, 0, msg ) );
+	}
+	else
+	{
+		DeliverGroupMessage( group, msg );
+	}
+}
+
+
+// Fetch every queued message for the given UID in one call and empty its mailbox. The
+// messages are returned oldest first as a contiguous range that is only valid until the
+// next call to DrainMessages. Messages sent while walking the range are queued as normal
+SMessageRange CMessenger::DrainMessages( TEntityUID to )
+{
+	vector<SMessage>& drained = GetDrainBuffer();
+	drained.clear();
+	SMailbox* mailboxPtr = FindMailbox( to );
+	if (!mailboxPtr)
+	{
+		SMessageRange range = { 0, 0 };
+		return range;
+	}
+	SMailbox& mailbox = *mailboxPtr;
+
+	if (mailbox.count > 0)
+	{
+		// Copy out the ring in at most two pieces - before and after the wrap point
+		TUInt32 firstPart = mailbox.capacity - mailbox.head;
+		if (firstPart > mailbox.count)
+		{
+			firstPart = mailbox.count;
+		}
+		drained.insert( drained.end(), mailbox.messages + mailbox.head,
+		                mailbox.messages + mailbox.head + firstPart );
+		drained.insert( drained.end(), mailbox.messages,
+		                mailbox.messages + (mailbox.count - firstPart) );
+#if GEN_MESSENGER_STATS
+		for (TUInt32 message = 0; message < mailbox.count; ++message)
+		{
+			RecordFetch( drained[message], mailbox.stamps[(mailbox.head + message) & (mailbox.capacity - 1)] );
+		}
+#endif
+
+		mailbox.head = 0;
+		mailbox.count = 0;
+
+		// Drained messages can be queued again
+		if (!mailbox.queuedKeys.empty())
+		{
+			for (TUInt32 message = 0; message < drained.size(); ++message)
+			{
+				RemoveQueuedKey( mailbox, drained[message] );
+			}
+		}
+	}
+
+	// Follow with any unread group messages
+#if GEN_MESSENGER_STATS
+	TUInt32 numDirect = static_cast<TUInt32>(drained.size());
+#endif
+	vector<SSubscription>& subscriptions = mailbox.subscriptions;
+	for (TUInt32 sub = 0; sub < subscriptions.size(); ++sub)
+	{
+		SGroupChannel& channel = m_Groups[subscriptions[sub].group];
+		TUInt32 firstUnread = subscriptions[sub].nextSequence - channel.firstSequence;
+		drained.insert( drained.end(), channel.messages.begin() + firstUnread, channel.messages.end() );
+		subscriptions[sub].nextSequence = channel.firstSequence + static_cast<TUInt32>(channel.messages.size());
+	}
+
+#if GEN_MESSENGER_STATS
+	for (TUInt32 message = numDirect; message < drained.size(); ++message)
+	{
+		RecordFetch( drained[message] );
+	}
+#endif
+
+	SMessageRange range = { drained.empty() ? 0 : &drained[0], static_cast<TUInt32>(drained.size()) };
+	return range;
+}
+
+
+/////////////////////////////////////
+// Delayed messages
+
+// Send the given message to a UID when messenger time reaches the given time (in seconds)
+void CMessenger::SendMessageAt( TEntityUID to, const SMessage& msg, TFloat32 time )
+{
+	if (to == SystemUID)
+	{
+		return;
+	}
+
+	// Round up to a whole tick, never earlier than the next tick
+	TUInt32 dueTick = static_cast<TUInt32>(ceil( time / kTickLength ));
+	if (static_cast<TInt32>(dueTick - m_DelayedMessages.GetNow()) <= 0)
+	{
+		dueTick = m_DelayedMessages.GetNow() + 1;
+	}
+
+#if GEN_MESSENGER_STATS
+	++m_Stats.sent[msg.type];
+#endif
+
+	SPendingMessage pending = MakePending( to, 0, dueTick, msg );
+	if (m_FramePhased)
+	{
+		// The timing wheel is only changed between frames - the message joins it when buffers are swapped
+		GetOutbox().push_back( pending );
+	}
+	else
+	{
+		m_DelayedMessages.Add( pending, dueTick );
+	}
+}
+
+// Advance messenger time, sending any delayed messages that have fallen due. Call once per
+// frame - before SwapMessageBuffers in frame phased mode so due messages are seen that frame
+void CMessenger::AdvanceTime( TFloat32 updateTime )
+{
+	m_TickTime += updateTime;
+	TUInt32 numTicks = static_cast<TUInt32>(m_TickTime / kTickLength);
+	m_TickTime -= numTicks * kTickLength;
+
+#if GEN_MESSENGER_THREAD_SAFE
+	// Messages falling due are sent now, after anything sent so far
+	NextSendPass();
+#endif
+	auto due = [this]( SPendingMessage& pending )
+	{
+		pending.dueTick = 0;
+#if GEN_MESSENGER_STATS
+		pending.stamp = GetSendStamp(); // Latency is measured from when the message falls due
+#endif
+#if GEN_MESSENGER_THREAD_SAFE
+		pending.order = static_cast<TUInt64>(m_SendPass) << 32;
+#endif
+		DeliverPending( pending );
+	};
+	m_DelayedMessages.Advance( numTicks, due );
+}
+
+
+/////////////////////////////////////
+// Frame phasing
+
+// Select frame phased delivery. Messages already waiting in the write buffer are delivered
+// when phasing is turned off. Ignored by the thread-safe messenger, which is always phased
+void CMessenger::SetFramePhased( bool framePhased )
+{
+#if !GEN_MESSENGER_THREAD_SAFE
+	if (m_FramePhased && !framePhased)
+	{
+		SwapMessageBuffers();
+		DeliverAdvisory( kUnlimitedBudget );
+	}
+	m_FramePhased = framePhased;
+#endif
+}
+
+// Deliver all messages sent since the last call, making them available to fetch. Call once
+// per frame before entities are updated. Does nothing if not in frame phased mode
+void CMessenger::SwapMessageBuffers()
+{
+#if GEN_MESSENGER_THREAD_SAFE
+	// Merge the per-thread outboxes ahead of the delayed messages that fell due, which were sent
+	// after them. Which thread ran a chunk, and when, depends on scheduling, so put the messages in
+	// send order (pass, chunk). A chunk runs on one thread, so the stable sort keeps the order each
+	// chunk sent in. The sort allocates a buffer, it is skipped when the messages are in order, as
+	// when one thread sent them all
+	TUInt32 numMerged = 0;
+	for (TUInt32 thread = 0; thread < m_ThreadBuffers.size(); ++thread)
+	{
+		vector<SPendingMessage>& outbox = m_ThreadBuffers[thread]->outbox;
+		m_Outbox.insert( m_Outbox.begin() + numMerged, outbox.begin(), outbox.end() );
+		numMerged += static_cast<TUInt32>(outbox.size());
+		outbox.clear();
+	}
+	if (!is_sorted( m_Outbox.begin(), m_Outbox.end(), SendsBefore ))
+	{
+		stable_sort( m_Outbox.begin(), m_Outbox.end(), SendsBefore );
+	}
+	m_SendPass = 0;
+#endif
+
+	// Critical messages are delivered in the order they were sent so mailboxes stay FIFO.
+	// Advisory messages join the end of the advisory lane. Delayed messages sent this frame
+	// are put in the timing wheel
+	for (TUInt32 pending = 0; pending < m_Outbox.size(); ++pending)
+	{
+		if (m_Outbox[pending].dueTick != 0)
+		{
+			m_DelayedMessages.Add( m_Outbox[pending], m_Outbox[pending].dueTick );
+		}
+		else if (m_Outbox[pending].to != SystemUID && Coalesce( m_Outbox[pending].to, m_Outbox[pending].msg ))
+		{
+			// Duplicate of a queued idempotent message
+		}
+		else if (GetMessagePriority( m_Outbox[pending].msg.type ) == Priority_Advisory)
+		{
+			m_Advisory.push_back( m_Outbox[pending] );
+		}
+		else if (m_Outbox[pending].to != SystemUID)
+		{
+			DeliverMessage( m_Outbox[pending] );
+		}
+		else
+		{
+			DeliverGroupMessage( m_Outbox[pending].group, m_Outbox[pending].msg );
+		}
+	}
+	m_Outbox.clear(); // Keeps its capacity for the next frame
+
+	// Then as many advisory messages as the budget allows
+	DeliverAdvisory( m_AdvisoryBudget );
+
+#if GEN_MESSENGER_STATS
+	RecordQueueDepth();
+	++m_Stats.numFrames;
+#endif
+}
+
+// Deliver up to the given number of held advisory messages, oldest first
+void CMessenger::DeliverAdvisory( TUInt32 budget )
+{
+	TUInt32 numDelivered = 0;
+	while (numDelivered < m_Advisory.size() && numDelivered < budget)
+	{
+		if (m_Advisory[numDelivered].to != SystemUID)
+		{
+			DeliverMessage( m_Advisory[numDelivered] );
+		}
+		else
+		{
+			DeliverGroupMessage( m_Advisory[numDelivered].group, m_Advisory[numDelivered].msg );
+		}
+		++numDelivered;
+	}
+	m_Advisory.erase( m_Advisory.begin(), m_Advisory.begin() + numDelivered );
+}
+
+
+/////////////////////////////////////
+// Groups
+
+// Add the given UID to a group. It will receive group messages sent after it joins
+void CMessenger::JoinGroup( TEntityUID uid, TMessageGroup group )
+{
+	if (group >= m_Groups.size())
+	{
+		m_Groups.resize( group + 1 );
+	}
+	SGroupChannel& channel = m_Groups[group];
+	SMailbox* mailboxPtr = GetMailbox( uid );
+	if (!mailboxPtr || mailboxPtr->destroyed)
+	{
+		return;
+	}
+	SMailbox& mailbox = *mailboxPtr;
+
+	// Ignore if already a member
+	for (TUInt32 sub = 0; sub < mailbox.subscriptions.size(); ++sub)
+	{
+		if (mailbox.subscriptions[sub].group == group)
+		{
+			return;
+		}
+	}
+
+	// Start reading from the end of the channel
+	SSubscription subscription = { group, channel.firstSequence + static_cast<TUInt32>(channel.messages.size()) };
+	mailbox.subscriptions.push_back( subscription );
+	channel.members.push_back( uid );
+}
+
+// Remove the given UID from a group, any group messages it has not read are discarded
+void CMessenger::LeaveGroup( TEntityUID uid, TMessageGroup group )
+{
+	SMailbox* mailbox = FindMailbox( uid );
+	if (!mailbox || group >= m_Groups.size())
+	{
+		return;
+	}
+
+	vector<SSubscription>& subscriptions = mailbox->subscriptions;
+	for (TUInt32 sub = 0; sub < subscriptions.size(); ++sub)
+	{
+		if (subscriptions[sub].group == group)
+		{
+			subscriptions[sub] = subscriptions.back();
+			subscriptions.pop_back();
+
+			vector<TEntityUID>& members = m_Groups[group].members;
+			members.erase( find( members.begin(), members.end(), uid ) );
+			if (members.empty())
+			{
+				// Nobody left to read the channel
+				m_Groups[group].firstSequence += static_cast<TUInt32>(m_Groups[group].messages.size());
+				m_Groups[group].messages.clear();
+			}
+			return;
+		}
+	}
+}
+
+// Remove the given UID from all the groups it is in (done by EntityDestroyed)
+void CMessenger::LeaveAllGroups( TEntityUID uid )
+{
+	SMailbox* mailbox = FindMailbox( uid );
+	if (!mailbox)
+	{
+		return;
+	}
+	while (!mailbox->subscriptions.empty())
+	{
+		LeaveGroup( uid, mailbox->subscriptions.back().group );
+	}
+}
+
+
+/////////////////////////////////////
+// Entity destruction
+
+// Tell the messenger a UID has been destroyed. Its mailbox and any unread messages are
+// discarded and it leaves all its groups. Messages sent to the UID from then on (including
+// any already waiting for delivery) are discarded and counted as dead letters
+void CMessenger::EntityDestroyed( TEntityUID uid )
+{
+	SMailbox* mailbox = GetMailbox( uid );
+	if (!mailbox || mailbox->destroyed)
+	{
+		return;
+	}
+
+#if GEN_MESSENGER_STATS
+	// Anything the entity has not read will never be read
+	m_Stats.orphaned += mailbox->count;
+	for (TUInt32 sub = 0; sub < mailbox->subscriptions.size(); ++sub)
+	{
+		SGroupChannel& channel = m_Groups[mailbox->subscriptions[sub].group];
+		m_Stats.orphaned += channel.firstSequence + static_cast<TUInt32>(channel.messages.size()) -
+		                    mailbox->subscriptions[sub].nextSequence;
+	}
+#endif
+
+	LeaveAllGroups( uid );
+	FreeMailbox( *mailbox );
+	mailbox->destroyed = true;
+
+	// Free the page once every UID in it has gone, keeping it for reuse by a later page
+	SMailboxPage& page = m_MailboxPages[uid >> kMailboxPageBits];
+	if (++page.numDestroyed == kMailboxPageSize)
+	{
+		m_FreePages.push_back( page.mailboxes );
+		page.mailboxes = 0;
+	}
+}
+
+
+#if GEN_MESSENGER_STATS
+/////////////////////////////////////
+// Statistics
+
+// Write the statistics to a CSV file, returns false on failure
+bool CMessenger::WriteStatsCSV( const string& fileName )
+{
+	ofstream file( fileName.c_str() );
+	if (!file)
+	{
+		return false;
+	}
+
+	file << "Type,Sent,Fetched" << endl;
+	for (TUInt32 type = 0; type < Msg_NumTypes; ++type)
+	{
+		file << GetMessageTypeName( static_cast<EMessageType>(type) ) << "," << m_Stats.sent[type] << ","
+		     << m_Stats.fetched[type] << endl;
+	}
+	file << endl;
+
+	file << "Statistic,Value" << endl;
+	file << "Frames," << m_Stats.numFrames << endl;
+	file << "Peak queue depth," << m_Stats.peakQueueDepth << endl;
+	file << "Average queue depth," << m_Stats.AverageQueueDepth() << endl;
+	file << "Orphaned," << m_Stats.orphaned << endl;
+	file << "Absorbed," << m_NumAbsorbed << endl;
+	file << "Dead letters," << m_NumDeadLetters << endl;
+	file << "Peak latency (frames)," << m_Stats.peakLatencyFrames << endl;
+	file << "Average latency (frames)," << m_Stats.AverageLatencyFrames() << endl;
+	file << "Peak latency (ms)," << m_Stats.peakLatencySeconds * 1000.0 << endl;
+	file << "Average latency (ms)," << m_Stats.AverageLatencySeconds() * 1000.0 << endl;
+	file << endl;
+
+	file << "Queue depth up to,Frames" << endl;
+	for (TUInt32 bucket = 0; bucket < SMessengerStats::kNumDepthBuckets; ++bucket)
+	{
+		file << (1u << bucket) - 1 << "," << m_Stats.depthHistogram[bucket] << endl;
+	}
+
+	return !file.fail();
+}
+#endif
+
+
+/////////////////////////////////////
+// Private functions
+
+#if GEN_MESSENGER_THREAD_SAFE
+// Return a new messenger ID, never 0
+TUInt32 CMessenger::NewID()
+{
+	static atomic<TUInt32> numCreated( 0 );
+	return ++numCreated;
+}
+
+// Return the buffers for the calling thread, creating them on first use
+CMessenger::SThreadBuffers* CMessenger::GetThreadBuffers()
+{
+	// Cache the buffers for the last messenger used on this thread
+	static thread_local TUInt32         threadMessengerID = 0;
+	static thread_local SThreadBuffers* threadBuffers = 0;
+	if (threadMessengerID != m_ID)
+	{
+		lock_guard<mutex> lock( m_ThreadBuffersLock );
+		threadBuffers = new SThreadBuffers;
+		m_ThreadBuffers.push_back( threadBuffers );
+		threadMessengerID = m_ID;
+	}
+	return threadBuffers;
+}
+
+// Return the write buffer for the calling thread
+vector<CMessenger::SPendingMessage>& CMessenger::GetOutbox()
+{
+	return GetThreadBuffers()->outbox;
+}
+
+// Return the buffer used by DrainMessages on the calling thread
+vector<SMessage>& CMessenger::GetDrainBuffer()
+{
+	return GetThreadBuffers()->drained;
+}
+
+// Set the chunk being run on the calling thread, until EndSendChunk
+void CMessenger::BeginSendChunk( TUInt32 chunk )
+{
+	GetThreadBuffers()->sendChunk = chunk + 1;
+}
+void CMessenger::EndSendChunk()
+{
+	GetThreadBuffers()->sendChunk = 0;
 }
 
+// Returns true if the first pending message is delivered before the second
+bool CMessenger::SendsBefore( const SPendingMessage& a, const SPendingMessage& b )
+{
+	return a.order < b.order;
+}
+#endif
+
+// Add a message to a UID's mailbox, making it available to fetch
+void CMessenger::DeliverMessage( const SPendingMessage& pending )
+{
+	SMailbox* mailboxPtr = GetMailbox( pending.to );
+	if (!mailboxPtr || mailboxPtr->destroyed)
+	{
+		++m_NumDeadLetters;
+		return;
+	}
+
+	// Add message at the tail of the ring, growing it first if full
+	SMailbox& mailbox = *mailboxPtr;
+	if (mailbox.count == mailbox.capacity)
+	{
+		GrowMailbox( mailbox );
+	}
+	TUInt32 tail = (mailbox.head + mailbox.count) & (mailbox.capacity - 1);
+	mailbox.messages[tail] = pending.msg;
+#if GEN_MESSENGER_STATS
+	mailbox.stamps[tail] = pending.stamp;
+#endif
+	++mailbox.count;
+}
 
-// Fetch the next available message for the given UID, returns the message through the given 
-// pointer. Returns false if there are no messages for this UID
-bool CMessenger::FetchMessage( TEntityUID to, SMessage* msg )
+// Add a message to a group channel, making it available to fetch for all group members
+void CMessenger::DeliverGroupMessage( TMessageGroup group, const SMessage& msg )
 {
-	// Find the first message for this UID in the message map
-	TMessageIter itMessage = m_Messages.find( to );
+	if (group >= m_Groups.size() || m_Groups[group].members.empty())
+	{
+		return; // No one to receive it
+	}
 
-	// See if no messages for this UID
-	if (itMessage == m_Messages.end())
+	// Occasionally trim messages all members have read. The trim size grows with the number of
+	// messages left behind so the cost of scanning the members is spread over many sends
+	SGroupChannel& channel = m_Groups[group];
+	if (channel.messages.size() >= channel.trimSize)
+	{
+		TrimGroup( channel );
+	}
+	channel.messages.push_back( msg );
+}
+
+// Pass a pending message on for delivery - to the write buffer in frame phased mode or
+// straight to a mailbox/group otherwise
+void CMessenger::DeliverPending( const SPendingMessage& pending )
+{
+	if (m_FramePhased)
+	{
+		m_Outbox.push_back( pending );
+	}
+	else if (pending.to != SystemUID)
+	{
+		if (!Coalesce( pending.to, pending.msg ))
+		{
+			DeliverMessage( pending );
+		}
+	}
+	else
+	{
+		DeliverGroupMessage( pending.group, pending.msg );
+	}
+}
+
+// Returns true if a direct message is an idempotent duplicate of one already queued for the
+// recipient, counting it as absorbed. Otherwise records the message as queued if idempotent
+bool CMessenger::Coalesce( TEntityUID to, const SMessage& msg )
+{
+	if (!IsMessageIdempotent( msg.type ))
 	{
 		return false;
 	}
 
-	// Return message, then delete it
-	*msg = itMessage->second;
-	m_Messages.erase( itMessage );
+	SMailbox* mailbox = GetMailbox( to );
+	if (!mailbox || mailbox->destroyed)
+	{
+		return false; // Leave it to be counted as a dead letter
+	}
 
-	return true;
+	vector<SQueuedKey>& queuedKeys = mailbox->queuedKeys;
+	for (TUInt32 key = 0; key < queuedKeys.size(); ++key)
+	{
+		if (queuedKeys[key].type == msg.type && queuedKeys[key].from == msg.from)
+		{
+			++m_NumAbsorbed;
+			return true;
+		}
+	}
+	SQueuedKey newKey = { msg.type, msg.from };
+	queuedKeys.push_back( newKey );
+	return false;
+}
+
+// Forget a fetched message's queued key, if it has one
+void CMessenger::RemoveQueuedKey( SMailbox& mailbox, const SMessage& msg )
+{
+	for (TUInt32 key = 0; key < mailbox.queuedKeys.size(); ++key)
+	{
+		if (mailbox.queuedKeys[key].type == msg.type && mailbox.queuedKeys[key].from == msg.from)
+		{
+			mailbox.queuedKeys[key] = mailbox.queuedKeys.back();
+			mailbox.queuedKeys.pop_back();
+			return;
+		}
+	}
+}
+
+// Return a pending message with the given recipient, delivery tick and message
+CMessenger::SPendingMessage CMessenger::MakePending( TEntityUID to, TMessageGroup group, TUInt32 dueTick,
+                                                     const SMessage& msg )
+{
+	SPendingMessage pending = { to, group, dueTick, msg };
+#if GEN_MESSENGER_STATS
+	pending.stamp = GetSendStamp();
+#endif
+#if GEN_MESSENGER_THREAD_SAFE
+	pending.order = (static_cast<TUInt64>(m_SendPass) << 32) | GetThreadBuffers()->sendChunk;
+#endif
+	return pending;
+}
+
+// Return the mailbox for a UID, allocating its page if necessary. Returns 0 if the page has
+// been freed because every UID in it has been destroyed
+CMessenger::SMailbox* CMessenger::GetMailbox( TEntityUID uid )
+{
+	TUInt32 pageIndex = uid >> kMailboxPageBits;
+	if (pageIndex >= m_MailboxPages.size())
+	{
+		SMailboxPage newPage = { 0, 0 };
+		m_MailboxPages.resize( pageIndex + 1, newPage );
+	}
+
+	// New pages hold empty mailboxes with no buffer. A freed page's mailboxes have already been
+	// emptied, they just need to be marked as not destroyed
+	SMailboxPage& page = m_MailboxPages[pageIndex];
+	if (!page.mailboxes)
+	{
+		if (page.numDestroyed == kMailboxPageSize)
+		{
+			return 0;
+		}
+		if (!m_FreePages.empty())
+		{
+			page.mailboxes = m_FreePages.back();
+			m_FreePages.pop_back();
+			for (TUInt32 mailbox = 0; mailbox < kMailboxPageSize; ++mailbox)
+			{
+				page.mailboxes[mailbox].destroyed = false;
+			}
+		}
+		else
+		{
+			page.mailboxes = new SMailbox[kMailboxPageSize];
+		}
+	}
+	return &page.mailboxes[uid & (kMailboxPageSize - 1)];
+}
+
+// Release a mailbox's message buffers
+void CMessenger::FreeMailbox( SMailbox& mailbox )
+{
+	ReleaseBuffer( mailbox.messages, mailbox.capacity );
+	mailbox.messages = 0;
+#if GEN_MESSENGER_STATS
+	delete[] mailbox.stamps;
+	mailbox.stamps = 0;
+#endif
+	mailbox.capacity = 0;
+	mailbox.head = 0;
+	mailbox.count = 0;
+	mailbox.queuedKeys.clear(); // Keep the capacity for the next UID to use this mailbox
+}
+
+// Double the size of a full mailbox, unwrapping the messages to the start of the new buffer
+void CMessenger::GrowMailbox( SMailbox& mailbox )
+{
+	TUInt32 newCapacity = mailbox.capacity ? mailbox.capacity * 2 : kInitialMailboxSize;
+	SMessage* newMessages;
+	if (newCapacity == kInitialMailboxSize && !m_FreeBuffers.empty())
+	{
+		newMessages = m_FreeBuffers.back();
+		m_FreeBuffers.pop_back();
+	}
+	else
+	{
+		newMessages = new SMessage[newCapacity];
+	}
+
+	for (TUInt32 message = 0; message < mailbox.count; ++message)
+	{
+		newMessages[message] = mailbox.messages[(mailbox.head + message) & (mailbox.capacity - 1)];
+	}
+	ReleaseBuffer( mailbox.messages, mailbox.capacity );
+
+#if GEN_MESSENGER_STATS
+	SSendStamp* newStamps = new SSendStamp[newCapacity];
+	for (TUInt32 message = 0; message < mailbox.count; ++message)
+	{
+		newStamps[message] = mailbox.stamps[(mailbox.head + message) & (mailbox.capacity - 1)];
+	}
+	delete[] mailbox.stamps;
+	mailbox.stamps = newStamps;
+#endif
+
+	mailbox.messages = newMessages;
+	mailbox.capacity = newCapacity;
+	mailbox.head = 0;
+}
+
+// Release a mailbox ring buffer with the given capacity. Buffers of the initial size are kept
+// for reuse, most mailboxes never grow beyond it
+void CMessenger::ReleaseBuffer( SMessage* messages, TUInt32 capacity )
+{
+	if (capacity == kInitialMailboxSize)
+	{
+		m_FreeBuffers.push_back( messages );
+	}
+	else
+	{
+		delete[] messages;
+	}
+}
+
+// Fetch the next unread group message for a mailbox that has no direct messages
+bool CMessenger::FetchGroupMessage( SMailbox& mailbox, SMessage* msg )
+{
+	for (TUInt32 sub = 0; sub < mailbox.subscriptions.size(); ++sub)
+	{
+		SSubscription& subscription = mailbox.subscriptions[sub];
+		SGroupChannel& channel = m_Groups[subscription.group];
+		TUInt32 firstUnread = subscription.nextSequence - channel.firstSequence;
+		if (firstUnread < channel.messages.size())
+		{
+			*msg = channel.messages[firstUnread];
+			++subscription.nextSequence;
+#if GEN_MESSENGER_STATS
+			RecordFetch( *msg );
+#endif
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns true if a mailbox has unread group messages
+bool CMessenger::HasGroupMessages( SMailbox& mailbox )
+{
+	for (TUInt32 sub = 0; sub < mailbox.subscriptions.size(); ++sub)
+	{
+		SGroupChannel& channel = m_Groups[mailbox.subscriptions[sub].group];
+		if (mailbox.subscriptions[sub].nextSequence - channel.firstSequence < channel.messages.size())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Discard messages from the start of a group channel that every member has read
+void CMessenger::TrimGroup( SGroupChannel& channel )
+{
+	// Find the oldest message that any member has not read. Sequence numbers are compared as
+	// offsets from the start of the channel so they can safely wrap
+	TUInt32 numRead = static_cast<TUInt32>(channel.messages.size());
+	TMessageGroup group = static_cast<TMessageGroup>(&channel - &m_Groups[0]);
+	for (TUInt32 member = 0; member < channel.members.size(); ++member)
+	{
+		vector<SSubscription>& subscriptions = FindMailbox( channel.members[member] )->subscriptions;
+		for (TUInt32 sub = 0; sub < subscriptions.size(); ++sub)
+		{
+			if (subscriptions[sub].group == group)
+			{
+				numRead = min( numRead, subscriptions[sub].nextSequence - channel.firstSequence );
+			}
+		}
+	}
+
+	channel.messages.erase( channel.messages.begin(), channel.messages.begin() + numRead );
+	channel.firstSequence += numRead;
+	channel.trimSize = static_cast<TUInt32>(channel.messages.size()) * 2;
+	if (channel.trimSize < kMinGroupTrimSize)
+	{
+		channel.trimSize = kMinGroupTrimSize;
+	}
+}
+
+#if GEN_MESSENGER_STATS
+// Return a send stamp for the current frame and time
+CMessenger::SSendStamp CMessenger::GetSendStamp()
+{
+	SSendStamp stamp = { m_Stats.numFrames, chrono::steady_clock::now() };
+	return stamp;
+}
+
+// Record the fetch of a direct message along with its latency
+void CMessenger::RecordFetch( const SMessage& msg, const SSendStamp& stamp )
+{
+	++m_Stats.fetched[msg.type];
+
+	TUInt32 frames = m_Stats.numFrames - stamp.frame;
+	TFloat64 seconds = chrono::duration<TFloat64>( chrono::steady_clock::now() - stamp.time ).count();
+	++m_Stats.numLatencySamples;
+	m_Stats.totalLatencyFrames += frames;
+	m_Stats.totalLatencySeconds += seconds;
+	if (frames > m_Stats.peakLatencyFrames)
+	{
+		m_Stats.peakLatencyFrames = frames;
+	}
+	if (seconds > m_Stats.peakLatencySeconds)
+	{
+		m_Stats.peakLatencySeconds = seconds;
+	}
+}
+
+// Record the number of queued messages at a buffer swap
+void CMessenger::RecordQueueDepth()
+{
+	TUInt32 depth = static_cast<TUInt32>(m_Advisory.size());
+	for (TUInt32 page = 0; page < m_MailboxPages.size(); ++page)
+	{
+		if (m_MailboxPages[page].mailboxes)
+		{
+			for (TUInt32 mailbox = 0; mailbox < kMailboxPageSize; ++mailbox)
+			{
+				depth += m_MailboxPages[page].mailboxes[mailbox].count;
+			}
+		}
+	}
+
+	m_Stats.totalQueueDepth += depth;
+	if (depth > m_Stats.peakQueueDepth)
+	{
+		m_Stats.peakQueueDepth = depth;
+	}
+
+	// Bucket is the number of bits needed to hold the depth
+	TUInt32 bucket = 0;
+	while (depth > 0 && bucket < SMessengerStats::kNumDepthBuckets - 1)
+	{
+		depth >>= 1;
+		++bucket;
+	}
+	++m_Stats.depthHistogram[bucket];
 }
+#endif
 
 
 
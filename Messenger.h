@@ -6,11 +6,45 @@
 
 #pragma once
 
-#include <map>
+#include <vector>
+#include <type_traits>
 using namespace std;
 
 #include "Defines.h"
 #include "Entity.h"
+#include "TimerWheel.h"
+
+// Set to 1 to build the thread-safe messenger, which allows entities to be updated on several
+// threads at once. Each thread sends into its own outbox and the outboxes are merged in a fixed
+// order when the message buffers are swapped (see Send order below). The thread-safe messenger is
+// always frame phased
+#ifndef GEN_MESSENGER_THREAD_SAFE
+#define GEN_MESSENGER_THREAD_SAFE 0
+#endif
+
+#if GEN_MESSENGER_THREAD_SAFE
+#include <mutex>
+#endif
+
+// Set to 1 to collect messenger statistics (see CMessenger::GetStats). Collected in debug builds
+// by default and compiled out of release builds. The counters are not thread-safe, so statistics
+// are not available in the thread-safe build
+#ifndef GEN_MESSENGER_STATS
+#if defined(_DEBUG) && !GEN_MESSENGER_THREAD_SAFE
+#define GEN_MESSENGER_STATS 1
+#else
+#define GEN_MESSENGER_STATS 0
+#endif
+#endif
+
+#if GEN_MESSENGER_STATS && GEN_MESSENGER_THREAD_SAFE
+#error Messenger statistics are not available in the thread-safe messenger
+#endif
+
+#if GEN_MESSENGER_STATS
+#include <string>
+#include <chrono>
+#endif
 
 namespace gen
 {
@@ -29,45 +63,184 @@ enum EMessageType
 	Msg_Ammo,
 	Msg_AmmoNull,
 	Msg_AmmoIncrease,
-	Msg_Help
+	Msg_Help,
+	Msg_Fire,   // Sent by a tank to itself when it is ready to fire
+	Msg_Expire, // Sent by an entity to itself at the end of its lifetime
+	Msg_Formation, // Gives a tank its target position in a formation
+
+	Msg_NumTypes // Number of message types - keep last
 };
 
-// A message contains a type and the UID that sent it.
-// The message types for this exercise don't currently require extra data, but it is possible
-// to use a union to add additional data for new message types (see the space game code)
+// Message priority lanes. In frame phased mode critical messages are always delivered at the
+// next buffer swap. Advisory messages are delivered after them, up to a budget each frame, with
+// any left over carried to the next frame in the order they were sent
+enum EMessagePriority
+{
+	Priority_Critical,
+	Priority_Advisory
+};
+
+// Return the priority lane for a message type
+EMessagePriority GetMessagePriority( EMessageType type );
+
+// Returns true if a message type is idempotent - receiving it twice from the same sender has the
+// same effect as receiving it once. A direct message of an idempotent type is discarded if the
+// same message from the same sender is still waiting to be fetched by the recipient
+bool IsMessageIdempotent( EMessageType type );
+
+// Return the name of a message type, e.g. "Msg_Hit"
+const char* GetMessageTypeName( EMessageType type );
+
+// A message contains a type, the UID that sent it and a payload of extra data for the type. The
+// payload carries everything the receiver needs, so it never has to look up the sender (which
+// may no longer exist by the time the message is read)
+// Messages are plain data with no constructors, so the compiler-provided copy is a straight
+// block copy. The union members must stay trivially copyable to keep it that way
 struct SMessage
 {
-	// Need to provide copy constructor and assignment operator in case you later add a union to this structure
-	// The compiler does not know which of the union contents are in use so it cannot provide default versions
-	SMessage() {} // Need to explicitly write default constructor when other constructors are provided
-	SMessage(const SMessage& o)
+	//*** Message data
+	EMessageType type;
+	TEntityUID   from;
+
+	// Payload - which member is used depends on the message type
+	union
+	{
+		struct
+		{
+			TFloat32 damage;
+		} hit;                // Msg_Hit
+
+		struct
+		{
+			TFloat32 x, y, z;
+		} position;           // Msg_Ammo (crate position), Msg_Evade (position to move to)
+
+		struct
+		{
+			TEntityUID uid;
+		} target;
+
+		struct
+		{
+			TUInt32 id;
+		} timer;              // Msg_Fire - lets the sender recognise its latest timer
+
+		TUInt8 payload[24];   // Sets the payload size, keeping messages 32 bytes
+	};
+
+	//*** Payload helpers
+	void SetPosition( const CVector3& pos )
+	{
+		position.x = pos.x;
+		position.y = pos.y;
+		position.z = pos.z;
+	}
+	CVector3 GetPosition() const
+	{
+		return CVector3( position.x, position.y, position.z );
+	}
+};
+
+static_assert( sizeof(SMessage) == 32, "SMessage must be 32 bytes" );
+static_assert( is_trivially_copyable<SMessage>::value, "SMessage must be trivially copyable" );
+
+// Message groups allow a single message to be addressed to many entities. Entities join groups
+// through the messenger; the group numbers themselves are just agreed values
+typedef TUInt32 TMessageGroup;
+const TMessageGroup Group_Tanks = 0; // Every tank entity
+const TMessageGroup Group_Team  = 1; // First team group - tanks on team N are in Group_Team + N
+
+
+#if GEN_MESSENGER_STATS
+// Messenger statistics, collected from creation of the messenger or the last ResetStats
+struct SMessengerStats
+{
+	// Number of queue depth histogram buckets. Bucket 0 counts frames with no messages queued,
+	// bucket N counts frames with 2^(N-1) to 2^N - 1 queued. The last bucket also takes any more
+	static const TUInt32 kNumDepthBuckets = 16;
+
+	// Message counts - a group message is counted once when sent and once per member fetching it
+	TUInt32 sent[Msg_NumTypes];
+	TUInt32 fetched[Msg_NumTypes];
+	TUInt32 orphaned; // Messages left unread when their recipient was destroyed
+
+	// Queue depth - direct messages waiting in mailboxes or the advisory lane, sampled at each
+	// buffer swap, so only collected in frame phased mode
+	TUInt32 numFrames;
+	TUInt32 peakQueueDepth;
+	TUInt64 totalQueueDepth;
+	TUInt32 depthHistogram[kNumDepthBuckets];
+
+	// Latency from sending a direct message to fetching it (from falling due for delayed messages)
+	TUInt32  numLatencySamples;
+	TUInt32  peakLatencyFrames;
+	TUInt64  totalLatencyFrames;
+	TFloat64 peakLatencySeconds;
+	TFloat64 totalLatencySeconds;
+
+	TFloat32 AverageQueueDepth() const
+	{
+		return numFrames ? static_cast<TFloat32>(totalQueueDepth) / numFrames : 0.0f;
+	}
+	TFloat32 AverageLatencyFrames() const
 	{
-		memcpy(this, &o, sizeof(SMessage)); // Use of memcpy is only safe if SMessage is a "POD" type - data
-											// only, no members that need construction. A fair restriction
-											// for messages, but does require programmer care.
+		return numLatencySamples ? static_cast<TFloat32>(totalLatencyFrames) / numLatencySamples : 0.0f;
 	}
-	SMessage& operator=(const SMessage& o)
+	TFloat64 AverageLatencySeconds() const
 	{
-		memcpy(this, &o, sizeof(SMessage)); return *this;
+		return numLatencySamples ? totalLatencySeconds / numLatencySamples : 0.0;
 	}
+};
+#endif
 
 
-	//*** Message data
-	EMessageType type;
-	TEntityUID   from;
+// A contiguous run of messages returned by CMessenger::DrainMessages. Can be walked with a
+// range-based for loop. Only valid until the next call to DrainMessages
+struct SMessageRange
+{
+	const SMessage* begin() const { return messages; }
+	const SMessage* end() const { return messages + count; }
+
+	const SMessage* messages;
+	TUInt32         count;
 };
 
 
 // Messenger class allows the sending and receipt of messages between entities - addressed by UID
+// Each UID that has been sent a message owns a mailbox - a FIFO ring buffer of messages. Mailboxes
+// are held in a dense table indexed directly by UID, which is possible because the entity manager
+// hands out UIDs from a single increasing integer
+// Group messages are stored once in a channel for the group. Each member keeps a read position in
+// the channel and picks up the group messages after its own direct messages when it fetches
+// In frame phased mode sent messages are held in a write buffer and only delivered to mailboxes
+// when SwapMessageBuffers is called once per frame. Every message sent during a frame is then
+// seen in the next frame, whatever order entities are updated in
+// In the thread-safe build (see GEN_MESSENGER_THREAD_SAFE above) messages may be sent, fetched
+// and drained from any thread during a frame, as long as each UID's messages are only fetched by
+// one thread. Group membership and SwapMessageBuffers must be used between parallel updates
+// Messages can also be sent with a delay. They wait in a timing wheel, which hands them on for
+// delivery as messenger time is advanced
 class CMessenger
 {
 /////////////////////////////////////
 //	Constructors/Destructors
 public:
 	// Default constructor
-	CMessenger() {}
+	CMessenger() : m_FramePhased( GEN_MESSENGER_THREAD_SAFE != 0 ), m_AdvisoryBudget( kUnlimitedBudget ),
+	               m_TickTime( 0.0f ), m_NumAbsorbed( 0 ), m_NumDeadLetters( 0 )
+	{
+		m_MailboxPages.reserve( kInitialMailboxPages );
+#if GEN_MESSENGER_THREAD_SAFE
+		m_SendPass = 0;
+		m_ID = NewID();
+#endif
+#if GEN_MESSENGER_STATS
+		ResetStats();
+#endif
+	}
 
-	// No destructor needed
+	// Destructor releases mailbox buffers
+	~CMessenger();
 
 private:
 	// Disallow use of copy constructor and assignment operator (private and not defined)
@@ -82,28 +255,466 @@ public:
 	/////////////////////////////////////
 	// Message sending/receiving
 
-	// Send the given message to a particular UID, does not check if the UID exists
+	// Send the given message to a particular UID, does not check if the UID exists. Messages
+	// sent to the SystemUID are discarded - nothing can fetch them
 	void SendMessage( TEntityUID to, const SMessage& msg );
 
+	// Send the given message to every member of a group. The message is stored once however many
+	// members the group has
+	void SendGroupMessage( TMessageGroup group, const SMessage& msg );
+
 	// Fetch the next available message for the given UID, returns the message through the given 
 	// pointer. Returns false if there are no messages for this UID
-	bool FetchMessage( TEntityUID to, SMessage* msg );
+	bool FetchMessage( TEntityUID to, SMessage* msg )
+	{
+		// An empty fetch is a table lookup and a count test - no searching
+		SMailbox* mailboxPtr = FindMailbox( to );
+		if (!mailboxPtr)
+		{
+			return false;
+		}
+		SMailbox& mailbox = *mailboxPtr;
+		if (mailbox.count == 0)
+		{
+			// Direct messages are returned first, then any unread group messages
+			return !mailbox.subscriptions.empty() && FetchGroupMessage( mailbox, msg );
+		}
+
+		// Return oldest message and advance the head of the ring
+		*msg = mailbox.messages[mailbox.head];
+#if GEN_MESSENGER_STATS
+		RecordFetch( *msg, mailbox.stamps[mailbox.head] );
+#endif
+		mailbox.head = (mailbox.head + 1) & (mailbox.capacity - 1);
+		--mailbox.count;
+
+		// Once fetched, the same message can be queued again
+		if (!mailbox.queuedKeys.empty())
+		{
+			RemoveQueuedKey( mailbox, *msg );
+		}
+
+		return true;
+	}
+
+	// Fetch every queued message for the given UID in one call and empty its mailbox. The
+	// messages are returned oldest first as a contiguous range that is only valid until the
+	// next call to DrainMessages. Messages sent while walking the range are queued as normal
+	SMessageRange DrainMessages( TEntityUID to );
+
+	// Returns true if there are messages waiting to be fetched for the given UID
+	bool HasMessages( TEntityUID to )
+	{
+		SMailbox* mailbox = FindMailbox( to );
+		if (!mailbox)
+		{
+			return false;
+		}
+		return mailbox->count > 0 || (!mailbox->subscriptions.empty() && HasGroupMessages( *mailbox ));
+	}
+
+
+	/////////////////////////////////////
+	// Entity destruction
+
+	// Tell the messenger a UID has been destroyed. Its mailbox and any unread messages are
+	// discarded and it leaves all its groups. Messages sent to the UID from then on (including
+	// any already waiting for delivery) are discarded and counted as dead letters
+	void EntityDestroyed( TEntityUID uid );
+
+	// Return number of messages discarded because their recipient had been destroyed
+	TUInt32 NumDeadLetters()
+	{
+		return m_NumDeadLetters;
+	}
+
+
+	/////////////////////////////////////
+	// Delayed messages
+
+	// Send the given message to a UID once the given delay (in seconds) has passed
+	void SendDelayedMessage( TEntityUID to, const SMessage& msg, TFloat32 delay )
+	{
+		SendMessageAt( to, msg, GetTime() + delay );
+	}
+
+	// Send the given message to a UID when messenger time reaches the given time (in seconds)
+	void SendMessageAt( TEntityUID to, const SMessage& msg, TFloat32 time );
+
+	// Return the messenger time in seconds
+	TFloat32 GetTime()
+	{
+		return m_DelayedMessages.GetNow() * kTickLength + m_TickTime;
+	}
+
+	// Advance messenger time, sending any delayed messages that have fallen due. Call once per
+	// frame - before SwapMessageBuffers in frame phased mode so due messages are seen that frame
+	void AdvanceTime( TFloat32 updateTime );
+
+
+	/////////////////////////////////////
+	// Frame phasing
+
+	// Select frame phased delivery. Messages already waiting in the write buffer are delivered
+	// when phasing is turned off. Ignored by the thread-safe messenger, which is always phased
+	void SetFramePhased( bool framePhased );
+
+	bool IsFramePhased()
+	{
+		return m_FramePhased;
+	}
+
+	// Deliver all messages sent since the last call, making them available to fetch. Call once
+	// per frame before entities are updated. Does nothing if not in frame phased mode
+	// Advisory messages beyond the advisory budget are held back until a later call
+	void SwapMessageBuffers();
+
+	// Set the maximum number of advisory messages delivered by each buffer swap (a group message
+	// counts once). Defaults to kUnlimitedBudget
+	void SetAdvisoryBudget( TUInt32 budget )
+	{
+		m_AdvisoryBudget = budget;
+	}
+
+	// Return number of advisory messages held back for a later frame
+	TUInt32 NumHeldAdvisoryMessages()
+	{
+		return static_cast<TUInt32>(m_Advisory.size());
+	}
+
+	// Return number of sends discarded as duplicates of an idempotent message already queued
+	TUInt32 NumAbsorbedMessages()
+	{
+		return m_NumAbsorbed;
+	}
+
+	// Advisory budget value that delivers every advisory message each frame
+	static const TUInt32 kUnlimitedBudget = 0xffffffff;
+
+
+	/////////////////////////////////////
+	// Send order
+
+	// In the thread-safe build, messages are delivered in an order that does not depend on which
+	// threads sent them or when. Parallel work is run in passes, one after another, and each pass
+	// is split into numbered chunks, each run on a single thread. Messages are delivered in pass
+	// order, then chunk order, then the order they were sent. Messages sent outside a chunk come
+	// before the chunks of their pass. Delayed messages falling due start a new pass
+	// In the single-threaded build messages are delivered in the order sent, and these do nothing
+
+#if GEN_MESSENGER_THREAD_SAFE
+	// Start the next pass. Call between parallel passes, when no chunk is running
+	void NextSendPass()
+	{
+		++m_SendPass;
+	}
+
+	// Set the chunk being run on the calling thread, until EndSendChunk
+	void BeginSendChunk( TUInt32 chunk );
+	void EndSendChunk();
+#else
+	void NextSendPass() {}
+	void BeginSendChunk( TUInt32 chunk ) {}
+	void EndSendChunk() {}
+#endif
+
+
+	/////////////////////////////////////
+	// Groups
+
+	// Add the given UID to a group. It will receive group messages sent after it joins
+	void JoinGroup( TEntityUID uid, TMessageGroup group );
+
+	// Remove the given UID from a group, any group messages it has not read are discarded
+	void LeaveGroup( TEntityUID uid, TMessageGroup group );
+
+	// Remove the given UID from all the groups it is in (done by EntityDestroyed)
+	void LeaveAllGroups( TEntityUID uid );
+
+
+#if GEN_MESSENGER_STATS
+	/////////////////////////////////////
+	// Statistics
+
+	const SMessengerStats& GetStats()
+	{
+		return m_Stats;
+	}
+
+	void ResetStats()
+	{
+		m_Stats = SMessengerStats();
+	}
+
+	// Write the statistics to a CSV file, returns false on failure
+	bool WriteStatsCSV( const string& fileName );
+#endif
 
 
 /////////////////////////////////////
 //	Private interface
 private:
 
-	// A multimap has properties similar to a hash map - mapping a key to a value. Here we
-	// have the key as an entity UID and the value as a message for that UID. The stored
-	// key/value pairs in a multimap are sorted by key, which means all the messages for a
-	// particular UID are together. Key look-up is somewhat slower than for a hash map though
-	// Define some types to make usage easier
-	typedef multimap<TEntityUID, SMessage> TMessages;
-	typedef TMessages::iterator TMessageIter;
-    typedef pair<TEntityUID, SMessage> UIDMsgPair; // The type stored by the multimap
+	// Initial number of messages a mailbox can hold before it needs to grow (power of two)
+	static const TUInt32 kInitialMailboxSize = 8;
+
+	// Minimum number of messages a group channel holds before read messages are trimmed from it
+	static const TUInt32 kMinGroupTrimSize = 32;
+
+	// Number of mailboxes in each page of the mailbox table (as a power of two)
+	static const TUInt32 kMailboxPageBits = 8;
+	static const TUInt32 kMailboxPageSize = 1 << kMailboxPageBits;
+
+	// Number of pages the mailbox table has room for up front. UIDs are not reused so the table
+	// grows by a page for every kMailboxPageSize entities ever created, this covers 65536
+	static const TUInt32 kInitialMailboxPages = 256;
+
+	// Resolution of delayed message times in seconds
+	static const TFloat32 kTickLength;
+
+#if GEN_MESSENGER_STATS
+	// When a message was sent, used to measure latency
+	struct SSendStamp
+	{
+		TUInt32                          frame;
+		chrono::steady_clock::time_point time;
+	};
+#endif
+
+	// A message waiting in the write buffer in frame phased mode or in the delayed messages
+	struct SPendingMessage
+	{
+		TEntityUID    to;      // Recipient UID, or SystemUID for a group message
+		TMessageGroup group;   // Recipient group for group messages
+		TUInt32       dueTick; // Delayed messages: tick to deliver on, 0 if not delayed
+		SMessage      msg;
+#if GEN_MESSENGER_STATS
+		SSendStamp    stamp;
+#endif
+#if GEN_MESSENGER_THREAD_SAFE
+		TUInt64       order;   // Pass in the high 32 bits, chunk + 1 (0 outside a chunk) in the low
+#endif
+	};
+
+	// Identifies a queued idempotent message: its type and sender (the recipient owns the mailbox)
+	struct SQueuedKey
+	{
+		EMessageType type;
+		TEntityUID   from;
+	};
+
+	// A group membership, holding the sequence number of the next group message to read
+	struct SSubscription
+	{
+		TMessageGroup group;
+		TUInt32       nextSequence;
+	};
+
+	// A mailbox is a ring buffer of messages for one UID. The capacity is always a power of two
+	// so wrapping is a mask rather than a modulo. The buffer is kept when the mailbox empties, so
+	// once an entity's mailbox has reached its working size sending no longer allocates
+	struct SMailbox
+	{
+		SMailbox() : messages( 0 ), capacity( 0 ), head( 0 ), count( 0 ), destroyed( false )
+		{
+#if GEN_MESSENGER_STATS
+			stamps = 0;
+#endif
+		}
+
+		SMessage* messages; // Ring buffer, 0 until first message is sent to this UID
+		TUInt32   capacity; // Size of ring buffer
+		TUInt32   head;     // Index of oldest message
+		TUInt32   count;    // Number of queued messages
+#if GEN_MESSENGER_STATS
+		SSendStamp* stamps; // Send stamp for each message in the ring buffer
+#endif
+
+		vector<SSubscription> subscriptions; // Groups this UID is a member of
+
+		// Idempotent direct messages that have been accepted for this UID (in the mailbox or the
+		// advisory lane) and not yet fetched. Only a handful at once so a linear search is used
+		vector<SQueuedKey> queuedKeys;
+
+		bool destroyed; // UID has been destroyed, messages to it are dead letters
+	};
+
+	// The mailbox table is split into pages, allocated when a UID in the page is first used. As
+	// UIDs are never reused, a page is freed once every UID in it has been destroyed, so the
+	// memory used stays flat however many short-lived entities come and go. Freed pages are kept
+	// and reused for new pages
+	struct SMailboxPage
+	{
+		SMailbox* mailboxes;    // 0 if not yet allocated or freed
+		TUInt32   numDestroyed; // Number of destroyed UIDs, page is freed when it reaches the page size
+	};
+
+	// A group channel holds the group messages that have not yet been read by every member.
+	// Messages are numbered with increasing sequence numbers, messages[0] having firstSequence
+	struct SGroupChannel
+	{
+		SGroupChannel() : firstSequence( 0 ), trimSize( kMinGroupTrimSize ) {}
+
+		vector<SMessage>   messages;
+		TUInt32            firstSequence;
+		TUInt32            trimSize; // Channel size that triggers the next trim
+		vector<TEntityUID> members;
+	};
+
+	// Return the write buffer for the calling thread
+#if GEN_MESSENGER_THREAD_SAFE
+	vector<SPendingMessage>& GetOutbox();
+#else
+	vector<SPendingMessage>& GetOutbox()
+	{
+		return m_Outbox;
+	}
+#endif
+
+	// Return the buffer used by DrainMessages on the calling thread
+#if GEN_MESSENGER_THREAD_SAFE
+	vector<SMessage>& GetDrainBuffer();
+#else
+	vector<SMessage>& GetDrainBuffer()
+	{
+		return m_Drained;
+	}
+#endif
+
+	// Return a pending message with the given recipient, delivery tick and message
+	SPendingMessage MakePending( TEntityUID to, TMessageGroup group, TUInt32 dueTick, const SMessage& msg );
+
+	// Add a direct message to its recipient's mailbox or a message to a group channel, making it
+	// available to fetch
+	void DeliverMessage( const SPendingMessage& pending );
+	void DeliverGroupMessage( TMessageGroup group, const SMessage& msg );
+
+	// Return the mailbox for a UID, or 0 if its page has not been allocated or has been freed
+	SMailbox* FindMailbox( TEntityUID uid )
+	{
+		TUInt32 page = uid >> kMailboxPageBits;
+		if (page >= m_MailboxPages.size() || !m_MailboxPages[page].mailboxes)
+		{
+			return 0;
+		}
+		return &m_MailboxPages[page].mailboxes[uid & (kMailboxPageSize - 1)];
+	}
+
+	// Return the mailbox for a UID, allocating its page if necessary. Returns 0 if the page has
+	// been freed because every UID in it has been destroyed
+	SMailbox* GetMailbox( TEntityUID uid );
+
+	// Release a mailbox's message buffers
+	void FreeMailbox( SMailbox& mailbox );
+
+	// Double the size of a full mailbox, unwrapping the messages to the start of the new buffer
+	void GrowMailbox( SMailbox& mailbox );
+
+	// Release a mailbox ring buffer with the given capacity. Buffers of the initial size are kept
+	// for reuse, most mailboxes never grow beyond it
+	void ReleaseBuffer( SMessage* messages, TUInt32 capacity );
+
+	// Fetch the next unread group message for a mailbox that has no direct messages
+	bool FetchGroupMessage( SMailbox& mailbox, SMessage* msg );
+
+	// Returns true if a mailbox has unread group messages
+	bool HasGroupMessages( SMailbox& mailbox );
+
+	// Pass a pending message on for delivery - to the write buffer in frame phased mode or
+	// straight to a mailbox/group otherwise
+	void DeliverPending( const SPendingMessage& pending );
+
+	// Deliver up to the given number of held advisory messages, oldest first
+	void DeliverAdvisory( TUInt32 budget );
+
+	// Returns true if a direct message is an idempotent duplicate of one already queued for the
+	// recipient, counting it as absorbed. Otherwise records the message as queued if idempotent
+	bool Coalesce( TEntityUID to, const SMessage& msg );
+
+	// Forget a fetched message's queued key, if it has one
+	void RemoveQueuedKey( SMailbox& mailbox, const SMessage& msg );
+
+#if GEN_MESSENGER_STATS
+	// Return a send stamp for the current frame and time
+	SSendStamp GetSendStamp();
+
+	// Record the fetch of a message, with its send stamp for direct messages
+	void RecordFetch( const SMessage& msg, const SSendStamp& stamp );
+	void RecordFetch( const SMessage& msg )
+	{
+		++m_Stats.fetched[msg.type];
+	}
+
+	// Record the number of queued messages at a buffer swap
+	void RecordQueueDepth();
+#endif
+
+	// Discard messages from the start of a group channel that every member has read
+	void TrimGroup( SGroupChannel& channel );
+
+	// Pages of mailboxes, indexed by UID / kMailboxPageSize
+	vector<SMailboxPage> m_MailboxPages;
+
+	// Freed pages and initial size ring buffers kept for reuse, so entities coming and going don't
+	// allocate a new page or buffer each time
+	vector<SMailbox*> m_FreePages;
+	vector<SMessage*> m_FreeBuffers;
+
+	// Group channels indexed by group number
+	vector<SGroupChannel> m_Groups;
+
+	// Frame phased mode and the write buffer of messages sent this frame
+	bool                    m_FramePhased;
+	vector<SPendingMessage> m_Outbox;
+
+	// Advisory messages waiting for delivery, oldest first, and the number delivered per frame
+	vector<SPendingMessage> m_Advisory;
+	TUInt32                 m_AdvisoryBudget;
+
+	// Delayed messages waiting for their time, and time since the wheel's current tick
+	CTimerWheel<SPendingMessage> m_DelayedMessages;
+	TFloat32                     m_TickTime;
+
+	// Number of idempotent sends discarded as duplicates, and messages to destroyed UIDs discarded
+	TUInt32 m_NumAbsorbed;
+	TUInt32 m_NumDeadLetters;
+
+#if GEN_MESSENGER_STATS
+	SMessengerStats m_Stats;
+#endif
+
+	// Messages from the most recent DrainMessages call. Drained messages are copied here so the
+	// mailbox can accept new messages while the caller is still processing the range
+	vector<SMessage> m_Drained;
+
+#if GEN_MESSENGER_THREAD_SAFE
+	// Per-thread write and drain buffers and the chunk the thread is running (+ 1, 0 for none). A
+	// thread's buffers are created the first time it uses the messenger, which is the only time
+	// the lock is taken
+	struct SThreadBuffers
+	{
+		SThreadBuffers() : sendChunk( 0 ) {}
+
+		vector<SPendingMessage> outbox;
+		vector<SMessage>        drained;
+		TUInt32                 sendChunk;
+	};
+	SThreadBuffers* GetThreadBuffers();
+
+	// Returns true if the first pending message is delivered before the second
+	static bool SendsBefore( const SPendingMessage& a, const SPendingMessage& b );
+
+	vector<SThreadBuffers*> m_ThreadBuffers;
+	mutex                   m_ThreadBuffersLock;
+
+	// Unique ID of this messenger, threads remember the buffers of the last messenger they used
+	// by ID as a later messenger may have the same address
+	TUInt32 m_ID;
+	static TUInt32 NewID();
 
-	TMessages m_Messages;
+	// Current send pass, restarted at each buffer swap
+	TUInt32 m_SendPass;
+#endif
 };
 
 
@@ -0,0 +1,181 @@
+/*******************************************
+	ProjectileSystem.cpp
+
+	Packed storage and movement for
+	projectiles
+********************************************/
+
+#include "ProjectileSystem.h"
+
+namespace gen
+{
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Constructor reserves space for projectiles
+CProjectileSystem::CProjectileSystem()
+{
+	m_PositionsX.reserve( kInitialCapacity );
+	m_PositionsY.reserve( kInitialCapacity );
+	m_PositionsZ.reserve( kInitialCapacity );
+	m_VelocitiesX.reserve( kInitialCapacity );
+	m_VelocitiesY.reserve( kInitialCapacity );
+	m_VelocitiesZ.reserve( kInitialCapacity );
+	m_Lifetimes.reserve( kInitialCapacity );
+	m_HitRadii.reserve( kInitialCapacity );
+	m_Damages.reserve( kInitialCapacity );
+	m_Owners.reserve( kInitialCapacity );
+	m_Targets.reserve( kInitialCapacity );
+	m_Templates.reserve( kInitialCapacity );
+}
+
+
+/////////////////////////////////////
+// Creation / removal
+
+// Add a projectile using the given template's mesh, moving with the given velocity until its
+// lifetime runs out. Returns the index of the new projectile
+TUInt32 CProjectileSystem::Add( CEntityTemplate* projectileTemplate, const CVector3& position,
+                                const CVector3& velocity, TFloat32 lifetime, TFloat32 hitRadius,
+                                TFloat32 damage, SEntityHandle owner, const SGridFilter& targets )
+{
+	m_PositionsX.push_back( position.x );
+	m_PositionsY.push_back( position.y );
+	m_PositionsZ.push_back( position.z );
+	m_VelocitiesX.push_back( velocity.x );
+	m_VelocitiesY.push_back( velocity.y );
+	m_VelocitiesZ.push_back( velocity.z );
+	m_Lifetimes.push_back( lifetime );
+	m_HitRadii.push_back( hitRadius );
+	m_Damages.push_back( damage );
+	m_Owners.push_back( owner );
+	m_Targets.push_back( targets );
+	m_Templates.push_back( projectileTemplate );
+	return static_cast<TUInt32>(m_Lifetimes.size()) - 1;
+}
+
+// Remove the projectile at the given index, the last projectile is moved into its place
+void CProjectileSystem::Remove( TUInt32 index )
+{
+	TUInt32 last = static_cast<TUInt32>(m_Lifetimes.size()) - 1;
+	m_PositionsX[index] = m_PositionsX[last];
+	m_PositionsY[index] = m_PositionsY[last];
+	m_PositionsZ[index] = m_PositionsZ[last];
+	m_VelocitiesX[index] = m_VelocitiesX[last];
+	m_VelocitiesY[index] = m_VelocitiesY[last];
+	m_VelocitiesZ[index] = m_VelocitiesZ[last];
+	m_Lifetimes[index] = m_Lifetimes[last];
+	m_HitRadii[index] = m_HitRadii[last];
+	m_Damages[index] = m_Damages[last];
+	m_Owners[index] = m_Owners[last];
+	m_Targets[index] = m_Targets[last];
+	m_Templates[index] = m_Templates[last];
+
+	m_PositionsX.pop_back();
+	m_PositionsY.pop_back();
+	m_PositionsZ.pop_back();
+	m_VelocitiesX.pop_back();
+	m_VelocitiesY.pop_back();
+	m_VelocitiesZ.pop_back();
+	m_Lifetimes.pop_back();
+	m_HitRadii.pop_back();
+	m_Damages.pop_back();
+	m_Owners.pop_back();
+	m_Targets.pop_back();
+	m_Templates.pop_back();
+}
+
+// Remove all projectiles
+void CProjectileSystem::RemoveAll()
+{
+	m_PositionsX.clear();
+	m_PositionsY.clear();
+	m_PositionsZ.clear();
+	m_VelocitiesX.clear();
+	m_VelocitiesY.clear();
+	m_VelocitiesZ.clear();
+	m_Lifetimes.clear();
+	m_HitRadii.clear();
+	m_Damages.clear();
+	m_Owners.clear();
+	m_Targets.clear();
+	m_Templates.clear();
+}
+
+
+/////////////////////////////////////
+// Update / Rendering
+
+// Reduce the lifetime of all projectiles by the given time and remove those that have expired
+void CProjectileSystem::Age( TFloat32 updateTime )
+{
+	TUInt32 numProjectiles = NumProjectiles();
+	TFloat32* lifetimes = m_Lifetimes.data();
+	for (TUInt32 projectile = 0; projectile < numProjectiles; ++projectile)
+	{
+		lifetimes[projectile] -= updateTime;
+	}
+
+	// Remove from the end, so the projectile moved into a removed one's place has been checked
+	for (TUInt32 projectile = numProjectiles; projectile > 0; --projectile)
+	{
+		if (lifetimes[projectile - 1] <= 0.0f)
+		{
+			Remove( projectile - 1 );
+		}
+	}
+}
+
+// Move all projectiles along their velocity for the given time. One loop per axis, so each loop
+// only reads and writes two arrays
+void CProjectileSystem::Move( TFloat32 updateTime )
+{
+	TUInt32 numProjectiles = NumProjectiles();
+	TFloat32* positions = m_PositionsX.data();
+	const TFloat32* velocities = m_VelocitiesX.data();
+	for (TUInt32 projectile = 0; projectile < numProjectiles; ++projectile)
+	{
+		positions[projectile] += velocities[projectile] * updateTime;
+	}
+	positions = m_PositionsY.data();
+	velocities = m_VelocitiesY.data();
+	for (TUInt32 projectile = 0; projectile < numProjectiles; ++projectile)
+	{
+		positions[projectile] += velocities[projectile] * updateTime;
+	}
+	positions = m_PositionsZ.data();
+	velocities = m_VelocitiesZ.data();
+	for (TUInt32 projectile = 0; projectile < numProjectiles; ++projectile)
+	{
+		positions[projectile] += velocities[projectile] * updateTime;
+	}
+}
+
+// Render all projectiles, facing their direction of travel
+// The mesh interface has no instanced rendering, so each projectile is still rendered on its
+// own, but its matrices are built in a working list rather than stored for every projectile
+void CProjectileSystem::Render()
+{
+	for (TUInt32 projectile = 0; projectile < NumProjectiles(); ++projectile)
+	{
+		CMesh* mesh = m_Templates[projectile]->Mesh();
+		TUInt32 numNodes = mesh->GetNumNodes();
+		if (m_RenderMatrices.size() < numNodes)
+		{
+			m_RenderMatrices.resize( numNodes );
+		}
+
+		m_RenderMatrices[0] = MatrixTranslation( GetPosition( projectile ) );
+		m_RenderMatrices[0].FaceDirection( GetVelocity( projectile ) );
+		for (TUInt32 node = 1; node < numNodes; ++node)
+		{
+			m_RenderMatrices[node] = mesh->GetNode( node ).positionMatrix *
+			                         m_RenderMatrices[mesh->GetNode( node ).parent];
+		}
+		mesh->Render( &m_RenderMatrices[0] );
+	}
+}
+
+
+} // namespace gen
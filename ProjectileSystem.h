@@ -0,0 +1,150 @@
+/*******************************************
+	ProjectileSystem.h
+
+	Packed storage and movement for
+	projectiles
+********************************************/
+
+#pragma once
+
+#include <vector>
+using namespace std;
+
+#include "Defines.h"
+#include "CVector3.h"
+#include "CMatrix4x4.h"
+#include "Entity.h"
+#include "SpatialGrid.h"
+
+
+constexpr float SHELL_LIFESPAN = 3.0f;
+constexpr float SHELL_SPEED = 25.0f;
+constexpr float SHELL_SIZE = .75f;
+
+namespace gen
+{
+
+// The projectile system holds projectiles such as shells, which only need a position, velocity,
+// lifetime and what to do when they hit something. Rather than being entities, with a name,
+// matrices and an update function each, projectiles are kept in packed arrays with one array per
+// field. All projectiles are moved and aged by simple loops over the arrays that the compiler can
+// vectorise, and the fields needed only for hits and rendering are not touched by those loops
+// A projectile is removed by moving the last projectile into its place, so the arrays stay packed
+// but a projectile's index changes when another is removed. Projectiles have no UID
+class CProjectileSystem
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Constructor reserves space for projectiles
+	CProjectileSystem();
+
+	// No destructor needed
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CProjectileSystem( const CProjectileSystem& );
+	CProjectileSystem& operator=( const CProjectileSystem& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	/////////////////////////////////////
+	// Creation / removal
+
+	// Add a projectile using the given template's mesh, moving with the given velocity until its
+	// lifetime runs out. It hits entities matching the target filter within the hit radius of it,
+	// other than its owner, causing the given damage. Returns the index of the new projectile
+	TUInt32 Add( CEntityTemplate* projectileTemplate, const CVector3& position, const CVector3& velocity,
+	             TFloat32 lifetime, TFloat32 hitRadius, TFloat32 damage, SEntityHandle owner,
+	             const SGridFilter& targets );
+
+	// Remove the projectile at the given index, the last projectile is moved into its place
+	void Remove( TUInt32 index );
+
+	// Remove all projectiles
+	void RemoveAll();
+
+
+	/////////////////////////////////////
+	// Update / Rendering
+
+	// Reduce the lifetime of all projectiles by the given time and remove those that have expired
+	void Age( TFloat32 updateTime );
+
+	// Move all projectiles along their velocity for the given time
+	void Move( TFloat32 updateTime );
+
+	// Render all projectiles, facing their direction of travel
+	void Render();
+
+
+	/////////////////////////////////////
+	// Access
+
+	// Return the number of projectiles
+	TUInt32 NumProjectiles()
+	{
+		return static_cast<TUInt32>(m_Lifetimes.size());
+	}
+
+	// Return the position and velocity of the projectile at the given index
+	CVector3 GetPosition( TUInt32 index )
+	{
+		return CVector3( m_PositionsX[index], m_PositionsY[index], m_PositionsZ[index] );
+	}
+	CVector3 GetVelocity( TUInt32 index )
+	{
+		return CVector3( m_VelocitiesX[index], m_VelocitiesY[index], m_VelocitiesZ[index] );
+	}
+
+	// Return the hit details of the projectile at the given index
+	TFloat32 GetHitRadius( TUInt32 index )
+	{
+		return m_HitRadii[index];
+	}
+	TFloat32 GetDamage( TUInt32 index )
+	{
+		return m_Damages[index];
+	}
+	SEntityHandle GetOwner( TUInt32 index )
+	{
+		return m_Owners[index];
+	}
+	const SGridFilter& GetTargets( TUInt32 index )
+	{
+		return m_Targets[index];
+	}
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Number of projectiles to reserve space for
+	static const TUInt32 kInitialCapacity = 1024;
+
+	// Movement, used by every update
+	vector<TFloat32> m_PositionsX;
+	vector<TFloat32> m_PositionsY;
+	vector<TFloat32> m_PositionsZ;
+	vector<TFloat32> m_VelocitiesX;
+	vector<TFloat32> m_VelocitiesY;
+	vector<TFloat32> m_VelocitiesZ;
+	vector<TFloat32> m_Lifetimes;
+
+	// Hits
+	vector<TFloat32>      m_HitRadii;
+	vector<TFloat32>      m_Damages;
+	vector<SEntityHandle> m_Owners;
+	vector<SGridFilter>   m_Targets;
+
+	// Rendering - the template of each projectile and a working list of node matrices
+	vector<CEntityTemplate*> m_Templates;
+	vector<CMatrix4x4>       m_RenderMatrices;
+};
+
+
+} // namespace gen
@@ -0,0 +1,183 @@
+/*******************************************
+	SpatialGrid.cpp
+
+	Uniform spatial hash grid for entity
+	proximity queries
+********************************************/
+
+#include "SpatialGrid.h"
+
+namespace gen
+{
+
+// Cell size in world units. Cells a little smaller than the common query ranges keep the number
+// of cells visited and the number of entities per cell both low
+const TFloat32 CSpatialGrid::kCellSize = 10.0f;
+
+
+/////////////////////////////////////
+// Entries
+
+// Add an entity at the given position, with its template type ID and team for filtering
+void CSpatialGrid::Insert( SEntityHandle handle, const CVector3& position, TUInt32 typeID, TUInt32 team )
+{
+	if (handle.slot >= m_Locations.size())
+	{
+		SLocation noLocation = { kNumBuckets, 0 };
+		m_Locations.resize( handle.slot + 1, noLocation );
+	}
+
+	SEntry entry = { handle, position, CellCoord( position.x ), CellCoord( position.z ), typeID, team };
+	Link( entry );
+}
+
+// Remove an entity from the grid
+void CSpatialGrid::Remove( SEntityHandle handle )
+{
+	if (handle.slot < m_Locations.size() && m_Locations[handle.slot].bucket != kNumBuckets)
+	{
+		Unlink( handle.slot );
+		m_Locations[handle.slot].bucket = kNumBuckets;
+	}
+}
+
+// Update the position of an entity, moving it to another cell only if it has left its cell
+void CSpatialGrid::Move( SEntityHandle handle, const CVector3& position )
+{
+	SLocation& location = m_Locations[handle.slot];
+	SEntry& entry = m_Buckets[location.bucket][location.index];
+	entry.position = position;
+
+	TInt32 cellX = CellCoord( position.x );
+	TInt32 cellZ = CellCoord( position.z );
+	if (cellX != entry.cellX || cellZ != entry.cellZ)
+	{
+		SEntry moved = entry;
+		moved.cellX = cellX;
+		moved.cellZ = cellZ;
+		Unlink( handle.slot );
+		Link( moved );
+	}
+}
+
+// Remove all entities
+void CSpatialGrid::Clear()
+{
+	for (TUInt32 bucket = 0; bucket < kNumBuckets; ++bucket)
+	{
+		m_Buckets[bucket].clear();
+	}
+	m_Locations.clear();
+}
+
+
+// Add an entry to the bucket for its cell
+void CSpatialGrid::Link( const SEntry& entry )
+{
+	TUInt32 bucket = Bucket( entry.cellX, entry.cellZ );
+	SLocation& location = m_Locations[entry.handle.slot];
+	location.bucket = bucket;
+	location.index = static_cast<TUInt32>(m_Buckets[bucket].size());
+	m_Buckets[bucket].push_back( entry );
+}
+
+// Take an entry out of its bucket, moving the last entry of the bucket into the gap
+void CSpatialGrid::Unlink( TUInt32 slot )
+{
+	const SLocation& location = m_Locations[slot];
+	vector<SEntry>& bucket = m_Buckets[location.bucket];
+	if (location.index != bucket.size() - 1)
+	{
+		bucket[location.index] = bucket.back();
+		m_Locations[bucket.back().handle.slot].index = location.index;
+	}
+	bucket.pop_back();
+}
+
+
+/////////////////////////////////////
+// Queries
+
+// Call the given function for each entry in cells overlapping the given XZ range
+template <class TFunc>
+void CSpatialGrid::VisitCells( const CVector3& minBounds, const CVector3& maxBounds, TFunc& visit )
+{
+	TInt32 minX = CellCoord( minBounds.x );
+	TInt32 maxX = CellCoord( maxBounds.x );
+	TInt32 minZ = CellCoord( minBounds.z );
+	TInt32 maxZ = CellCoord( maxBounds.z );
+
+	// A range covering more cells than there are buckets would visit buckets more than once, so
+	// visit every bucket once instead, testing all entries
+	if (static_cast<TUInt32>(maxX - minX + 1) * static_cast<TUInt32>(maxZ - minZ + 1) >= kNumBuckets)
+	{
+		for (TUInt32 bucket = 0; bucket < kNumBuckets; ++bucket)
+		{
+			for (TUInt32 entry = 0; entry < m_Buckets[bucket].size(); ++entry)
+			{
+				visit( m_Buckets[bucket][entry] );
+			}
+		}
+		return;
+	}
+
+	for (TInt32 cellZ = minZ; cellZ <= maxZ; ++cellZ)
+	{
+		for (TInt32 cellX = minX; cellX <= maxX; ++cellX)
+		{
+			// Skip entries from other cells sharing the bucket
+			const vector<SEntry>& bucket = m_Buckets[Bucket( cellX, cellZ )];
+			for (TUInt32 entry = 0; entry < bucket.size(); ++entry)
+			{
+				if (bucket[entry].cellX == cellX && bucket[entry].cellZ == cellZ)
+				{
+					visit( bucket[entry] );
+				}
+			}
+		}
+	}
+}
+
+
+// Add handles of entities matching the filter within the given distance of a point to the
+// given list (the list is not cleared first)
+void CSpatialGrid::QueryRadius( const CVector3& centre, TFloat32 radius, const SGridFilter& filter,
+                                vector<SEntityHandle>& found )
+{
+	// Visit the cells overlapping the circle's bounding square, then test the actual distance
+	CVector3 extent( radius, radius, radius );
+	TFloat32 radiusSquared = radius * radius;
+	auto visit = [&]( const SEntry& entry )
+	{
+		if (Matches( entry, filter ))
+		{
+			CVector3 offset = entry.position - centre;
+			if (offset.x * offset.x + offset.y * offset.y + offset.z * offset.z <= radiusSquared)
+			{
+				found.push_back( entry.handle );
+			}
+		}
+	};
+	VisitCells( centre - extent, centre + extent, visit );
+}
+
+// Add handles of entities matching the filter inside the given axis-aligned box to the given
+// list (the list is not cleared first)
+void CSpatialGrid::QueryBox( const CVector3& minBounds, const CVector3& maxBounds, const SGridFilter& filter,
+                             vector<SEntityHandle>& found )
+{
+	auto visit = [&]( const SEntry& entry )
+	{
+		if (Matches( entry, filter ) &&
+		    entry.position.x >= minBounds.x && entry.position.x <= maxBounds.x &&
+		    entry.position.y >= minBounds.y && entry.position.y <= maxBounds.y &&
+		    entry.position.z >= minBounds.z && entry.position.z <= maxBounds.z)
+		{
+			found.push_back( entry.handle );
+		}
+	};
+	VisitCells( minBounds, maxBounds, visit );
+}
+
+
+} // namespace gen
@@ -0,0 +1,159 @@
+/*******************************************
+	SpatialGrid.h
+
+	Uniform spatial hash grid for entity
+	proximity queries
+********************************************/
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+using namespace std;
+
+#include "Defines.h"
+#include "CVector3.h"
+#include "Entity.h"
+
+namespace gen
+{
+
+// Team number for entities that are not on a team
+const TUInt32 kNoTeam = 0xffffffff;
+
+// Filter for grid queries - an entity matches if it has the given template type and is on (or
+// with otherTeams set, not on) the given team
+struct SGridFilter
+{
+	TUInt32 typeID;     // Template type ID, or kNoTemplateID for any type
+	TUInt32 team;       // Team number, or kNoTeam for any team
+	bool    otherTeams; // Match entities that are not on the team instead
+};
+
+
+// The spatial grid divides the ground plane (XZ) into square cells and keeps a list of the
+// entities in each cell, so a query only visits entities in the cells it overlaps rather than
+// every entity. Cells are hashed into a fixed number of buckets, so the world is unbounded and
+// no memory is used for empty space. Several cells may share a bucket, each entry records its
+// cell so queries skip entries from other cells
+// Entities are identified by handle, their slot number is used to find their entry in the grid
+class CSpatialGrid
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Default constructor, gives each bucket room for a few entries up front so entities moving
+	// between cells rarely need a bucket to grow
+	CSpatialGrid()
+	{
+		for (TUInt32 bucket = 0; bucket < kNumBuckets; ++bucket)
+		{
+			m_Buckets[bucket].reserve( kInitialBucketSize );
+		}
+	}
+
+	// No destructor needed
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CSpatialGrid( const CSpatialGrid& );
+	CSpatialGrid& operator=( const CSpatialGrid& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	/////////////////////////////////////
+	// Entries
+
+	// Add an entity at the given position, with its template type ID and team for filtering
+	void Insert( SEntityHandle handle, const CVector3& position, TUInt32 typeID, TUInt32 team );
+
+	// Remove an entity from the grid
+	void Remove( SEntityHandle handle );
+
+	// Update the position of an entity, moving it to another cell only if it has left its cell
+	void Move( SEntityHandle handle, const CVector3& position );
+
+	// Remove all entities
+	void Clear();
+
+
+	/////////////////////////////////////
+	// Queries
+
+	// Add handles of entities matching the filter within the given distance of a point to the
+	// given list (the list is not cleared first)
+	void QueryRadius( const CVector3& centre, TFloat32 radius, const SGridFilter& filter,
+	                  vector<SEntityHandle>& found );
+
+	// Add handles of entities matching the filter inside the given axis-aligned box to the given
+	// list (the list is not cleared first)
+	void QueryBox( const CVector3& minBounds, const CVector3& maxBounds, const SGridFilter& filter,
+	               vector<SEntityHandle>& found );
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Cell size, number of buckets (as a power of two) and entries reserved in each bucket
+	static const TUInt32 kBucketBits = 8;
+	static const TUInt32 kNumBuckets = 1 << kBucketBits;
+	static const TUInt32 kInitialBucketSize = 8;
+	static const TFloat32 kCellSize;
+
+	// An entity in a bucket, with a copy of the data queries test
+	struct SEntry
+	{
+		SEntityHandle handle;
+		CVector3      position;
+		TInt32        cellX;
+		TInt32        cellZ;
+		TUInt32       typeID;
+		TUInt32       team;
+	};
+
+	// Where an entity's entry is, indexed by entity slot
+	struct SLocation
+	{
+		TUInt32 bucket;
+		TUInt32 index;
+	};
+
+	// Return the cell coordinate containing the given world coordinate
+	TInt32 CellCoord( TFloat32 coord )
+	{
+		return static_cast<TInt32>(floor( coord / kCellSize ));
+	}
+
+	// Return the bucket for the given cell
+	TUInt32 Bucket( TInt32 cellX, TInt32 cellZ )
+	{
+		TUInt32 hash = static_cast<TUInt32>(cellX) * 73856093u ^ static_cast<TUInt32>(cellZ) * 19349663u;
+		return (hash ^ (hash >> kBucketBits)) & (kNumBuckets - 1);
+	}
+
+	// Add an entry to the bucket for its cell / take an entry out of its bucket
+	void Link( const SEntry& entry );
+	void Unlink( TUInt32 slot );
+
+	// Return true if an entry matches a query filter
+	bool Matches( const SEntry& entry, const SGridFilter& filter )
+	{
+		return (filter.typeID == kNoTemplateID || entry.typeID == filter.typeID) &&
+		       (filter.team == kNoTeam || (entry.team == filter.team) != filter.otherTeams);
+	}
+
+	// Call the given function for each entry in cells overlapping the given XZ range
+	template <class TFunc>
+	void VisitCells( const CVector3& minBounds, const CVector3& maxBounds, TFunc& visit );
+
+	// Buckets of entries and the location of each entity's entry
+	vector<SEntry>    m_Buckets[kNumBuckets];
+	vector<SLocation> m_Locations;
+};
+
+
+} // namespace gen
@@ -17,6 +17,7 @@ using namespace std;
 #include "Light.h"
 #include "EntityManager.h"
 #include "Messenger.h"
+#include "LineOfSight.h"
 #include "TankAssignment.h"
 
 namespace gen
@@ -64,6 +65,9 @@ extern CMessenger Messenger;
 // Entity manager
 CEntityManager EntityManager;
 
+// Line of sight against static scenery
+CLineOfSight LineOfSight;
+
 // Tank UIDs
 constexpr int tankCount = 8;
 int deadTanks = 0;
@@ -85,16 +89,36 @@ int NumUpdateTimes = 0;
 float AverageUpdateTime = -1.0f; // Invalid value at first
 
 bool extraInfo = false;
+#if GEN_MESSENGER_STATS
+bool messengerStats = false; //Messenger statistics overlay
+#endif
+#if GEN_COUNT_ALLOCATIONS
+TUInt64 updateAllocations = 0; //Heap allocations made by the last entity update, should stay at 0 during play
+#endif
 int tankSelected = -1;
 
 int currentCamera = 0;
 float ammoRespawn = 0;
 constexpr float AMMO_SPAWN_RATE = 10.0f;
+constexpr TUInt32 ADVISORY_MESSAGE_BUDGET = 64; //Help and ammo messages delivered per frame, the rest wait
+constexpr TUInt32 THINK_BUDGET = 32; //Tanks searching for targets or planning per frame, the rest wait
 
 //-----------------------------------------------------------------------------
 // Scene management
 //-----------------------------------------------------------------------------
 
+// Add all entities with the given template to the line of sight occluders, using their mesh
+// bounding radius multiplied by the given factor
+void BakeOccluders(const string& templateName, float radiusFactor)
+{
+	TUInt32 nameID = EntityManager.FindTemplateNameID(templateName);
+	for (TUInt32 n = 0; n < EntityManager.NumEntitiesOfTemplate(nameID); ++n)
+	{
+		CEntity* entity = EntityManager.GetEntityAtIndex(EntityManager.GetIndexOfTemplate(nameID, n));
+		LineOfSight.AddOccluder(entity->Position(), entity->Template()->Mesh()->BoundingRadius() * radiusFactor);
+	}
+}
+
 // Creates the scene geometry
 bool SceneSetup()
 {
@@ -127,6 +151,15 @@ bool SceneSetup()
 			                        CVector3(0.0f, Random(0.0f, 2.0f * kfPi), 0.0f) );
 	}
 
+	// Bake the scenery that blocks tanks' view. Only a tree's trunk blocks it, not the whole mesh
+	LineOfSight.Clear();
+	BakeOccluders("Building", 1.0f);
+	BakeOccluders("Tree", 0.25f);
+	LineOfSight.Bake();
+
+	// Shells are stopped by the same scenery
+	EntityManager.SetShotScenery(&LineOfSight);
+
 
 	/////////////////////////////////
 	// Create tank templates
@@ -189,6 +222,15 @@ bool SceneSetup()
 		SecondaryCameras[i]->SetNearFarClip(1.0f, 20000.0f);
 	}
 
+	// Deliver messages once per frame so entities see the same messages whatever their update order
+	Messenger.SetFramePhased(true);
+#if GEN_MESSENGER_THREAD_SAFE
+	// The thread-safe messenger allows entities to be updated on every core
+	EntityManager.SetUpdateThreads(0);
+#endif
+	Messenger.SetAdvisoryBudget(ADVISORY_MESSAGE_BUDGET);
+	EntityManager.SetThinkBudget(THINK_BUDGET);
+
 	// Sunlight and light in building
 	Lights[0] = new CLight(CVector3(-5000.0f, 4000.0f, -10000.0f), SColourRGBA(1.0f, 0.9f, 0.6f), 15000.0f);
 	Lights[1] = new CLight(CVector3(6.0f, 7.5f, 40.0f), SColourRGBA(1.0f, 0.0f, 0.0f), 1.0f);
@@ -220,8 +262,10 @@ void SceneShutdown()
 	}
 
 	// Destroy all entities
+	EntityManager.SetShotScenery(0);
 	EntityManager.DestroyAllEntities();
 	EntityManager.DestroyAllTemplates();
+	LineOfSight.Clear();
 }
 
 
@@ -293,7 +337,8 @@ void RenderScene( float updateTime )
 	SetAmbientLight(AmbientLight);
 	SetLights(&Lights[0]);
 
-	// Render entities and draw on-screen text
+	// Bring entity matrices up to date, then render entities and draw on-screen text
+	EntityManager.UpdateTransforms();
 	EntityManager.RenderAllEntities();
 	RenderSceneText( updateTime );
 
@@ -336,15 +381,20 @@ void RenderSceneText( float updateTime )
 	if (AverageUpdateTime >= 0.0f)
 	{
 		outText << "Frame Time: " << AverageUpdateTime * 1000.0f << "ms" << endl << "FPS:" << 1.0f / AverageUpdateTime;
+#if GEN_COUNT_ALLOCATIONS
+		outText << endl << "Update allocations: " << updateAllocations;
+#endif
 		RenderText( outText.str(), 2, 2, 0.0f, 0.0f, 0.0f );
 		RenderText( outText.str(), 0, 0, 1.0f, 1.0f, 0.0f );
 		outText.str("");
-		int loopLimit = EntityManager.NumEntities();
-		for (int i = 0; i < loopLimit; ++i)
+		//Only tanks have text, so visit just the tank entities
+		TUInt32 tankType = EntityManager.FindTemplateTypeID("Tank");
+		TUInt32 loopLimit = EntityManager.NumEntitiesOfType(tankType);
+		for (TUInt32 tank = 0; tank < loopLimit; ++tank)
 		{
-			
+			TUInt32 i = EntityManager.GetIndexOfType(tankType, tank);
 			CEntity* temp = EntityManager.GetEntityAtIndex(i);
-			CVector3* tempPos = &temp->Position();
+			const CVector3* tempPos = &EntityManager.GetEntityPosition(i);
 			bool ifCamera = false;
 
 			int X, Y;
@@ -364,47 +414,83 @@ void RenderSceneText( float updateTime )
 			}
 
 
-			string ifTrue = temp->Template()->GetType();
-
+			CTankEntity* tankAccess = static_cast<CTankEntity*>(temp);
+			if (extraInfo)
+			{
+					outText << temp->Template()->GetName().c_str() << " " << temp->GetName().c_str() <<
+						"\nHealth: " << tankAccess->GetHealth() << "\nAmmo: " <<
+						tankAccess->GetMaxAmmoCount() - tankAccess->GetAmmoCount() << "/"
+						<< tankAccess->GetMaxAmmoCount() << "\nShells shot: " <<
+						tankAccess->GetBullets();
+					
+			}
+			else
+			{
+				outText << temp->Template()->GetName().c_str() << " " << temp->GetName().c_str();
+			}
 
-			if (ifTrue == "Tank")
+			if (tankAccess->ifCurrentlySelected())
 			{
-				CTankEntity* tankAccess = static_cast<CTankEntity*>(temp);
-				if (extraInfo)
-				{
-						outText << temp->Template()->GetName().c_str() << " " << temp->GetName().c_str() <<
-							"\nHealth: " << tankAccess->GetHealth() << "\nAmmo: " <<
-							tankAccess->GetMaxAmmoCount() - tankAccess->GetAmmoCount() << "/"
-							<< tankAccess->GetMaxAmmoCount() << "\nShells shot: " <<
-							tankAccess->GetBullets();
-						
-				}
-				else
-				{
-					outText << temp->Template()->GetName().c_str() << " " << temp->GetName().c_str();
-				}
+				RenderText(outText.str(), X, Y, 1.0f, .6f, 0.6f, 1);
+				outText.str("");
+			}
+			else
+			{
+				RenderText(outText.str(), X, Y, 0.6f, 1.0f, 0.6f, 1);
+				outText.str("");
+			}
+		}
 
-				if (tankAccess->ifCurrentlySelected())
-				{
-					RenderText(outText.str(), X, Y, 1.0f, .6f, 0.6f, 1);
-					outText.str("");
-				}
-				else
-				{
-					RenderText(outText.str(), X, Y, 0.6f, 1.0f, 0.6f, 1);
-					outText.str("");
-				}
+		outText.str("");
+
+		//Tanks in each state and the time taken by each state's update pass
+		if (extraInfo)
+		{
+			outText << "Tank states";
+			for (TUInt32 state = 0; state < CTankEntity::kNumStates; ++state)
+			{
+				outText << "\n" << CTankEntity::GetStateName(state) << ": " << EntityManager.NumTanksInState(state) <<
+					" (" << EntityManager.GetTankStateTime(state) * 1000.0f << "ms)";
 			}
+			RenderText(outText.str(), ViewportWidth - 198, 2, 0.0f, 0.0f, 0.0f);
+			RenderText(outText.str(), ViewportWidth - 200, 0, 1.0f, 1.0f, 0.0f);
+			outText.str("");
 		}
+	}
 
+#if GEN_MESSENGER_STATS
+	//Message traffic, to find which behaviours are sending the most
+	if (messengerStats)
+	{
+		const SMessengerStats& stats = Messenger.GetStats();
+		outText << "Messages (sent/fetched)";
+		for (TUInt32 type = 0; type < Msg_NumTypes; ++type)
+		{
+			if (stats.sent[type] > 0 || stats.fetched[type] > 0)
+			{
+				outText << "\n" << GetMessageTypeName(static_cast<EMessageType>(type)) << ": " << stats.sent[type] << "/" << stats.fetched[type];
+			}
+		}
+		outText << "\nQueue depth: " << stats.peakQueueDepth << " peak, " << stats.AverageQueueDepth() << " average" <<
+			"\nLatency: " << stats.AverageLatencyFrames() << " frames, " << stats.AverageLatencySeconds() * 1000.0 << "ms average" <<
+			"\nOrphaned: " << stats.orphaned << "\nDead letters: " << Messenger.NumDeadLetters() <<
+			"\nAbsorbed: " << Messenger.NumAbsorbedMessages() <<
+			"\nHeld advisory: " << Messenger.NumHeldAdvisoryMessages();
+		RenderText(outText.str(), 2, 52, 0.0f, 0.0f, 0.0f);
+		RenderText(outText.str(), 0, 50, 1.0f, 1.0f, 0.0f);
 		outText.str("");
 	}
+#endif
 }
 
 
 // Update the scene between rendering
 void UpdateScene( float updateTime )
 {
+	// Send delayed messages that are now due, then make messages sent last frame available to
+	// entities this frame
+	Messenger.AdvanceTime( updateTime );
+	Messenger.SwapMessageBuffers();
 
 	//39-40%
 	if (ammoRespawn >= AMMO_SPAWN_RATE)
@@ -421,8 +507,18 @@ void UpdateScene( float updateTime )
 	}
 
 
+	// Tanks near the camera being viewed through think on every frame, those further away less often
+	CCamera* viewCamera = (currentCamera == tankCount) ? MainCamera : SecondaryCameras[currentCamera];
+	EntityManager.SetThinkViewpoint(viewCamera->Position());
+
 	// Call all entity update functions
+#if GEN_COUNT_ALLOCATIONS
+	TUInt64 allocationsBefore = GetNumHeapAllocations();
+	EntityManager.UpdateAllEntities( updateTime );
+	updateAllocations = GetNumHeapAllocations() - allocationsBefore;
+#else
 	EntityManager.UpdateAllEntities( updateTime );
+#endif
 
 	// Set camera speeds
 	// Key F1 used for full screen toggle
@@ -437,12 +533,15 @@ void UpdateScene( float updateTime )
 	}
 	else
 	{
-		CEntity* CameraPosition = EntityManager.GetEntityAtIndex(TankID[currentCamera]);
-
-		SecondaryCameras[currentCamera]->Matrix() = CameraPosition->Matrix();
+		//The camera stays where it was once its tank is destroyed
+		CEntity* CameraPosition = EntityManager.GetEntity(TankID[currentCamera]);
+		if (CameraPosition != nullptr)
+		{
+			SecondaryCameras[currentCamera]->Matrix() = CameraPosition->Matrix();
 
-		SecondaryCameras[currentCamera]->Matrix().MoveLocal(CVector3(0.0f,6.5f,-25.0f));
-		SecondaryCameras[currentCamera]->Matrix().FaceTarget(CameraPosition->Position());
+			SecondaryCameras[currentCamera]->Matrix().MoveLocal(CVector3(0.0f,6.5f,-25.0f));
+			SecondaryCameras[currentCamera]->Matrix().FaceTarget(CameraPosition->Position());
+		}
 	}
 
 
@@ -454,6 +553,18 @@ void UpdateScene( float updateTime )
 		extraInfo = !extraInfo;
 	}
 
+#if GEN_MESSENGER_STATS
+	//Messenger statistics overlay, and save them to file
+	if (KeyHit(Key_F4))
+	{
+		messengerStats = !messengerStats;
+	}
+	if (KeyHit(Key_F5))
+	{
+		Messenger.WriteStatsCSV("MessengerStats.csv");
+	}
+#endif
+
 	//Return to main camera
 	if (KeyHit(Key_5))
 	{
@@ -504,8 +615,6 @@ void UpdateScene( float updateTime )
 		{
 		
 			//The entire plane, on the Y axis, is around 0 and so it should be based around that value.
-			CTankEntity* TankEntity = static_cast<CTankEntity*>(EntityManager.GetEntityAtIndex(TankID[tankSelected]));
-
 			float multiplier = 0;
 			CVector3 inputCalc = cameraPtr->Position();
 
@@ -516,7 +625,12 @@ void UpdateScene( float updateTime )
 			inputCalc -= temp * multiplier;
 
 
-			TankEntity->setTarget(inputCalc);
+			//Send the tank to the clicked point
+			SMessage msg;
+			msg.type = Msg_Evade;
+			msg.from = SystemUID;
+			msg.SetPosition(inputCalc);
+			Messenger.SendMessage(TankID[tankSelected], msg);
 			tankSelected = -1;
 		}
 		else
@@ -531,7 +645,12 @@ void UpdateScene( float updateTime )
 			{
 				for (int i = 0; i < tankCount; ++i)
 				{
-					CVector3 currentTank = EntityManager.GetEntityAtIndex(TankID[i])->Position();
+					CEntity* tankEntity = EntityManager.GetEntity(TankID[i]);
+					if (tankEntity == nullptr)
+					{
+						continue; //Destroyed
+					}
+					CVector3 currentTank = tankEntity->Position();
 					tempCalc = cameraPtr->Position() - (temp * j);
 
 					if (currentTank.x + TANK_RADIUS > tempCalc.x &&
@@ -546,7 +665,7 @@ void UpdateScene( float updateTime )
 						SMessage msg;
 						msg.type = Msg_Selected;
 						msg.from = SystemUID;
-						Messenger.SendMessage(EntityManager.GetEntityAtIndex(TankID[i])->GetUID(), msg);
+						Messenger.SendMessage(TankID[i], msg);
 					}
 				}
 			}
@@ -556,13 +675,12 @@ void UpdateScene( float updateTime )
 
 	if (KeyHit(Key_E) && tankSelected != -1)
 	{
-		static_cast<CTankEntity*>(
-			EntityManager.GetEntityAtIndex(TankID[tankSelected]))->setTarget(CVector3(Random(-40,40),0, Random(-40, 40)));
-		//Send a message to the tank so it shows as selected.
+		//Send the tank to a random position
 		SMessage msg;
 		msg.type = Msg_Evade;
 		msg.from = SystemUID;
-		Messenger.SendMessage(EntityManager.GetEntityAtIndex(TankID[tankSelected])->GetUID(), msg);
+		msg.SetPosition(CVector3(Random(-40,40),0, Random(-40, 40)));
+		Messenger.SendMessage(TankID[tankSelected], msg);
 		tankSelected = -1;
 	}
 
@@ -570,35 +688,21 @@ void UpdateScene( float updateTime )
 
 	if (KeyHit(Key_1))
 	{
-		for (int i = 0; i < EntityManager.NumEntities(); ++i)
-		{
-			string typeSearch = EntityManager.GetEntityAtIndex(i)->Template()->GetType();
-			if (typeSearch == "Tank")
-			{
-				SMessage msg;
+		SMessage msg;
 
-				msg.type = Msg_Go;
+		msg.type = Msg_Go;
 
-				msg.from = SystemUID;
-				Messenger.SendMessage(EntityManager.GetEntityAtIndex(i)->GetUID(), msg);
-			}
-		}
+		msg.from = SystemUID;
+		Messenger.SendGroupMessage(Group_Tanks, msg);
 	}
 
 	// Stop
 	if (KeyHit(Key_2))
 	{
-		for (int i = 0; i < EntityManager.NumEntities(); ++i)
-		{
-			string typeSearch = EntityManager.GetEntityAtIndex(i)->Template()->GetType();
-			if (typeSearch == "Tank")
-			{
-				SMessage msg;
-				msg.type = Msg_Stop;
-				msg.from = SystemUID;
-				Messenger.SendMessage(EntityManager.GetEntityAtIndex(i)->GetUID(), msg);
-			}
-		}
+		SMessage msg;
+		msg.type = Msg_Stop;
+		msg.from = SystemUID;
+		Messenger.SendGroupMessage(Group_Tanks, msg);
 	}
 
 }
@@ -22,18 +22,24 @@
 //   of a matrix. This can be used on the *relative* turret matrix to help in rotating it to face
 //   forwards in Evade state
 
-// - The CShellEntity class is simply an outline. To support shell firing, you will need to add
-//   member data to it and rewrite its constructor & update function. You will also need to update 
-//   the CreateShell function in EntityManager.cpp to pass any additional constructor data required
+// - Shells are not entities, they are projectiles held in packed arrays by the entity manager (see
+//   ProjectileSystem.h). Fire one with EntityManager.CreateShell, the manager moves it and sends
+//   Msg_Hit to any tank it hits
 // - Destroy an entity by returning false from its Update function - the entity manager wil perform
-//   the destruction. Don't try to call DestroyEntity from within the Update function.
+//   the destruction. DestroyEntity may also be called during an update (e.g. from a tank state's
+//   update), the entity is destroyed once the update is finished
+// - Tank behaviour is a table of states (see CTankEntity::kStates). Change state with ChangeState,
+//   not by setting m_State - the entity manager keeps the tanks in each state together
 // - As entities can be destroyed, you must check that entity UIDs refer to existant entities, before
 //   using their entity pointers. The return value from EntityManager.GetEntity will be NULL if the
 //   entity no longer exists. Use this to avoid trying to target a tank that no longer exists etc.
 
+#include <algorithm>
+
 #include "TankEntity.h"
 #include "EntityManager.h"
 #include "Messenger.h"
+#include "LineOfSight.h"
 
 namespace gen
 {
@@ -46,6 +52,9 @@ extern CEntityManager EntityManager;
 // Messenger class for sending messages to and between entities
 extern CMessenger Messenger;
 
+// Line of sight tests against the static scenery, from TankAssignment.cpp
+extern CLineOfSight LineOfSight;
+
 // Helper function made available from TankAssignment.cpp - gets UID of tank A (team 0) or B (team 1).
 // Will be needed to implement the required tank behaviour in the Update function below
 extern TEntityUID GetTankUID(int team);
@@ -81,9 +90,30 @@ CTankEntity::CTankEntity
 	m_Speed = 0.0f;
 	m_HP = m_TankTemplate->GetMaxHP();
 	m_State = Stop;
-	m_Timer = 0.0f;
+	m_RandomSeed = UID;
 	currentPos = 0;
 	tankPatrol = patrolList;
+
+	// Crate templates are created before any tanks
+	m_CrateType = EntityManager.FindTemplateTypeID("Buff");
+
+	// Receive messages addressed to all tanks and to this tank's team
+	Messenger.JoinGroup(UID, Group_Tanks);
+	Messenger.JoinGroup(UID, Group_Team + team);
+
+	//Target searches and scavenge planning are only done when the entity manager lets the tank think
+	EnableThinking();
+}
+
+// Tanks are allocated from the entity manager's tank pool
+void* CTankEntity::operator new(size_t size)
+{
+	return EntityManager.TankPool().Allocate(size);
+}
+
+void CTankEntity::operator delete(void* block, size_t size)
+{
+	EntityManager.TankPool().Free(block, size);
 }
 
 
@@ -94,48 +124,57 @@ CTankEntity::CTankEntity
 void CTankEntity::getMessager()
 {
 
-	// Fetch any messages
-	SMessage msg;
-	while (Messenger.FetchMessage(GetUID(), &msg))
+	// Fetch all messages in one call and walk them as an array
+	for (const SMessage& msg : Messenger.DrainMessages(GetUID()))
 	{
 		// Set state variables based on received messages
 		switch (msg.type)
 		{
 		case Msg_Go:
-			m_State = Active;
+			ChangeState(Active);
 			break;
 		case Msg_Evade:
-			m_State = Evade;
+			setTarget(msg.GetPosition());
 			break;
 		case Msg_Stop:
-			m_State = Stop;
+			ChangeState(Stop);
 			break;
 		case Msg_Selected:
 			isSelected = true;
 			break;
+		case Msg_Fire:
+			//Ignore reload timers from earlier firing states
+			if (msg.timer.id == m_FireTimer)
+			{
+				isReloaded = true;
+			}
+			break;
 		case Msg_Hit:
-			//Grab damage from Shell class
-			m_HP -= static_cast<CShellEntity*>(EntityManager.GetEntity(msg.from))->getDamage();
+			//Damage is carried by the message, the shell may already be gone
+			m_HP -= msg.hit.damage;
 
 			isHelp = true;
 			break;
 		case Msg_Ammo:
-
-			availableCrates.push_back(EntityManager.GetEntity(msg.from));
+		{
+			//Crates don't move so remember where it is along with its UID
+			SCrate crate = { msg.from, msg.GetPosition() };
+			availableCrates.push_back(crate);
 
 			if (m_ShellCount > TANK_AMMO_LIMIT * 0.9f) //If less than 90% ammo
 			{
-				m_State = Scavenge;
+				ChangeState(Scavenge);
 			}
 			break;
+		}
 		case Msg_AmmoNull:
 
 			for (int i = 0; i < availableCrates.size(); ++i)
 			{
 				//If ammo null then remove the ammo box from the pool of options
-				if (availableCrates[i]->GetUID() == msg.from)
+				if (availableCrates[i].uid == msg.from)
 				{
-					CEntity* temp = availableCrates.back();
+					SCrate temp = availableCrates.back();
 
 					availableCrates.back() = availableCrates[i];
 
@@ -148,7 +187,11 @@ void CTankEntity::getMessager()
 			break;
 		case Msg_Help:
 			//Will force a shot, if possible, but make the tank alert for new upcoming chances.
-			m_State = Active;
+			ChangeState(Active);
+			break;
+		case Msg_Formation:
+			//Another tank has given this tank its place in a formation
+			target = CVector2(msg.GetPosition().x, msg.GetPosition().z);
 			break;
 		}
 	}
@@ -160,9 +203,10 @@ void CTankEntity::getMessager()
 constexpr float ACTIVE_ROTATION_SPEED_MULT = 1.3f;
 void CTankEntity::tankTurretRotation(float& updateTime)
 {
-	if (EntityManager.GetEntity(entityTarget) != nullptr)
+	CEntity* targetEntity = EntityManager.GetEntity(entityTarget);
+	if (targetEntity != nullptr)
 	{
-		CVector3 TargetVector = Normalise((Matrix(2) * Matrix()).Position() - EntityManager.GetEntity(entityTarget)->Position());
+		CVector3 TargetVector = Normalise((Matrix(2) * Matrix()).Position() - EntityManager.GetEntityPosition(entityTarget));
 
 		TFloat32 leftRightRotation = (Dot(TargetVector, (Matrix(2) * Matrix()).XAxis()));
 
@@ -193,7 +237,8 @@ void CTankEntity::tankRotation(float& updateTime)
 
 	TFloat32 leftRightRotation = (Dot(TargetVector, Matrix().XAxis()));
 
-	float RadianRotationMax = (acos(Dot(Matrix().ZAxis(), TargetVector)));
+	//Rounding can take the dot product of unit vectors just past 1, where acos is undefined
+	float RadianRotationMax = (acos(min(max(Dot(Matrix().ZAxis(), TargetVector), -1.0f), 1.0f)));
 
 	float turnSpeed = RadianRotationMax;
 
@@ -247,7 +292,7 @@ void CTankEntity::tankPatrolBounds()
 	if (target.y + TANK_RADIUS >= Position().z && target.y - TANK_RADIUS <= Position().z &&
 		target.x + TANK_RADIUS >= Position().x && target.x - TANK_RADIUS <= Position().x)
 	{
-		m_State = Active;
+		ChangeState(Active);
 		target = CVector2(tankPatrol[currentPos].x, tankPatrol[currentPos].z);
 		++currentPos;
 		if (currentPos >= tankPatrol.size())
@@ -257,89 +302,74 @@ void CTankEntity::tankPatrolBounds()
 	}
 }
 
+//A simple linear congruential generator, the same for every tank so results are repeatable
+TFloat32 CTankEntity::RandomInRange(TFloat32 min, TFloat32 max)
+{
+	m_RandomSeed = m_RandomSeed * 1664525u + 1013904223u;
+	return min + (max - min) * static_cast<TFloat32>(m_RandomSeed >> 8) / static_cast<TFloat32>(1 << 24);
+}
+
 bool CTankEntity::activeIsTarget(float& updateTime)
 {
 	CMatrix4x4 GlobalTankHead = Matrix() * Matrix(2);
-	constexpr float Error_margin = .025;
 
 	CTankTemplate* TemplateAccess = static_cast<CTankTemplate*>(Template());
 
-	for (int i = 0; i < EntityManager.NumEntities(); ++i)
+	TUInt32 tankType = Template()->GetTypeID();
+
+	//A tank that has been hit calls out to every enemy tank, wherever it is
+	if (isHelp)
 	{
+		for (TUInt32 tank = 0; tank < EntityManager.NumEntitiesOfType(tankType); ++tank)
+		{
+			CEntity* EntityMatrix = EntityManager.GetEntityAtIndex(EntityManager.GetIndexOfType(tankType, tank));
+			if (!static_cast<CTankEntity*>(EntityMatrix)->isSameTeam(m_Team))
+			{
+				SMessage Msg;
+
+				Msg.from = this->GetUID();
+				Msg.type = Msg_Help;
+
+				Messenger.SendMessageA(EntityMatrix->GetUID(), Msg);
+			}
+		}
+		isHelp = false;
+	}
+
+	//Only tanks within range are visited, found with the entity manager's spatial grid. Formation
+	//partners are closer than the firing range so they are found by the same query
+	isEnemyInRange = false;
+	SGridFilter tankFilter = { tankType, kNoTeam, false };
+	m_Nearby.clear();
+	EntityManager.QueryRadius(Position(), static_cast<float>(TANK_RANGE_MULT), tankFilter, m_Nearby);
+
+	for (TUInt32 tank = 0; tank < m_Nearby.size(); ++tank)
+	{
+		CEntity* EntityMatrix = EntityManager.GetEntity(m_Nearby[tank]);
 	
-		if (EntityManager.GetEntityAtIndex(i) != nullptr)
+		if (EntityMatrix != nullptr)
 		{
 
-			if (EntityManager.GetEntityAtIndex(i)->Template()->GetType() == "Tank" &&
-				EntityManager.GetEntityAtIndex(i) != this)
+			if (EntityMatrix != this)
 			{
-				CEntity* EntityMatrix = EntityManager.GetEntityAtIndex(i);
 				CTankEntity* EnemyAccess = static_cast<CTankEntity*>(EntityMatrix);
 
+				//Other tanks may be updating at the same time, so read their position from the entity manager's
+				//packed positions, which don't change during updates
+				const CVector3& EnemyPosition = EntityManager.GetEntityPosition(m_Nearby[tank]);
+
 				if (!EnemyAccess->isSameTeam(m_Team))
 				{
-					float targetDistance = Distance(EntityMatrix->Position(), this->Position());
+					float targetDistance = Distance(EnemyPosition, this->Position());
 
 					//If the target is within range
 					if (targetDistance < TANK_RANGE_MULT)
 					{
+						isEnemyInRange = true;
 						
 
-						//Set a boolean allowing access to the firing section.
-						bool isNotBlocked = true;
-						for (int j = NULL; j < EntityManager.NumEntities(); ++j)
-						{
-							//Grab every entity and test each building
-							string typeSearch = EntityManager.GetEntityAtIndex(j)->GetName();
-							if (typeSearch == "Building")
-							{
-								//These will need to be set once per building		
-								//A copied Matrix to simulate collision
-								CMatrix4x4 headRotation = Matrix(2);
-								//The buildings collision values
-								CVector3 buildingPos = EntityManager.GetEntityAtIndex(j)->Position();
-								float BuildingRadius = EntityManager.GetEntityAtIndex(j)->Template()->Mesh()->BoundingRadius();
-
-
-								//Test if a fake matrix, stored earlier, collides with the building as it moves forward
-								int loopLimit = 5;//Distance(buildingPos, Matrix().Position());
-
-
-								int distanceComparison = Distance((Matrix(1) * Matrix()).Position(), buildingPos);
-								for (int k = NULL; k < loopLimit; ++k)
-								{
-									//Move the fake matrix forward
-									headRotation.MoveLocalZ(1.0f);
-									//Multiply it by the origin matrix to make it a global position
-									CVector3 tempCalc = headRotation.Position() + Matrix(0).Position();
-
-									float distanceBetweenPoints = Distance(tempCalc, buildingPos);
-									if (distanceBetweenPoints <= distanceComparison)
-									{
-										++loopLimit;
-									}
-			
-									if (tempCalc.x <= buildingPos.x + (Error_margin + BuildingRadius) &&
-										tempCalc.y <= buildingPos.y + (Error_margin + BuildingRadius)&&
-										tempCalc.z <= buildingPos.z + (Error_margin + BuildingRadius)&& 
-										tempCalc.x >= buildingPos.x - (Error_margin + BuildingRadius) &&
-										tempCalc.y >= buildingPos.y - (Error_margin + BuildingRadius) &&
-										tempCalc.z >= buildingPos.z - (Error_margin + BuildingRadius))
-									{
-										//Disable access to the firing section
-										isNotBlocked = false;
-										//Disable the loop early
-										k = loopLimit;
-									}
-									else
-									{
-										distanceComparison = distanceBetweenPoints;
-									}
-
-								}
-							}
-
-						}
+						//Buildings and trees block the shot, tested against the line of sight grid baked from the scenery
+						bool isNotBlocked = LineOfSight.IsClear(Position(), EnemyPosition);
 
 
 
@@ -348,13 +378,13 @@ bool CTankEntity::activeIsTarget(float& updateTime)
 
 
 
-							CVector3 TargetVector = Normalise(EntityMatrix->Matrix().Position() - (Matrix(2) * Matrix()).Position());
+							CVector3 TargetVector = Normalise(EnemyPosition - (Matrix(2) * Matrix()).Position());
 
 							TFloat32 leftRightRotation = ToDegrees(acos(Dot(TargetVector, Matrix(2).XAxis())));
 
 							if (abs(leftRightRotation) <= 15.0f)
 							{
-								entityTarget = EntityMatrix->GetUID();
+								entityTarget = EntityMatrix->GetHandle();
 								return true;
 							}
 
@@ -364,31 +394,45 @@ bool CTankEntity::activeIsTarget(float& updateTime)
 
 					}
 				}
-				else if (Distance(this->Position(), EnemyAccess->Position()) < TANK_RADIUS)
+				else if (Distance(this->Position(), EnemyPosition) < TANK_RADIUS)
 				{
 					for (int i = 0; i < 3; ++i)
 					{
-						if (m_LocalFormPos[i] == -1)
+						if (m_LocalFormPos[i] == NullEntityHandle)
 						{	
-							m_LocalFormPos[i] = EnemyAccess->GetUID();
+							m_LocalFormPos[i] = EnemyAccess->GetHandle();
 							//EnemyAccess->target = EnemyAccess->target + LocalFormation[i];
 							if (i != 0)
 							{
-								CEntity* EntityMatrix1 = EntityManager.GetEntityAtIndex(m_LocalFormPos[0]);
+								//Either tank may have been destroyed since it was recorded
+								CEntity* EntityMatrix1 = EntityManager.GetEntity(m_LocalFormPos[0]);
 								CTankEntity* EnemyAccess1 = static_cast<CTankEntity*>(EntityMatrix1);
 
-								CEntity* EntityMatrix2 = EntityManager.GetEntityAtIndex(m_LocalFormPos[1]);
+								CEntity* EntityMatrix2 = EntityManager.GetEntity(m_LocalFormPos[1]);
 								CTankEntity* EnemyAccess2 = static_cast<CTankEntity*>(EntityMatrix2);
 
-								m_LocalFormPos[2] = GetUID();
+								m_LocalFormPos[2] = GetHandle();
 
-								target = target + LocalFormation[i];
-								EnemyAccess1->target = (target + LocalFormation[0]);
-								EnemyAccess2->target = (target + LocalFormation[1]);
+								if (EnemyAccess1 != nullptr && EnemyAccess2 != nullptr)
+								{
+									//The other tanks are told their place in the formation rather than having it set directly
+									target = target + LocalFormation[i];
+									SMessage Msg;
+									Msg.from = GetUID();
+									Msg.type = Msg_Formation;
+
+									CVector2 formationTarget = target + LocalFormation[0];
+									Msg.SetPosition(CVector3(formationTarget.x, 0.0f, formationTarget.y));
+									Messenger.SendMessageA(EnemyAccess1->GetUID(), Msg);
+
+									formationTarget = target + LocalFormation[1];
+									Msg.SetPosition(CVector3(formationTarget.x, 0.0f, formationTarget.y));
+									Messenger.SendMessageA(EnemyAccess2->GetUID(), Msg);
+								}
 
 								for (int i = 0; i < 3; ++i)
 								{
-									m_LocalFormPos[i] = -1;
+									m_LocalFormPos[i] = NullEntityHandle;
 								}
 							}
 
@@ -398,15 +442,6 @@ bool CTankEntity::activeIsTarget(float& updateTime)
 					}
 
 
-				}
-				if (isHelp && !EnemyAccess->isSameTeam(m_Team))
-				{
-					SMessage Msg;
-
-					Msg.from = this->GetUID();
-					Msg.type = Msg_Help;
-
-					Messenger.SendMessageA(EnemyAccess->GetUID(), Msg);
 				}
 				//else
 				//{
@@ -418,187 +453,273 @@ bool CTankEntity::activeIsTarget(float& updateTime)
 
 		}
 	}
-	isHelp = false;
 
 
 	return false; //No targers were found. 
 
 }
 
+// Update the tank - processes the tank's messages, which may change its state. The behaviour for
+// the tank's state is updated afterwards by UpdateStates
+// Return false if the entity is to be destroyed
 bool CTankEntity::Update(TFloat32 updateTime)
 {
-
-
 	getMessager();
 
+	//A destroyed tank shrinks away in the Dying state, whatever its messages asked for
 	if (m_HP <= 0)
 	{
-		if (m_Scale >= 0)
+		ChangeState(Dying);
+	}
+	return true; //The Dying state destroys the tank
+}
+
+
+/////////////////////////////////////
+// State machine
+
+// The table of tank states - the name and update function of each state, indexed by state
+const CTankEntity::SStateInfo CTankEntity::kStates[CTankEntity::kNumStates] =
+{
+	{ "Stop",     &CTankEntity::UpdateStop },
+	{ "Evade",    &CTankEntity::UpdateEvade },
+	{ "Active",   &CTankEntity::UpdateActive },
+	{ "Firing",   &CTankEntity::UpdateFiring },
+	{ "Scavenge", &CTankEntity::UpdateScavenge },
+	{ "Dying",    &CTankEntity::UpdateDying },
+};
+
+// Return the name of the given state
+const char* CTankEntity::GetStateName(TUInt32 state)
+{
+	return (state < kNumStates) ? kStates[state].name : "N/A";
+}
+
+// Update the given tanks, which must all be in the given state, with that state's update function
+// Sleeping tanks are skipped, as are tanks already updated in this frame's passes
+void CTankEntity::UpdateStates(TUInt32 state, CTankEntity* const* tanks, TUInt32 numTanks, TUInt32 frame, TFloat32 updateTime)
+{
+	//Every tank in the pass runs the same function, so it is looked up once
+	TStateUpdate update = kStates[state].update;
+	for (TUInt32 tank = 0; tank < numTanks; ++tank)
+	{
+		if (!tanks[tank]->IsAsleep() && tanks[tank]->m_StateFrame != frame)
+		{
+			tanks[tank]->m_StateFrame = frame;
+			(tanks[tank]->*update)(updateTime);
+		}
+	}
+}
+
+// Change to the given state. The entity manager makes the change after the update or state pass
+// it is made in, so the rest of this update is in the current state. Dying is final
+void CTankEntity::ChangeState(EState state)
+{
+	if (m_State != Dying)
+	{
+		EntityManager.ChangeTankState(this, state);
+	}
+}
+
+
+//A stopped tank waits for orders, it is woken when a message arrives or a crate is created in
+//reach. It stays awake while it has crates in reach, until it has collected them
+void CTankEntity::UpdateStop(TFloat32 updateTime)
+{
+	m_Speed = 0;
+	FinishStateUpdate(updateTime);
+	if (m_Nearby.empty())
+	{
+		Sleep();
+	}
+}
+
+//Patrol and aim
+void CTankEntity::UpdateActive(TFloat32 updateTime)
+{
+	
+	// Cycle speed up and down using a sine wave - just demonstration behaviour
+	//**** Variations on this sine wave code does not count as patrolling - for the
+	//**** assignment the tank must move naturally between two specific points
+
+
+	tankRotation(updateTime);
+	tankPatrolBounds();
+
+	//Aim State. Searching for a target is the expensive part of a tank's update, it is spread
+	//over frames by the entity manager's think scheduling. The turret keeps turning meanwhile
+	if (IsThinking() && activeIsTarget(updateTime))
+	{
+		//If the tank tries to fire with no ammo the it'll go scavenge instead
+		if (m_AmmoCount <= TANK_AMMO_LIMIT)
 		{
-			m_Scale -= 0.1f * updateTime;
-			Matrix().Scale(m_Scale);
+			m_Speed = 0;
+			//Then rotate the tank head towards target
+			tankTurretRotation(updateTime);
+
+			//Fire once reloaded, the tank is sent a message when the time is up
+			SMessage Msg;
+			Msg.from = GetUID();
+			Msg.type = Msg_Fire;
+			Msg.timer.id = ++m_FireTimer;
+			Messenger.SendDelayedMessage(GetUID(), Msg, TANK_FIRERATE);
+			isReloaded = false;
+
+			ChangeState(Firing);
+			++m_AmmoCount;
 		}
 		else
 		{
-			return false;
+			ChangeState(Scavenge);
 		}
 	}
 	else
 	{
-		// Tank behaviour
-		// Only move if in Go state
-		if (m_State == Active)
-		{
-			
-			// Cycle speed up and down using a sine wave - just demonstration behaviour
-			//**** Variations on this sine wave code does not count as patrolling - for the
-			//**** assignment the tank must move naturally between two specific points
+		//Patrol state
+		CTankTemplate* TemplateAccess = static_cast<CTankTemplate*>(Template());
+		float rotateAmount = TemplateAccess->GetTurretTurnSpeed() * updateTime;
+		Matrix(2).RotateLocalY(rotateAmount);
+	}
 
+	
 
-			tankRotation(updateTime);
-			tankPatrolBounds();
 
-			//Aim State
-			if (activeIsTarget(updateTime))
-			{
-				//If the tank tries to fire with no ammo the it'll go scavenge instead
-				if (m_AmmoCount <= TANK_AMMO_LIMIT)
-				{
-					m_Speed = 0;
-					//Then rotate the tank head towards target
-					tankTurretRotation(updateTime);
+	//Set speed
+	tankAcceleration();
 
-					m_ShellCooldown = TANK_FIRERATE;
-					m_State = Firing;
-					++m_AmmoCount;
-				}
-				else
-				{
-					m_State = Scavenge;
-				}
-			}
-			else
-			{
-				//Patrol state
-				CTankTemplate* TemplateAccess = static_cast<CTankTemplate*>(Template());
-				float rotateAmount = TemplateAccess->GetTurretTurnSpeed() * updateTime;
-				Matrix(2).RotateLocalY(rotateAmount);
-			}
+	FinishStateUpdate(updateTime);
+}
 
-			
+void CTankEntity::UpdateEvade(TFloat32 updateTime)
+{
+	if (isRandomPos)
+	{
+		isRandomPos = false;
+		target = CVector2(RandomInRange(-40, 40), RandomInRange(-40, 40));
+	}
 
 
-			//Set speed
-			tankAcceleration();
-			m_Timer += updateTime;
+	CVector3 headRotation;
+	Matrix(2).DecomposeAffineEuler(nullptr, &headRotation, nullptr);
+	
+	headRotation *= -updateTime;
+	Matrix(2).RotateLocalY(headRotation.y);
 
-		}
-		else if (m_State == Evade)
-		{
-			if (isRandomPos)
-			{
-				isRandomPos = false;
-				target = CVector2(Random(-40, 40),  Random(-40, 40));
-			}
+	//When Evading the tank head should slowly rotate to facing forward.
+	//This can be done by grabbing the headrotation (above) and rotation
+	//local Y axis by the negative of that value, each frame, divided by
+	//The turning speed.
 
+	//Matrix(2).FaceTarget(CVector3(.0f, Matrix(2).GetY(), 1.0f));
+	tankRotation(updateTime);
 
-			CVector3 headRotation;
-			Matrix(2).DecomposeAffineEuler(nullptr, &headRotation, nullptr);
-			
-			headRotation *= -updateTime;
-			Matrix(2).RotateLocalY(headRotation.y);
+	//When reaching new target then change back to active.
+	tankPatrolBounds();
 
-			//When Evading the tank head should slowly rotate to facing forward.
-			//This can be done by grabbing the headrotation (above) and rotation
-			//local Y axis by the negative of that value, each frame, divided by
-			//The turning speed.
+	//Set speed
+	tankAcceleration();
 
-			//Matrix(2).FaceTarget(CVector3(.0f, Matrix(2).GetY(), 1.0f));
-			tankRotation(updateTime);
+	FinishStateUpdate(updateTime);
+}
 
-			//When reaching new target then change back to active.
-			tankPatrolBounds();
+void CTankEntity::UpdateFiring(TFloat32 updateTime)
+{
+	tankTurretRotation(updateTime);
 
-			//Set speed
-			tankAcceleration();
+	if (isReloaded)
+	{
+		isReloaded = false;
 
-			m_Timer += updateTime;
-		}
-		else if (m_State == Firing)
-		{
-			tankTurretRotation(updateTime);
+		CVector3 ShellPos = Position();
+		ShellPos.y += Matrix(2).GetY();
 
-			m_ShellCooldown -= updateTime;
-			if (m_ShellCooldown <= 0)
-			{
-				m_ShellCooldown = TANK_FIRERATE;
+		CVector3 rotation;
+		(Matrix(2) * Matrix(01)).DecomposeAffineEuler(nullptr, &rotation, nullptr);
 
-				CVector3 ShellPos = Position();
-				ShellPos.y += Matrix(2).GetY();
 
-				CVector3 rotation;
-				(Matrix(2) * Matrix(01)).DecomposeAffineEuler(nullptr, &rotation, nullptr);
+		m_ShellCount++;
+		EntityManager.CreateShell("Shell Type 1", GetHandle(), m_Team, static_cast<TFloat32>(m_TankTemplate->GetShellDamage()), ShellPos, rotation);
 
+		ChangeState(Evade);
+		isRandomPos = true;
+	}
 
-				m_ShellCount++;
-				EntityManager.CreateShell("Shell Type 1", "Shell", ShellPos,rotation);
+	FinishStateUpdate(updateTime);
+}
 
-				m_State = Evade;
-				isRandomPos = true;
-			}
-		}
-		else if (m_State == Scavenge)
+void CTankEntity::UpdateScavenge(TFloat32 updateTime)
+{
+	//Head for the closest crate, chosen when the tank next thinks. Messages were all read by Update
+	//before the state passes, so the list is up to date
+	if (IsThinking())
+	{
+		if (!availableCrates.empty())
 		{
 			int IDTarget = 0;
-			float distAmmo = Distance(Position(), availableCrates[0]->Position());
+			float distAmmo = Distance(Position(), availableCrates[0].position);
 			for (int i = 1; i < availableCrates.size(); ++i)
 			{
-				getMessager();
-				if (availableCrates[i]->GetUID() != 3722304989) 
-					//Error code for deleted as the tank doesn't recieve the message fast enoguh
-				{
-					float distAmmoComp = Distance(Position(), availableCrates[i]->Position());
+				float distAmmoComp = Distance(Position(), availableCrates[i].position);
 
-					if (distAmmoComp <= distAmmo)
-					{
-						IDTarget = i;
-						distAmmo = distAmmoComp;
-					}
+				if (distAmmoComp <= distAmmo)
+				{
+					IDTarget = i;
+					distAmmo = distAmmoComp;
 				}
 			}
 
-			target = CVector2(availableCrates[IDTarget]->Position().x, availableCrates[IDTarget]->Position().z);
-			m_State = Evade;
-		}
-		else
-		{
-			m_Speed = 0;
+			target = CVector2(availableCrates[IDTarget].position.x, availableCrates[IDTarget].position.z);
 		}
+		ChangeState(Evade);
+	}
 
+	FinishStateUpdate(updateTime);
+}
 
+//Shrink away, then destroy the tank
+void CTankEntity::UpdateDying(TFloat32 updateTime)
+{
+	if (m_Scale >= 0)
+	{
+		m_Scale -= 0.1f * updateTime;
+		Matrix().Scale(m_Scale);
+	}
+	else
+	{
+		EntityManager.DestroyEntity(GetUID());
+	}
+}
 
-		for (int i = 0; i < availableCrates.size(); ++i)
+// Behaviour shared by every state but Dying, after the state's own update - picking up crates and
+// moving
+void CTankEntity::FinishStateUpdate(TFloat32 updateTime)
+{
+	//Pick up any crates being touched, found with the entity manager's spatial grid
+	SGridFilter crateFilter = { m_CrateType, kNoTeam, false };
+	m_Nearby.clear();
+	EntityManager.QueryRadius(Position(), AMMO_RADIUS + TANK_RADIUS, crateFilter, m_Nearby);
+	for (int i = 0; i < m_Nearby.size(); ++i)
+	{
+		CEntity* crate = EntityManager.GetEntity(m_Nearby[i]);
+		if (crate != nullptr)
 		{
-			//Currently there is a small chance of the messanger being too early/late and not triggering in time
-			getMessager();
-			float distAmmo = Distance(Position(), availableCrates[i]->Position());
-			if (distAmmo <= AMMO_RADIUS + TANK_RADIUS)
-			{
-				m_AmmoCount = 0;
+			m_AmmoCount = 0;
 
-				SMessage Msg;
+			SMessage Msg;
 
-				Msg.from = this->GetUID();
-				Msg.type = Msg_Stop;
+			Msg.from = this->GetUID();
+			Msg.type = Msg_Stop;
 
-				Messenger.SendMessageA(availableCrates[i]->GetUID(), Msg);
-			}
-			
+			Messenger.SendMessageA(crate->GetUID(), Msg);
 		}
-
-		Matrix().MoveLocalZ(m_Speed * updateTime);
+		
 	}
-	return true; // Don't destroy the entity
+
+	Matrix().MoveLocalZ(m_Speed * updateTime);
+
+	//A tank near enemies, under fire or looking for ammo needs to think on every frame, wherever it is
+	//Enemies in range are found by the Active target search, the result is stale in other states
+	SetEngaged((isEnemyInRange && m_State == Active) || isHelp || m_State == Scavenge);
 }
 
 
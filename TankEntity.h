@@ -154,6 +154,10 @@ public:
 
 	// No destructor needed
 
+	// Tanks are allocated from the entity manager's tank pool
+	static void* operator new( size_t size );
+	static void operator delete( void* block, size_t size );
+
 
 /////////////////////////////////////
 //	Public interface
@@ -180,24 +184,7 @@ public:
 
 	string GetState()
 	{
-		switch (m_State)
-		{
-		case Stop:
-			return "Stop";
-			break;
-		case Evade:
-			return "Evade";
-			break;
-		case Active:
-			return "Active";
-			break;
-		case Firing:
-			return "Firing";
-			break;
-		default:
-			return "N/A";
-			break;
-		}
+		return GetStateName(m_State);
 	}
 
 	TFloat32 GetSpeed()
@@ -221,7 +208,7 @@ public:
 	void setTarget(CVector3 input)
 	{
 		isSelected = false;
-		m_State = Evade;
+		ChangeState(Evade);
 		target = CVector2(input.x,input.z);
 	}
 
@@ -229,10 +216,37 @@ public:
 	/////////////////////////////////////
 	// Update
 
-	// Update the tank - performs tank message processing and behaviour
+	// Update the tank - performs tank message processing, the behaviour for the tank's state is
+	// updated afterwards by UpdateStates
 	// Return false if the entity is to be destroyed
 	// Keep as a virtual function in case of further derivation
 	virtual bool Update( TFloat32 updateTime );
+
+
+	/////////////////////////////////////
+	// State machine
+
+	// States available for a tank, each has an entry in the state table
+	enum EState
+	{
+		Stop,
+		Evade,
+		Active, //Patrol + Aim
+		Firing,
+		Scavenge,
+		Dying, //Destroyed, shrinking away
+	};
+	static const TUInt32 kNumStates = Dying + 1;
+
+	// Return the name of the given state
+	static const char* GetStateName( TUInt32 state );
+
+	// Update the given tanks, which must all be in the given state, with that state's update
+	// function. The entity manager keeps the tanks in each state together and updates them in one
+	// pass per state, so each pass runs the same code over every tank in it. Tanks already updated
+	// in the given frame, in an earlier pass before changing state, are skipped
+	static void UpdateStates( TUInt32 state, CTankEntity* const* tanks, TUInt32 numTanks,
+	                          TUInt32 frame, TFloat32 updateTime );
 	
 
 /////////////////////////////////////
@@ -244,18 +258,40 @@ private:
 	void tankRotation(float& updateTime);
 	void tankPatrolBounds();
 	bool activeIsTarget(float& updateTime);
+
+	// Return a pseudo-random number in the given range from the tank's own sequence. Tanks update
+	// in parallel, so they do not share the global random sequence, whose order would depend on
+	// the threads
+	TFloat32 RandomInRange(TFloat32 min, TFloat32 max);
+
+	//State updates, one for each state
+	void UpdateStop(TFloat32 updateTime);
+	void UpdateEvade(TFloat32 updateTime);
+	void UpdateActive(TFloat32 updateTime);
+	void UpdateFiring(TFloat32 updateTime);
+	void UpdateScavenge(TFloat32 updateTime);
+	void UpdateDying(TFloat32 updateTime);
+
+	// Behaviour shared by every state but Dying, after the state's own update
+	void FinishStateUpdate(TFloat32 updateTime);
+
+	// Change to the given state, the change is made by the entity manager
+	void ChangeState(EState state);
+
+	// The entity manager sets the state of tanks when it moves them between its state lists
+	friend class CEntityManager;
+
 	/////////////////////////////////////
 	// Types
-	
-	// States available for a tank - placeholders for shell code
-	enum EState
+
+	// A state's entry in the state table - its name and update function
+	typedef void (CTankEntity::*TStateUpdate)(TFloat32 updateTime);
+	struct SStateInfo
 	{
-		Stop,
-		Evade,
-		Active, //Patrol + Aim
-		Firing,
-		Scavenge
+		const char*  name;
+		TStateUpdate update;
 	};
+	static const SStateInfo kStates[kNumStates];
 
 
 	/////////////////////////////////////
@@ -271,24 +307,36 @@ private:
 
 	// Tank state
 	EState   m_State; // Current state
-	TFloat32 m_Timer; // A timer used in the example update function   
+	TUInt32  m_StateFrame = 0; // Frame of the state passes the tank's state was last updated in
 	TFloat32 m_Scale = 1.0f;
 
 	//Text output variables
-	TFloat32 m_ShellCooldown = 0;
+	TUInt32 m_FireTimer = 0; // Id of the latest reload timer, see Msg_Fire
+	bool isReloaded = false;
 	TInt32 m_ShellCount = 0;
 	TInt32 m_AmmoCount = 0;
 
-	TInt32 m_LocalFormPos[3] = { -1,-1,-1, };
+	SEntityHandle m_LocalFormPos[3] = { NullEntityHandle, NullEntityHandle, NullEntityHandle };
 	bool isSelected = false;
 	bool isRandomPos = false;
 	bool isHelp = false;
+	bool isEnemyInRange = false; //An enemy was in firing range at the last target search, only counts while Active
+	TUInt32 m_RandomSeed; //State of the tank's random sequence, see RandomInRange
 
 	//Positioning variables
-	TEntityUID entityTarget = this->GetUID();
+	SEntityHandle entityTarget = NullEntityHandle;
 	CVector2 target;// = { CVector2(this->Position().x,this->Position().y) };
 	std::vector<CVector3> tankPatrol;
-	std::vector<CEntity*> availableCrates;
+	struct SCrate
+	{
+		TEntityUID uid;
+		CVector3 position;
+	};
+	std::vector<SCrate> availableCrates;
+	TUInt32 m_CrateType; // Template type ID of crates
+
+	// Entities found by the last spatial grid query, kept to reuse its memory
+	std::vector<SEntityHandle> m_Nearby;
 	int currentPos;
 
 };
@@ -0,0 +1,194 @@
+/*******************************************
+	AllocationTest.cpp
+
+	Test that entity and shell churn makes no
+	heap allocations once warmed up
+********************************************/
+
+// Sets up the tanks of the game, then runs frames that churn entities and shells: a crate is
+// created every frame and the oldest withdrawn, and every tank fires a harmless shell every few
+// frames on top of those the tanks fire themselves. Once the frames have warmed up every pool,
+// mailbox and list, a further run of frames must make no general heap allocations at all,
+// counted with GEN_COUNT_ALLOCATIONS (see EntityPool.h)
+// Build as a console program with GEN_COUNT_ALLOCATIONS=1, the engine, the game sources except
+// TankAssignment.cpp and MainApp.cpp, and this file. Run from the folder the game runs from so
+// the meshes are found - they are loaded on a null device, nothing is drawn. Returns 0 if no
+// allocations were made
+
+#include <windows.h>
+#include <d3d10.h>
+#include <iostream>
+using namespace std;
+
+#include "EntityManager.h"
+#include "Messenger.h"
+#include "LineOfSight.h"
+#include "EntityPool.h"
+
+#if !GEN_COUNT_ALLOCATIONS
+#error Build the allocation test with GEN_COUNT_ALLOCATIONS=1
+#endif
+
+namespace gen
+{
+
+// Globals used by the game sources, defined by MainApp.cpp and TankAssignment.cpp in the game
+ID3D10Device* g_pd3dDevice = NULL;
+CEntityManager EntityManager;
+CLineOfSight LineOfSight;
+extern CMessenger Messenger;
+
+vector<TEntityUID> TankID;
+TEntityUID GetTankUID( int team )
+{
+	return team < static_cast<int>(TankID.size()) ? TankID[team] : SystemUID;
+}
+
+} // namespace gen
+
+using namespace gen;
+
+namespace
+{
+
+// Frames run before counting, frames counted, and length of each frame
+const TUInt32 kWarmUpFrames = 600;
+const TUInt32 kTestFrames = 600;
+const TFloat32 kFrameTime = 1.0f / 60.0f;
+
+// Number of crates kept alive, and frames between the extra shells fired by each tank. Extra
+// shells do no damage so no tank is destroyed - the first destruction of a tank grows free lists
+// once, which is not churn
+const TUInt32 kNumCrates = 16;
+const TUInt32 kShellInterval = 5;
+
+// Repeatable pseudo-random number in the given range
+TFloat32 Random( TUInt32& seed, TFloat32 min, TFloat32 max )
+{
+	seed = seed * 1664525u + 1013904223u;
+	return min + (max - min) * static_cast<TFloat32>(seed >> 8) / static_cast<TFloat32>(1 << 24);
+}
+
+// Create the templates and tanks of the game
+void SetUpScene()
+{
+	EntityManager.CreateTankTemplate( "Tank", "Rogue Scout", "HoverTank02.x", 24.0f, 2.2f, 2.0f, kfPi / 3, 100, 20 );
+	EntityManager.CreateTankTemplate( "Tank", "Oberon MkII", "HoverTank07.x", 18.0f, 1.6f, 1.3f, kfPi / 4, 120, 35 );
+	EntityManager.CreateTemplate( "Projectile", "Shell Type 1", "Bullet.x" );
+	EntityManager.CreateTemplate( "Buff", "Buff box: Ammo", "Sphere.x" );
+
+	vector<CVector3> patrol1;
+	patrol1.push_back( CVector3( -15.0f, 0.0f, 35.0f ) );
+	patrol1.push_back( CVector3( -40.0f, 0.0f, 50.0f ) );
+	patrol1.push_back( CVector3( -15.0f, 0.0f, 40.0f ) );
+	vector<CVector3> patrol2;
+	patrol2.push_back( CVector3( 15.0f, 0.0f, 35.0f ) );
+	patrol2.push_back( CVector3( 40.0f, 0.0f, 50.0f ) );
+	patrol2.push_back( CVector3( 15.0f, 0.0f, 40.0f ) );
+	for (TUInt32 tank = 0; tank < 4; ++tank)
+	{
+		TFloat32 offset = 5.0f + 10.0f * tank;
+		TankID.push_back( EntityManager.CreateTank( "Rogue Scout", 0, patrol1, "A", CVector3( -offset, 0.5f, -offset ) ) );
+		TankID.push_back( EntityManager.CreateTank( "Oberon MkII", 1, patrol2, "B", CVector3( offset, 0.5f, offset ),
+		                                            CVector3( 0.0f, kfPi, 0.0f ) ) );
+	}
+
+	Messenger.SetFramePhased( true );
+	Messenger.SetAdvisoryBudget( 64 );
+	EntityManager.SetThinkBudget( 32 );
+
+	SMessage msg;
+	msg.type = Msg_Go;
+	msg.from = SystemUID;
+	Messenger.SendGroupMessage( Group_Tanks, msg );
+}
+
+// Run one frame of the game with extra entity and shell churn
+void RunFrame( TUInt32 frame, TUInt32& seed, TEntityUID* crates )
+{
+	Messenger.AdvanceTime( kFrameTime );
+	Messenger.SwapMessageBuffers();
+
+	// Replace the oldest crate. Stop it as a tank collecting it does, so it tells the tanks it has
+	// gone and destroys itself. It may already have been collected
+	TEntityUID& crate = crates[frame % kNumCrates];
+	if (crate != SystemUID)
+	{
+		SMessage msg;
+		msg.type = Msg_Stop;
+		msg.from = SystemUID;
+		Messenger.SendMessage( crate, msg );
+	}
+	crate = EntityManager.CreateCrate( "Buff box: Ammo", "Ammo Crate",
+	                                   CVector3( Random( seed, -30.0f, 30.0f ), 0.5f, Random( seed, -30.0f, 30.0f ) ),
+	                                   CVector3( 0.01f, 0.01f, 0.01f ) );
+
+	// Each tank fires a shell in a random direction every few frames. Teams alternate in TankID
+	if (frame % kShellInterval == 0)
+	{
+		for (TUInt32 tank = 0; tank < TankID.size(); ++tank)
+		{
+			CEntity* tankEntity = EntityManager.GetEntity( TankID[tank] );
+			if (tankEntity)
+			{
+				EntityManager.CreateShell( "Shell Type 1", EntityManager.GetHandle( TankID[tank] ), tank % 2,
+				                           0.0f, tankEntity->Position() + CVector3( 0.0f, 2.0f, 0.0f ),
+				                           CVector3( 0.0f, Random( seed, 0.0f, 2.0f * kfPi ), 0.0f ) );
+			}
+		}
+	}
+
+	EntityManager.UpdateAllEntities( kFrameTime );
+	EntityManager.UpdateTransforms();
+}
+
+} // namespace
+
+
+int main()
+{
+	// Meshes need a device to load into, a null device draws nothing
+	if (FAILED( D3D10CreateDevice( NULL, D3D10_DRIVER_TYPE_NULL, NULL, 0, D3D10_SDK_VERSION, &g_pd3dDevice ) ))
+	{
+		cout << "FAILED: could not create a null device" << endl;
+		return 1;
+	}
+	SetUpScene();
+
+	TUInt32 seed = 1;
+	TEntityUID crates[kNumCrates];
+	for (TUInt32 crate = 0; crate < kNumCrates; ++crate)
+	{
+		crates[crate] = SystemUID;
+	}
+	for (TUInt32 frame = 0; frame < kWarmUpFrames; ++frame)
+	{
+		RunFrame( frame, seed, crates );
+	}
+
+	// Count allocations over whole frames, reporting the frames that made any
+	TUInt64 numAllocations = 0;
+	TUInt32 maxProjectiles = 0;
+	for (TUInt32 frame = kWarmUpFrames; frame < kWarmUpFrames + kTestFrames; ++frame)
+	{
+		TUInt64 allocationsBefore = GetNumHeapAllocations();
+		RunFrame( frame, seed, crates );
+		TUInt64 frameAllocations = GetNumHeapAllocations() - allocationsBefore;
+		if (frameAllocations > 0)
+		{
+			cout << "Frame " << frame << ": " << frameAllocations << " allocations" << endl;
+			numAllocations += frameAllocations;
+		}
+		maxProjectiles = max( maxProjectiles, EntityManager.NumProjectiles() );
+	}
+
+	cout << kTestFrames << " frames, " << kTestFrames << " crates created, up to " << maxProjectiles
+	     << " shells in flight, " << numAllocations << " allocations" << endl;
+
+	EntityManager.DestroyAllEntities();
+	EntityManager.DestroyAllTemplates();
+	g_pd3dDevice->Release();
+
+	cout << (numAllocations == 0 ? "Passed" : "FAILED") << endl;
+	return numAllocations == 0 ? 0 : 1;
+}
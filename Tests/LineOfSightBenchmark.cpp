@@ -0,0 +1,194 @@
+/*******************************************
+	LineOfSightBenchmark.cpp
+
+	Benchmark of line of sight tests against
+	the baked grid and the old stepping loop
+********************************************/
+
+// Places scenery like SceneSetup - a building and 100 tree trunks - then times line of sight
+// tests between random pairs of points on the battlefield:
+// - the stepping loop tanks used before the line of sight grid, which moves a copy of the turret
+//   matrix forward one unit at a time and checks the box around each occluder
+// - CLineOfSight::IsClearExact, walking the baked grid
+// - CLineOfSight::IsClear, walking the grid through the per-thread result cache
+// The exact grid results are checked against testing every occluder directly
+// Build as a console program with the engine headers and maths, LineOfSight.cpp and this file.
+// Returns 0 if the grid results are correct
+
+#include <vector>
+#include <chrono>
+#include <iostream>
+using namespace std;
+
+#include "CMatrix4x4.h"
+#include "LineOfSight.h"
+
+using namespace gen;
+
+namespace
+{
+
+// Number of point pairs tested and times each set of tests is repeated
+const TUInt32 kNumTests = 20000;
+const TUInt32 kNumRepeats = 10;
+
+// An occluder as placed in the scene
+struct SOccluderDef
+{
+	CVector3 centre;
+	TFloat32 radius;
+};
+
+// Repeatable pseudo-random number from 0 to 1
+TFloat32 Random01( TUInt32& seed )
+{
+	seed = seed * 1664525u + 1013904223u;
+	return static_cast<TFloat32>(seed >> 8) / static_cast<TFloat32>(1 << 24);
+}
+
+// Return true if no occluder crosses the line, using the stepping loop from before the grid.
+// The turret is taken to face the target, from the point the line starts
+bool SteppingIsClear( const vector<SOccluderDef>& occluders, const CVector3& from, const CVector3& to )
+{
+	const TFloat32 Error_margin = 0.025f;
+
+	bool isNotBlocked = true;
+	for (TUInt32 occluder = 0; occluder < occluders.size(); ++occluder)
+	{
+		CMatrix4x4 headRotation = CMatrix4x4::kIdentity;
+		headRotation.FaceDirection( to - from );
+		const CVector3& buildingPos = occluders[occluder].centre;
+		TFloat32 BuildingRadius = occluders[occluder].radius;
+
+		int loopLimit = 5;
+		int distanceComparison = static_cast<int>(Distance( from, buildingPos ));
+		for (int k = 0; k < loopLimit; ++k)
+		{
+			headRotation.MoveLocalZ( 1.0f );
+			CVector3 tempCalc = headRotation.Position() + from;
+
+			TFloat32 distanceBetweenPoints = Distance( tempCalc, buildingPos );
+			if (distanceBetweenPoints <= distanceComparison)
+			{
+				++loopLimit;
+			}
+
+			if (tempCalc.x <= buildingPos.x + (Error_margin + BuildingRadius) &&
+			    tempCalc.y <= buildingPos.y + (Error_margin + BuildingRadius) &&
+			    tempCalc.z <= buildingPos.z + (Error_margin + BuildingRadius) &&
+			    tempCalc.x >= buildingPos.x - (Error_margin + BuildingRadius) &&
+			    tempCalc.y >= buildingPos.y - (Error_margin + BuildingRadius) &&
+			    tempCalc.z >= buildingPos.z - (Error_margin + BuildingRadius))
+			{
+				isNotBlocked = false;
+				k = loopLimit;
+			}
+			else
+			{
+				distanceComparison = static_cast<int>(distanceBetweenPoints);
+			}
+		}
+	}
+	return isNotBlocked;
+}
+
+// Return true if no occluder crosses the line, testing every occluder exactly as the grid does
+bool DirectIsClear( const vector<SOccluderDef>& occluders, const CVector3& from, const CVector3& to )
+{
+	TFloat32 lineX = to.x - from.x;
+	TFloat32 lineZ = to.z - from.z;
+	TFloat32 lengthSquared = lineX * lineX + lineZ * lineZ;
+	for (TUInt32 occluder = 0; occluder < occluders.size(); ++occluder)
+	{
+		const SOccluderDef& o = occluders[occluder];
+		TFloat32 offsetX = o.centre.x - from.x;
+		TFloat32 offsetZ = o.centre.z - from.z;
+		TFloat32 t = lengthSquared > 0.0f ? (offsetX * lineX + offsetZ * lineZ) / lengthSquared : 0.0f;
+		t = min( max( t, 0.0f ), 1.0f );
+		TFloat32 distX = offsetX - lineX * t;
+		TFloat32 distZ = offsetZ - lineZ * t;
+		if (distX * distX + distZ * distZ <= o.radius * o.radius)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Return the average time in nanoseconds taken by the given test per line, also returning the
+// number of lines found clear
+template <typename TTest>
+TFloat64 TimeTests( const vector<CVector3>& points, TTest test, TUInt32& numClear )
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	numClear = 0;
+	for (TUInt32 repeat = 0; repeat < kNumRepeats; ++repeat)
+	{
+		for (TUInt32 line = 0; line < kNumTests; ++line)
+		{
+			numClear += test( points[line * 2], points[line * 2 + 1] ) ? 1 : 0;
+		}
+	}
+	numClear /= kNumRepeats;
+	TFloat64 seconds = chrono::duration<TFloat64>( chrono::steady_clock::now() - start ).count();
+	return seconds * 1e9 / (kNumTests * kNumRepeats);
+}
+
+} // namespace
+
+
+int main()
+{
+	// Scenery as in SceneSetup, trees blocking with their trunk only. The radii are roughly those
+	// of the building and tree meshes
+	TUInt32 seed = 1;
+	vector<SOccluderDef> occluders;
+	SOccluderDef building = { CVector3( 0.0f, 0.0f, 40.0f ), 12.0f };
+	occluders.push_back( building );
+	for (TUInt32 tree = 0; tree < 100; ++tree)
+	{
+		SOccluderDef trunk = { CVector3( -200.0f + 230.0f * Random01( seed ), 0.0f, 40.0f + 110.0f * Random01( seed ) ),
+		                       0.25f * 6.0f };
+		occluders.push_back( trunk );
+	}
+
+	CLineOfSight lineOfSight;
+	for (TUInt32 occluder = 0; occluder < occluders.size(); ++occluder)
+	{
+		lineOfSight.AddOccluder( occluders[occluder].centre, occluders[occluder].radius );
+	}
+	lineOfSight.Bake();
+
+	// Pairs of points over the battlefield, at tank height
+	vector<CVector3> points;
+	for (TUInt32 point = 0; point < kNumTests * 2; ++point)
+	{
+		points.push_back( CVector3( -220.0f + 270.0f * Random01( seed ), 0.0f, -60.0f + 230.0f * Random01( seed ) ) );
+	}
+
+	TUInt32 steppingClear, exactClear, cachedClear;
+	TFloat64 steppingTime = TimeTests( points, [&]( const CVector3& from, const CVector3& to )
+	                                   { return SteppingIsClear( occluders, from, to ); }, steppingClear );
+	TFloat64 exactTime = TimeTests( points, [&]( const CVector3& from, const CVector3& to )
+	                                { return lineOfSight.IsClearExact( from, to ); }, exactClear );
+	TFloat64 cachedTime = TimeTests( points, [&]( const CVector3& from, const CVector3& to )
+	                                 { return lineOfSight.IsClear( from, to ); }, cachedClear );
+
+	cout << occluders.size() << " occluders, " << kNumTests << " lines" << endl;
+	cout << "Stepping loop:     " << steppingTime << "ns per line, " << steppingClear << " clear" << endl;
+	cout << "Grid (exact):      " << exactTime << "ns per line, " << exactClear << " clear" << endl;
+	cout << "Grid (cached):     " << cachedTime << "ns per line, " << cachedClear << " clear" << endl;
+
+	// The grid must give the same answer as testing every occluder
+	for (TUInt32 line = 0; line < kNumTests; ++line)
+	{
+		const CVector3& from = points[line * 2];
+		const CVector3& to = points[line * 2 + 1];
+		if (lineOfSight.IsClearExact( from, to ) != DirectIsClear( occluders, from, to ))
+		{
+			cout << "FAILED: grid result differs from testing every occluder at line " << line << endl;
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*******************************************
+	MatrixBatchTest.cpp
+
+	Test of batched matrix composition against
+	CMatrix4x4 multiplication
+********************************************/
+
+// Composes batches of random matrices with ComposeMatrices and checks every result against
+// CMatrix4x4::operator*. Batches are run with the matrices at each 4-byte offset from 16-byte
+// alignment, as entity matrices may be placed, and as hierarchies where each parent is the
+// previous result in the same batch
+// Build as a console program with the engine maths, MatrixBatch.cpp and this file, with and
+// without GEN_MATRIX_SIMD. Returns 0 if all results match
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+using namespace std;
+
+#include "MatrixBatch.h"
+
+using namespace gen;
+
+namespace
+{
+
+// Number of matrices in each batch, and in each chain of parents when chained
+const TUInt32 kNumMatrices = 1000;
+const TUInt32 kChainLength = 8;
+
+// Largest difference allowed between elements, relative to the size of the products summed
+const TFloat32 kTolerance = 1e-5f;
+
+// Repeatable pseudo-random number in the given range
+TFloat32 Random( TUInt32& seed, TFloat32 min, TFloat32 max )
+{
+	seed = seed * 1664525u + 1013904223u;
+	return min + (max - min) * static_cast<TFloat32>(seed >> 8) / static_cast<TFloat32>(1 << 24);
+}
+
+// Fill a matrix with random elements, all sixteen so the test does not depend on it being affine
+void RandomMatrix( TUInt32& seed, CMatrix4x4& matrix )
+{
+	TFloat32* elements = &matrix.e00;
+	for (TUInt32 element = 0; element < 16; ++element)
+	{
+		elements[element] = Random( seed, -2.0f, 2.0f );
+	}
+}
+
+// Return true if the two matrices are equal within the tolerance, for a product whose terms
+// are no larger than the given size
+bool MatricesMatch( const CMatrix4x4& a, const CMatrix4x4& b, TFloat32 size )
+{
+	const TFloat32* aElements = &a.e00;
+	const TFloat32* bElements = &b.e00;
+	for (TUInt32 element = 0; element < 16; ++element)
+	{
+		if (fabs( aElements[element] - bElements[element] ) > kTolerance * size)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Return the largest element of a matrix, ignoring sign
+TFloat32 MaxElement( const CMatrix4x4& matrix )
+{
+	const TFloat32* elements = &matrix.e00;
+	TFloat32 maxElement = 0.0f;
+	for (TUInt32 element = 0; element < 16; ++element)
+	{
+		maxElement = max( maxElement, static_cast<TFloat32>(fabs( elements[element] )) );
+	}
+	return maxElement;
+}
+
+// Return a pointer to the given matrix in a byte buffer, the first starting the given number of
+// bytes after a 16-byte boundary
+CMatrix4x4* MatrixAt( vector<TUInt8>& buffer, TUInt32 offset, TUInt32 matrix )
+{
+	TUInt8* start = &buffer[0] + (16 - reinterpret_cast<size_t>(&buffer[0]) % 16) % 16 + offset;
+	return reinterpret_cast<CMatrix4x4*>(start + matrix * sizeof(CMatrix4x4));
+}
+
+// Compose a batch with its matrices at the given offset from 16-byte alignment and check the
+// results. If chained, the matrices are split into short chains where each parent is the
+// previous result, as in a node hierarchy. Returns the number of results that do not match
+TUInt32 TestBatch( TUInt32& seed, TUInt32 offset, bool chained )
+{
+	// Room for the matrices plus alignment, for the relatives, parents and results
+	vector<TUInt8> buffer( 3 * kNumMatrices * sizeof(CMatrix4x4) + 32 );
+	vector<const CMatrix4x4*> relatives( kNumMatrices );
+	vector<const CMatrix4x4*> parents( kNumMatrices );
+	vector<CMatrix4x4*> results( kNumMatrices );
+	for (TUInt32 matrix = 0; matrix < kNumMatrices; ++matrix)
+	{
+		CMatrix4x4* relative = MatrixAt( buffer, offset, matrix );
+		CMatrix4x4* parent = MatrixAt( buffer, offset, kNumMatrices + matrix );
+		RandomMatrix( seed, *relative );
+		RandomMatrix( seed, *parent );
+		relatives[matrix] = relative;
+		parents[matrix] = (chained && matrix % kChainLength != 0) ? results[matrix - 1] : parent;
+		results[matrix] = MatrixAt( buffer, offset, 2 * kNumMatrices + matrix );
+	}
+
+	ComposeMatrices( kNumMatrices, &relatives[0], &parents[0], &results[0] );
+
+	TUInt32 numMismatches = 0;
+	for (TUInt32 matrix = 0; matrix < kNumMatrices; ++matrix)
+	{
+		CMatrix4x4 expected = *relatives[matrix] * *parents[matrix];
+		TFloat32 size = 4.0f * MaxElement( *relatives[matrix] ) * MaxElement( *parents[matrix] );
+		if (!MatricesMatch( *results[matrix], expected, size ))
+		{
+			++numMismatches;
+		}
+	}
+	return numMismatches;
+}
+
+} // namespace
+
+
+int main()
+{
+	cout << "GEN_MATRIX_SIMD " << GEN_MATRIX_SIMD << endl;
+
+	TUInt32 seed = 1;
+	bool passed = true;
+	for (TUInt32 chained = 0; chained < 2; ++chained)
+	{
+		for (TUInt32 offset = 0; offset < 16; offset += sizeof(TFloat32))
+		{
+			TUInt32 numMismatches = TestBatch( seed, offset, chained != 0 );
+			if (numMismatches > 0)
+			{
+				cout << (chained ? "Chained" : "Separate") << " matrices at offset " << offset << ": "
+				     << numMismatches << " of " << kNumMatrices << " results differ" << endl;
+				passed = false;
+			}
+		}
+	}
+
+	cout << (passed ? "Passed" : "FAILED") << endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+/*******************************************
+	MessengerDrainBenchmark.cpp
+
+	Benchmark of reading mailboxes with
+	FetchMessage against DrainMessages
+********************************************/
+
+// Sends a few messages to each of 10,000 UIDs, then reads every mailbox, either one message at a
+// time with FetchMessage or all at once with DrainMessages, and reports the average time taken to
+// read all the mailboxes. Sending is not timed
+// Build as a console program with the engine headers, Messenger.cpp and this file
+
+#include <chrono>
+#include <iostream>
+using namespace std;
+
+#include "Messenger.h"
+
+using namespace gen;
+
+namespace
+{
+
+// Number of UIDs sent messages, messages sent to each per frame, and frames to time
+const TUInt32 kNumEntities = 10000;
+const TUInt32 kMessagesPerEntity = 4;
+const TUInt32 kNumFrames = 200;
+
+// Send each UID its messages for a frame
+void SendMessages( CMessenger& messenger, TUInt32 frame )
+{
+	for (TUInt32 message = 0; message < kMessagesPerEntity; ++message)
+	{
+		for (TEntityUID uid = 0; uid < kNumEntities; ++uid)
+		{
+			SMessage msg;
+			msg.type = Msg_Hit;
+			msg.from = (uid + frame + message + 1) % kNumEntities;
+			messenger.SendMessage( uid, msg );
+		}
+	}
+}
+
+// Read every mailbox with FetchMessage, returns the sum of the senders read
+TUInt64 ReadByFetch( CMessenger& messenger )
+{
+	TUInt64 total = 0;
+	for (TEntityUID uid = 0; uid < kNumEntities; ++uid)
+	{
+		SMessage msg;
+		while (messenger.FetchMessage( uid, &msg ))
+		{
+			total += msg.from;
+		}
+	}
+	return total;
+}
+
+// Read every mailbox with DrainMessages, returns the sum of the senders read
+TUInt64 ReadByDrain( CMessenger& messenger )
+{
+	TUInt64 total = 0;
+	for (TEntityUID uid = 0; uid < kNumEntities; ++uid)
+	{
+		for (const SMessage& msg : messenger.DrainMessages( uid ))
+		{
+			total += msg.from;
+		}
+	}
+	return total;
+}
+
+// Return the average time in milliseconds taken by the given read function per frame, also
+// returning the total it read
+template <typename TRead>
+TFloat64 TimeReads( TRead read, TUInt64& total )
+{
+	// Frame phased, as in the game - messages are delivered when the buffers are swapped
+	CMessenger messenger;
+	messenger.SetFramePhased( true );
+
+	// One untimed frame so every mailbox has its ring buffer
+	SendMessages( messenger, 0 );
+	messenger.SwapMessageBuffers();
+	read( messenger );
+
+	TFloat64 seconds = 0.0;
+	total = 0;
+	for (TUInt32 frame = 0; frame < kNumFrames; ++frame)
+	{
+		SendMessages( messenger, frame );
+		messenger.SwapMessageBuffers();
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		total += read( messenger );
+		seconds += chrono::duration<TFloat64>( chrono::steady_clock::now() - start ).count();
+	}
+	return seconds * 1000.0 / kNumFrames;
+}
+
+} // namespace
+
+
+int main()
+{
+	TUInt64 fetchTotal, drainTotal;
+	TFloat64 fetchTime = TimeReads( ReadByFetch, fetchTotal );
+	TFloat64 drainTime = TimeReads( ReadByDrain, drainTotal );
+
+	cout << kNumEntities << " entities, " << kMessagesPerEntity << " messages each" << endl;
+	cout << "FetchMessage:  " << fetchTime << "ms per frame" << endl;
+	cout << "DrainMessages: " << drainTime << "ms per frame" << endl;
+
+	// Both must read the same messages
+	if (fetchTotal != drainTotal)
+	{
+		cout << "FAILED: read totals differ" << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*******************************************
+	MessengerStressTest.cpp
+
+	Stress test of the thread-safe messenger
+	from many threads
+********************************************/
+
+// Runs frames of sends from chunks of senders on a job system, the way the entity manager updates
+// entities, then drains every mailbox in parallel. Each sender numbers its messages. Checks that
+// - every message is delivered
+// - each sender's direct messages reach each recipient in the order they were sent
+// - the delivery order is the same for every thread count
+// Build as a console program with GEN_MESSENGER_THREAD_SAFE=1, the engine headers,
+// Messenger.cpp, JobSystem.cpp and this file. Returns 0 if all checks pass
+
+#include <vector>
+#include <iostream>
+using namespace std;
+
+#include "Messenger.h"
+#include "JobSystem.h"
+
+#if !GEN_MESSENGER_THREAD_SAFE
+#error Build the messenger stress test with GEN_MESSENGER_THREAD_SAFE=1
+#endif
+
+using namespace gen;
+
+namespace
+{
+
+// Shape of the test. Senders are split into chunks, each chunk sending in each pass. Every
+// sender is also a recipient and a member of a group
+const TUInt32 kNumFrames = 60;
+const TUInt32 kNumPasses = 3;
+const TUInt32 kNumChunks = 32;
+const TUInt32 kSendersPerChunk = 8;
+const TUInt32 kNumSenders = kNumChunks * kSendersPerChunk;
+const TUInt32 kSendsPerPass = 6;
+const TMessageGroup kGroup = 0;
+
+// Sender used for messages sent from the main thread between passes
+const TEntityUID kMainSender = kNumSenders;
+
+// Messages carry their sender and the sender's sequence number together in the from field
+const TUInt32 kSequenceBits = 16;
+
+// A delivered message as seen by its recipient
+struct SDelivery
+{
+	TEntityUID   to;
+	TEntityUID   from;
+	EMessageType type;
+	TUInt32      sequence;
+};
+
+bool operator!=( const SDelivery& a, const SDelivery& b )
+{
+	return a.to != b.to || a.from != b.from || a.type != b.type || a.sequence != b.sequence;
+}
+
+// Repeatable pseudo-random number from the given values
+TUInt32 Hash( TUInt32 a, TUInt32 b, TUInt32 c, TUInt32 d )
+{
+	TUInt32 h = a * 0x9e3779b1u ^ b * 0x85ebca6bu ^ c * 0xc2b2ae35u ^ d * 0x27d4eb2fu;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+// Test state for one run
+struct STestRun
+{
+	CMessenger*        messenger;
+	vector<TUInt32>    nextSequence;  // Next sequence number of each sender
+	vector<TUInt32>    lastSequence;  // Last direct sequence seen, for each recipient and sender
+	vector< vector<SDelivery> > received; // Messages drained by each recipient this frame
+	vector<SDelivery>  log;           // Every delivery, in recipient order within each frame
+	vector<TUInt32>    numSent;       // Messages sent by each sender, a group message counting once per member
+	TUInt32            numOutOfOrder;
+};
+
+// Send a message from the given sender, numbered with its next sequence number
+void Send( STestRun& run, TEntityUID from, TUInt32 frame, TUInt32 pass, TUInt32 send )
+{
+	SMessage msg;
+	msg.from = (from << kSequenceBits) | run.nextSequence[from]++;
+
+	TUInt32 choice = Hash( frame, pass, from, send );
+	TEntityUID to = choice % kNumSenders;
+	switch ((choice >> 16) % 32)
+	{
+	case 0:
+	case 1:
+	case 2:
+	case 3:
+		// Delayed messages fall due later, out of sequence with direct ones
+		msg.type = Msg_Fire;
+		run.messenger->SendDelayedMessage( to, msg, 0.01f * (1 + (choice >> 20) % 4) );
+		++run.numSent[from];
+		break;
+	case 4:
+		msg.type = Msg_Go;
+		run.messenger->SendGroupMessage( kGroup, msg );
+		run.numSent[from] += kNumSenders;
+		break;
+	default:
+		msg.type = Msg_Hit;
+		run.messenger->SendMessage( to, msg );
+		++run.numSent[from];
+		break;
+	}
+}
+
+// Send the messages of one chunk of senders
+void SendChunk( STestRun& run, TUInt32 frame, TUInt32 pass, TUInt32 chunk )
+{
+	run.messenger->BeginSendChunk( chunk );
+	for (TUInt32 send = 0; send < kSendsPerPass; ++send)
+	{
+		for (TUInt32 sender = 0; sender < kSendersPerChunk; ++sender)
+		{
+			Send( run, chunk * kSendersPerChunk + sender, frame, pass, send );
+		}
+	}
+	run.messenger->EndSendChunk();
+}
+
+// Drain the mailboxes of one chunk of recipients
+void DrainChunk( STestRun& run, TUInt32 chunk )
+{
+	for (TUInt32 recipient = 0; recipient < kSendersPerChunk; ++recipient)
+	{
+		TEntityUID to = chunk * kSendersPerChunk + recipient;
+		for (const SMessage& msg : run.messenger->DrainMessages( to ))
+		{
+			SDelivery delivery = { to, msg.from >> kSequenceBits, msg.type, msg.from & ((1 << kSequenceBits) - 1) };
+			run.received[to].push_back( delivery );
+		}
+	}
+}
+
+// Run a batch of chunks on the job system, or in order if there is none
+template <typename TRun>
+void RunChunks( CJobSystem* jobs, TRun runChunk )
+{
+	if (jobs)
+	{
+		jobs->ParallelFor( kNumChunks, runChunk );
+	}
+	else
+	{
+		for (TUInt32 chunk = 0; chunk < kNumChunks; ++chunk)
+		{
+			runChunk( chunk );
+		}
+	}
+}
+
+// Run the test on the given number of threads, returning the delivery log. Returns false if a
+// check failed
+bool RunTest( TUInt32 numThreads, vector<SDelivery>& log )
+{
+	CMessenger messenger;
+	CJobSystem* jobs = numThreads > 1 ? new CJobSystem( numThreads ) : 0;
+
+	STestRun run;
+	run.messenger = &messenger;
+	run.nextSequence.assign( kNumSenders + 1, 0 );
+	run.lastSequence.assign( kNumSenders * (kNumSenders + 1), 0xffffffff );
+	run.received.resize( kNumSenders );
+	run.numSent.assign( kNumSenders + 1, 0 );
+	run.numOutOfOrder = 0;
+	for (TEntityUID uid = 0; uid < kNumSenders; ++uid)
+	{
+		messenger.JoinGroup( uid, kGroup );
+	}
+
+	// Extra frames at the end deliver the last delayed messages
+	const TUInt32 kNumDrainFrames = 10;
+	for (TUInt32 frame = 0; frame < kNumFrames + kNumDrainFrames; ++frame)
+	{
+		messenger.AdvanceTime( 0.01f );
+		messenger.SwapMessageBuffers();
+
+		// Read in parallel, then record in recipient order
+		RunChunks( jobs, [&]( TUInt32 chunk ) { DrainChunk( run, chunk ); } );
+		for (TEntityUID to = 0; to < kNumSenders; ++to)
+		{
+			for (TUInt32 message = 0; message < run.received[to].size(); ++message)
+			{
+				const SDelivery& delivery = run.received[to][message];
+				if (delivery.type == Msg_Hit)
+				{
+					TUInt32& last = run.lastSequence[to * (kNumSenders + 1) + delivery.from];
+					if (last != 0xffffffff && delivery.sequence <= last)
+					{
+						++run.numOutOfOrder;
+					}
+					last = delivery.sequence;
+				}
+				run.log.push_back( delivery );
+			}
+			run.received[to].clear();
+		}
+
+		if (frame >= kNumFrames)
+		{
+			continue;
+		}
+		for (TUInt32 pass = 0; pass < kNumPasses; ++pass)
+		{
+			// The main thread sends before each pass, as the game does between updates
+			Send( run, kMainSender, frame, pass, 0 );
+			RunChunks( jobs, [&]( TUInt32 chunk ) { SendChunk( run, frame, pass, chunk ); } );
+			messenger.NextSendPass();
+		}
+	}
+	delete jobs;
+
+	log.swap( run.log );
+	TUInt32 numSent = 0;
+	for (TUInt32 sender = 0; sender < run.numSent.size(); ++sender)
+	{
+		numSent += run.numSent[sender];
+	}
+	bool passed = true;
+	if (log.size() != numSent)
+	{
+		cout << numThreads << " threads: " << numSent << " messages sent, " << log.size() << " delivered" << endl;
+		passed = false;
+	}
+	if (run.numOutOfOrder > 0)
+	{
+		cout << numThreads << " threads: " << run.numOutOfOrder << " messages out of order" << endl;
+		passed = false;
+	}
+	return passed;
+}
+
+} // namespace
+
+
+int main()
+{
+	const TUInt32 kThreadCounts[] = { 1, 2, 3, 4, 8, 16 };
+	const TUInt32 kNumRepeats = 3;
+
+	bool passed = true;
+	vector<SDelivery> serialLog;
+	for (TUInt32 count = 0; count < sizeof(kThreadCounts) / sizeof(kThreadCounts[0]); ++count)
+	{
+		// Repeat each count, scheduling differs from run to run
+		for (TUInt32 repeat = 0; repeat < kNumRepeats; ++repeat)
+		{
+			TUInt32 numThreads = kThreadCounts[count];
+			vector<SDelivery> log;
+			passed = RunTest( numThreads, log ) && passed;
+
+			if (serialLog.empty())
+			{
+				serialLog.swap( log );
+				continue;
+			}
+			TUInt32 mismatch = 0;
+			while (mismatch < log.size() && mismatch < serialLog.size() && !(log[mismatch] != serialLog[mismatch]))
+			{
+				++mismatch;
+			}
+			if (mismatch != log.size() || log.size() != serialLog.size())
+			{
+				cout << numThreads << " threads: delivery order differs from 1 thread at message " << mismatch << endl;
+				passed = false;
+			}
+		}
+	}
+
+	cout << (passed ? "Passed" : "FAILED") << ", " << serialLog.size() << " messages per run" << endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,170 @@
+/*******************************************
+	ShotCollisionTest.cpp
+
+	Test that shells hit along their whole path
+	at any update time
+********************************************/
+
+// Fires single shells at a tank with an update time long enough for the shell to pass right
+// through the tank in one step, which a test of the shell's position at the end of the step
+// would miss. Checks that
+// - a shell passing through the tank hits it exactly once
+// - a shell passing just outside the tank's hit radius misses and flies on
+// - a shell passing through a building before the tank is stopped by it and hits nothing
+// Build as a console program with the engine, the game sources except TankAssignment.cpp and
+// MainApp.cpp, and this file. Run from the folder the game runs from so the meshes are found -
+// they are loaded on a null device, nothing is drawn. Returns 0 if all checks pass
+
+#include <windows.h>
+#include <d3d10.h>
+#include <iostream>
+using namespace std;
+
+#include "EntityManager.h"
+#include "Messenger.h"
+#include "LineOfSight.h"
+
+namespace gen
+{
+
+// Globals used by the game sources, defined by MainApp.cpp and TankAssignment.cpp in the game
+ID3D10Device* g_pd3dDevice = NULL;
+CEntityManager EntityManager;
+CLineOfSight LineOfSight;
+extern CMessenger Messenger;
+
+vector<TEntityUID> TankID;
+TEntityUID GetTankUID( int team )
+{
+	return team < static_cast<int>(TankID.size()) ? TankID[team] : SystemUID;
+}
+
+} // namespace gen
+
+using namespace gen;
+
+namespace
+{
+
+// The shell starts at the origin facing along Z. In the first update it travels the whole of its
+// path past the target, further frames check that nothing more happens
+const TFloat32 kLongUpdate = 2.0f;
+const TFloat32 kTargetDistance = 25.0f;
+const TUInt32  kExtraFrames = 10;
+const TFloat32 kFrameTime = 1.0f / 60.0f;
+
+// Hit radius of shells against tanks, and how far outside it the missing shell passes
+const TFloat32 kHitRadius = SHELL_SIZE + TANK_RADIUS;
+const TFloat32 kMissMargin = 0.1f;
+
+// Building between the shell and the target in the scenery test
+const TFloat32 kBuildingDistance = 12.0f;
+const TFloat32 kBuildingRadius = 4.0f;
+
+// Count the hit messages waiting for the given tank, removing all its messages
+TUInt32 DrainHits( TEntityUID tank )
+{
+	TUInt32 numHits = 0;
+	for (const SMessage& msg : Messenger.DrainMessages( tank ))
+	{
+		if (msg.type == Msg_Hit)
+		{
+			++numHits;
+		}
+	}
+	return numHits;
+}
+
+// Fire one shell from the origin along Z at a stationary enemy tank at the given X offset from
+// the shell's path, with the given scenery stopping shots. Returns the number of hits on the
+// tank, also returning the number of shells still in flight after the long update
+TUInt32 FireShell( TFloat32 targetOffset, CLineOfSight* scenery, TUInt32& numInFlight )
+{
+	// Tanks are stopped until sent Msg_Go, the firing tank is well away from the shell's path
+	vector<CVector3> patrol;
+	patrol.push_back( CVector3::kOrigin );
+	TEntityUID firer = EntityManager.CreateTank( "Rogue Scout", 0, patrol, "A", CVector3( -100.0f, 0.5f, 0.0f ) );
+	TEntityUID target = EntityManager.CreateTank( "Oberon MkII", 1, patrol, "B",
+	                                              CVector3( targetOffset, 0.5f, kTargetDistance ) );
+	EntityManager.SetShotScenery( scenery );
+
+	// One update to put the tanks in the spatial grid, then clear their messages
+	EntityManager.UpdateAllEntities( kFrameTime );
+	Messenger.SwapMessageBuffers();
+	DrainHits( target );
+
+	EntityManager.CreateShell( "Shell Type 1", EntityManager.GetHandle( firer ), 0, 10.0f,
+	                           CVector3( 0.0f, 0.5f, 0.0f ), CVector3( 0.0f, 0.0f, 0.0f ) );
+	EntityManager.UpdateAllEntities( kLongUpdate );
+	numInFlight = EntityManager.NumProjectiles();
+
+	// Hits are read here before the target's update would read them
+	TUInt32 numHits = 0;
+	for (TUInt32 frame = 0; frame < kExtraFrames; ++frame)
+	{
+		Messenger.AdvanceTime( kFrameTime );
+		Messenger.SwapMessageBuffers();
+		numHits += DrainHits( target );
+		EntityManager.UpdateAllEntities( kFrameTime );
+	}
+	Messenger.SwapMessageBuffers();
+	numHits += DrainHits( target );
+
+	EntityManager.SetShotScenery( 0 );
+	EntityManager.DestroyAllEntities();
+	return numHits;
+}
+
+} // namespace
+
+
+int main()
+{
+	// Meshes need a device to load into, a null device draws nothing
+	if (FAILED( D3D10CreateDevice( NULL, D3D10_DRIVER_TYPE_NULL, NULL, 0, D3D10_SDK_VERSION, &g_pd3dDevice ) ))
+	{
+		cout << "FAILED: could not create a null device" << endl;
+		return 1;
+	}
+	EntityManager.CreateTemplate( "Buff", "Buff box: Ammo", "Sphere.x" );
+	EntityManager.CreateTankTemplate( "Tank", "Rogue Scout", "HoverTank02.x", 24.0f, 2.2f, 2.0f, kfPi / 3, 100, 20 );
+	EntityManager.CreateTankTemplate( "Tank", "Oberon MkII", "HoverTank07.x", 18.0f, 1.6f, 1.3f, kfPi / 4, 120, 35 );
+	EntityManager.CreateTemplate( "Projectile", "Shell Type 1", "Bullet.x" );
+	Messenger.SetFramePhased( true );
+
+	bool passed = true;
+	TUInt32 numInFlight;
+
+	// Straight through the middle of the tank
+	TUInt32 numHits = FireShell( 0.0f, 0, numInFlight );
+	if (numHits != 1 || numInFlight != 0)
+	{
+		cout << "Shell through the tank: " << numHits << " hits, " << numInFlight << " shells in flight" << endl;
+		passed = false;
+	}
+
+	// Past the tank, just outside its hit radius
+	numHits = FireShell( kHitRadius + kMissMargin, 0, numInFlight );
+	if (numHits != 0 || numInFlight != 1)
+	{
+		cout << "Shell past the tank: " << numHits << " hits, " << numInFlight << " shells in flight" << endl;
+		passed = false;
+	}
+
+	// Through a building in front of the tank
+	CLineOfSight buildings;
+	buildings.AddOccluder( CVector3( 0.0f, 0.0f, kBuildingDistance ), kBuildingRadius );
+	buildings.Bake();
+	numHits = FireShell( 0.0f, &buildings, numInFlight );
+	if (numHits != 0 || numInFlight != 0)
+	{
+		cout << "Shell through a building: " << numHits << " hits, " << numInFlight << " shells in flight" << endl;
+		passed = false;
+	}
+
+	EntityManager.DestroyAllTemplates();
+	g_pd3dDevice->Release();
+
+	cout << (passed ? "Passed" : "FAILED") << endl;
+	return passed ? 0 : 1;
+}
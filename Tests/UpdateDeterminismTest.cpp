@@ -0,0 +1,225 @@
+/*******************************************
+	UpdateDeterminismTest.cpp
+
+	Test that parallel entity updates give the
+	same results as the serial update
+********************************************/
+
+// Runs a battle of many tanks, with scenery and crates, first with the serial update
+// (SetUpdateThreads(1)) then with the job system on several thread counts, including one thread
+// per hardware thread (SetUpdateThreads(0)). Every frame the position, state and HP of each tank
+// are recorded. Checks that every parallel run records exactly what the serial run did
+// Build as a console program with GEN_MESSENGER_THREAD_SAFE=1, the engine, the game sources except
+// TankAssignment.cpp and MainApp.cpp, and this file. Run from the folder the game runs from so
+// the meshes are found - they are loaded on a null device, nothing is drawn. Returns 0 if all
+// runs match
+
+#include <windows.h>
+#include <d3d10.h>
+#include <new>
+#include <iostream>
+using namespace std;
+
+#include "EntityManager.h"
+#include "Messenger.h"
+#include "LineOfSight.h"
+
+#if !GEN_MESSENGER_THREAD_SAFE
+#error Build the update determinism test with GEN_MESSENGER_THREAD_SAFE=1
+#endif
+
+namespace gen
+{
+
+// Globals used by the game sources, defined by MainApp.cpp and TankAssignment.cpp in the game
+ID3D10Device* g_pd3dDevice = NULL;
+CEntityManager EntityManager;
+CLineOfSight LineOfSight;
+extern CMessenger Messenger;
+
+vector<TEntityUID> TankID;
+TEntityUID GetTankUID( int team )
+{
+	return team < static_cast<int>(TankID.size()) ? TankID[team] : SystemUID;
+}
+
+} // namespace gen
+
+using namespace gen;
+
+namespace
+{
+
+// Shape of the battle. There are enough tanks for the entity update and the busier state
+// passes to be split into several chunks
+const TUInt32  kTanksPerTeam = 48;
+const TUInt32  kNumTrees = 100;
+const TUInt32  kNumFrames = 2400;
+const TUInt32  kCrateInterval = 30;
+const TFloat32 kFrameTime = 1.0f / 60.0f;
+
+// A tank as recorded each frame
+struct STankRecord
+{
+	CVector3 position;
+	string   state;
+	TFloat32 hp;
+};
+
+bool operator!=( const STankRecord& a, const STankRecord& b )
+{
+	return a.position.x != b.position.x || a.position.y != b.position.y || a.position.z != b.position.z ||
+	       a.state != b.state || a.hp != b.hp;
+}
+
+// Repeatable pseudo-random number in the given range
+TFloat32 Random( TUInt32& seed, TFloat32 min, TFloat32 max )
+{
+	seed = seed * 1664525u + 1013904223u;
+	return min + (max - min) * static_cast<TFloat32>(seed >> 8) / static_cast<TFloat32>(1 << 24);
+}
+
+// Create the scenery, templates and tanks of the battle
+void SetUpScene( TUInt32& seed )
+{
+	// Scenery only blocks line of sight and shots, it is not drawn
+	LineOfSight.AddOccluder( CVector3( 0.0f, 0.0f, 40.0f ), 12.0f );
+	for (TUInt32 tree = 0; tree < kNumTrees; ++tree)
+	{
+		LineOfSight.AddOccluder( CVector3( Random( seed, -200.0f, 30.0f ), 0.0f, Random( seed, 40.0f, 150.0f ) ), 1.5f );
+	}
+	LineOfSight.Bake();
+	EntityManager.SetShotScenery( &LineOfSight );
+
+	EntityManager.CreateTemplate( "Buff", "Buff box: Ammo", "Sphere.x" );
+	EntityManager.CreateTankTemplate( "Tank", "Rogue Scout", "HoverTank02.x", 24.0f, 2.2f, 2.0f, kfPi / 3, 100, 20 );
+	EntityManager.CreateTankTemplate( "Tank", "Oberon MkII", "HoverTank07.x", 18.0f, 1.6f, 1.3f, kfPi / 4, 120, 35 );
+	EntityManager.CreateTemplate( "Projectile", "Shell Type 1", "Bullet.x" );
+
+	vector<CVector3> patrol1;
+	patrol1.push_back( CVector3( -15.0f, 0.0f, 35.0f ) );
+	patrol1.push_back( CVector3( -40.0f, 0.0f, 50.0f ) );
+	patrol1.push_back( CVector3( -15.0f, 0.0f, 40.0f ) );
+	vector<CVector3> patrol2;
+	patrol2.push_back( CVector3( 15.0f, 0.0f, 35.0f ) );
+	patrol2.push_back( CVector3( 40.0f, 0.0f, 50.0f ) );
+	patrol2.push_back( CVector3( 15.0f, 0.0f, 40.0f ) );
+	for (TUInt32 tank = 0; tank < kTanksPerTeam; ++tank)
+	{
+		TFloat32 offset = 5.0f + 10.0f * (tank % 4);
+		TFloat32 spread = 3.0f * (tank / 4);
+		TankID.push_back( EntityManager.CreateTank( "Rogue Scout", 0, patrol1, "A",
+		                                            CVector3( -offset - spread, 0.5f, -offset ) ) );
+		TankID.push_back( EntityManager.CreateTank( "Oberon MkII", 1, patrol2, "B",
+		                                            CVector3( offset + spread, 0.5f, offset ), CVector3( 0.0f, kfPi, 0.0f ) ) );
+	}
+
+	Messenger.SetFramePhased( true );
+	Messenger.SetAdvisoryBudget( 64 );
+	EntityManager.SetThinkBudget( 32 );
+
+	SMessage msg;
+	msg.type = Msg_Go;
+	msg.from = SystemUID;
+	Messenger.SendGroupMessage( Group_Tanks, msg );
+}
+
+// Run the battle on the given number of threads (see SetUpdateThreads), recording every tank
+// in every frame. Destroyed tanks are recorded with no state
+void RunBattle( TUInt32 numThreads, vector<STankRecord>& records )
+{
+	// The game's globals have no reset, so each run rebuilds them in place to start from the
+	// same UIDs, message time and scenery
+	EntityManager.~CEntityManager();
+	Messenger.~CMessenger();
+	LineOfSight.~CLineOfSight();
+	new (&LineOfSight) CLineOfSight;
+	new (&Messenger) CMessenger;
+	new (&EntityManager) CEntityManager;
+	TankID.clear();
+
+	TUInt32 seed = 1;
+	SetUpScene( seed );
+	EntityManager.SetUpdateThreads( numThreads );
+
+	records.clear();
+	for (TUInt32 frame = 0; frame < kNumFrames; ++frame)
+	{
+		Messenger.AdvanceTime( kFrameTime );
+		Messenger.SwapMessageBuffers();
+		if (frame % kCrateInterval == 0)
+		{
+			EntityManager.CreateCrate( "Buff box: Ammo", "Ammo Crate",
+			                           CVector3( Random( seed, -30.0f, 30.0f ), 0.5f, Random( seed, -30.0f, 30.0f ) ),
+			                           CVector3( 0.01f, 0.01f, 0.01f ) );
+		}
+		EntityManager.UpdateAllEntities( kFrameTime );
+		EntityManager.UpdateTransforms();
+
+		for (TUInt32 tank = 0; tank < TankID.size(); ++tank)
+		{
+			STankRecord record = { CVector3::kOrigin, "", 0.0f };
+			CTankEntity* tankEntity = static_cast<CTankEntity*>(EntityManager.GetEntity( TankID[tank] ));
+			if (tankEntity)
+			{
+				record.position = tankEntity->Position();
+				record.state = tankEntity->GetState();
+				record.hp = tankEntity->GetHealth();
+			}
+			records.push_back( record );
+		}
+	}
+
+	EntityManager.SetUpdateThreads( 1 );
+	EntityManager.DestroyAllEntities();
+	EntityManager.DestroyAllTemplates();
+}
+
+} // namespace
+
+
+int main()
+{
+	// Meshes need a device to load into, a null device draws nothing
+	if (FAILED( D3D10CreateDevice( NULL, D3D10_DRIVER_TYPE_NULL, NULL, 0, D3D10_SDK_VERSION, &g_pd3dDevice ) ))
+	{
+		cout << "FAILED: could not create a null device" << endl;
+		return 1;
+	}
+
+	vector<STankRecord> serialRecords;
+	RunBattle( 1, serialRecords );
+	TUInt32 numAlive = 0;
+	for (TUInt32 tank = serialRecords.size() - TankID.size(); tank < serialRecords.size(); ++tank)
+	{
+		numAlive += serialRecords[tank].state.empty() ? 0 : 1;
+	}
+	cout << "Serial update: " << numAlive << " of " << TankID.size() << " tanks alive after " << kNumFrames << " frames" << endl;
+
+	// 0 is one thread per hardware thread, the others are fixed so the test means something on
+	// any machine
+	const TUInt32 kThreadCounts[] = { 0, 2, 3, 8 };
+	bool passed = true;
+	for (TUInt32 count = 0; count < sizeof(kThreadCounts) / sizeof(kThreadCounts[0]); ++count)
+	{
+		vector<STankRecord> records;
+		RunBattle( kThreadCounts[count], records );
+
+		TUInt32 mismatch = 0;
+		while (mismatch < records.size() && !(records[mismatch] != serialRecords[mismatch]))
+		{
+			++mismatch;
+		}
+		if (mismatch < records.size())
+		{
+			cout << "SetUpdateThreads(" << kThreadCounts[count] << "): frame " << mismatch / TankID.size()
+			     << ", tank " << mismatch % TankID.size() << " differs from the serial update" << endl;
+			passed = false;
+		}
+	}
+
+	g_pd3dDevice->Release();
+
+	cout << (passed ? "Passed" : "FAILED") << endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*******************************************
+	TimerWheel.h
+
+	Hierarchical timing wheel template
+********************************************/
+
+#pragma once
+
+#include <vector>
+using namespace std;
+
+#include "Defines.h"
+
+namespace gen
+{
+
+// A hierarchical timing wheel holds items that are due at a given tick and hands them back when
+// time reaches that tick. Time is counted in whole ticks. The wheel has several levels of slots:
+// level 0 has one slot per tick, each slot at level 1 covers a full turn of level 0 and so on.
+// An item is placed at the lowest level whose range covers it, then moved down a level each time
+// its slot comes round ("cascading"), so adding an item and advancing a tick are both O(1) however
+// many items are waiting
+// Items further ahead than the wheel can hold are placed in the furthest slot and cascade back in
+// until they are due
+template <class TItem>
+class CTimerWheel
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Default constructor, time starts at tick 0
+	CTimerWheel() : m_Now( 0 ), m_NumItems( 0 ) {}
+
+	// No destructor needed
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CTimerWheel( const CTimerWheel& );
+	CTimerWheel& operator=( const CTimerWheel& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	/////////////////////////////////////
+	// Getters
+
+	// Return the current tick
+	TUInt32 GetNow()
+	{
+		return m_Now;
+	}
+
+	// Return number of items waiting
+	TUInt32 NumItems()
+	{
+		return m_NumItems;
+	}
+
+
+	/////////////////////////////////////
+	// Timers
+
+	// Add an item due at the given tick. Items due now or in the past are returned on the next tick
+	void Add( const TItem& item, TUInt32 dueTick )
+	{
+		if (static_cast<TInt32>(dueTick - m_Now) <= 0)
+		{
+			dueTick = m_Now + 1;
+		}
+		SEntry entry = { item, dueTick };
+		Insert( entry );
+		++m_NumItems;
+	}
+
+	// Advance time by the given number of ticks, passing each item that becomes due to the given
+	// function (or function object) in the order they fall due
+	template <class TFunc>
+	void Advance( TUInt32 numTicks, TFunc& due )
+	{
+		for (; numTicks > 0 && m_NumItems > 0; --numTicks)
+		{
+			++m_Now;
+
+			// At the start of each turn of a level, cascade the next slot of the level above
+			for (TUInt32 level = 1; level < kNumLevels; ++level)
+			{
+				if (((m_Now >> (kSlotBits * (level - 1))) & kSlotMask) != 0)
+				{
+					break;
+				}
+				Cascade( level, (m_Now >> (kSlotBits * level)) & kSlotMask );
+			}
+
+			// Hand back items in this tick's slot
+			vector<SEntry>& slot = m_Slots[0][m_Now & kSlotMask];
+			if (!slot.empty())
+			{
+				m_Due.swap( slot );
+				for (TUInt32 entry = 0; entry < m_Due.size(); ++entry)
+				{
+					due( m_Due[entry].item );
+				}
+				m_NumItems -= static_cast<TUInt32>(m_Due.size());
+				m_Due.clear();
+			}
+		}
+
+		// Nothing left waiting so time can jump straight to the end
+		m_Now += numTicks;
+	}
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Wheel size: number of levels and slots per level (as a power of two)
+	static const TUInt32 kNumLevels = 4;
+	static const TUInt32 kSlotBits = 6;
+	static const TUInt32 kNumSlots = 1 << kSlotBits;
+	static const TUInt32 kSlotMask = kNumSlots - 1;
+
+	// An item with its due tick
+	struct SEntry
+	{
+		TItem   item;
+		TUInt32 dueTick;
+	};
+
+	// Place an entry in the lowest level that covers its due tick. Entries cascaded down on the
+	// tick they are due go in the current level 0 slot, which is handed back straight after
+	void Insert( const SEntry& entry )
+	{
+		TUInt32 delta = entry.dueTick - m_Now;
+
+		TUInt32 level = 0;
+		while (level < kNumLevels - 1 && delta >= (1u << (kSlotBits * (level + 1))))
+		{
+			++level;
+		}
+
+		// Items beyond the range of the wheel wait in the top level slot that will come round last,
+		// then cascade back in with their remaining delay
+		TUInt32 slotTick = (delta >> (kSlotBits * kNumLevels)) != 0 ? m_Now : entry.dueTick;
+		m_Slots[level][(slotTick >> (kSlotBits * level)) & kSlotMask].push_back( entry );
+	}
+
+	// Move all entries from the given slot down to lower levels
+	void Cascade( TUInt32 level, TUInt32 slot )
+	{
+		m_Cascading.swap( m_Slots[level][slot] );
+		for (TUInt32 entry = 0; entry < m_Cascading.size(); ++entry)
+		{
+			Insert( m_Cascading[entry] );
+		}
+		m_Cascading.clear();
+	}
+
+	// Current tick and number of items waiting
+	TUInt32 m_Now;
+	TUInt32 m_NumItems;
+
+	// Slots for each level
+	vector<SEntry> m_Slots[kNumLevels][kNumSlots];
+
+	// Working lists for items being returned or cascaded, kept to reuse their memory
+	vector<SEntry> m_Due;
+	vector<SEntry> m_Cascading;
+};
+
+
+} // namespace gen
@@ -0,0 +1,63 @@
+/*******************************************
+	TransformStore.cpp
+
+	Chunked storage for entity matrices
+********************************************/
+
+#include "TransformStore.h"
+
+namespace gen
+{
+
+/////////////////////////////////////
+// Constructors/Destructors
+
+// Destructor releases all chunks
+CTransformStore::~CTransformStore()
+{
+	for (TUInt32 chunk = 0; chunk < m_Chunks.size(); ++chunk)
+	{
+		delete[] m_Chunks[chunk];
+	}
+}
+
+
+/////////////////////////////////////
+// Public interface
+
+// Return a block of the given number of contiguous matrices
+CMatrix4x4* CTransformStore::Allocate( TUInt32 numMatrices )
+{
+	// Reuse a freed block of the same size if possible
+	if (numMatrices < m_FreeBlocks.size() && !m_FreeBlocks[numMatrices].empty())
+	{
+		CMatrix4x4* matrices = m_FreeBlocks[numMatrices].back();
+		m_FreeBlocks[numMatrices].pop_back();
+		return matrices;
+	}
+
+	// Otherwise take the block from the end of the last chunk, starting a new chunk if it won't
+	// fit (the rest of the old chunk is unused). Blocks larger than a chunk get a chunk to themselves
+	if (m_ChunkUsed + numMatrices > kChunkSize)
+	{
+		TUInt32 chunkSize = numMatrices > kChunkSize ? numMatrices : kChunkSize;
+		m_Chunks.push_back( new CMatrix4x4[chunkSize] );
+		m_ChunkUsed = 0;
+	}
+	CMatrix4x4* matrices = m_Chunks.back() + m_ChunkUsed;
+	m_ChunkUsed += numMatrices;
+	return matrices;
+}
+
+// Return a block from Allocate to the store, passing the same number of matrices
+void CTransformStore::Free( CMatrix4x4* matrices, TUInt32 numMatrices )
+{
+	if (numMatrices >= m_FreeBlocks.size())
+	{
+		m_FreeBlocks.resize( numMatrices + 1 );
+	}
+	m_FreeBlocks[numMatrices].push_back( matrices );
+}
+
+
+} // namespace gen
@@ -0,0 +1,68 @@
+/*******************************************
+	TransformStore.h
+
+	Chunked storage for entity matrices
+********************************************/
+
+#pragma once
+
+#include <vector>
+using namespace std;
+
+#include "Defines.h"
+#include "CMatrix4x4.h"
+
+namespace gen
+{
+
+// The transform store holds the matrices of all entities in large contiguous chunks, rather than
+// each entity allocating its own arrays. An entity takes one block of matrices (its relative
+// matrices followed by its absolute ones), so an entity's matrices are together and entities
+// created one after another are next to each other in memory
+// Freed blocks are kept in a free list for their size and reused by the next entity needing a
+// block that size - most entities created during play are the same few types
+class CTransformStore
+{
+/////////////////////////////////////
+//	Constructors/Destructors
+public:
+	// Default constructor, no chunks are allocated until needed
+	CTransformStore() : m_ChunkUsed( kChunkSize ) {}
+
+	// Destructor releases all chunks
+	~CTransformStore();
+
+private:
+	// Prevent use of copy constructor and assignment operator (private and not defined)
+	CTransformStore( const CTransformStore& );
+	CTransformStore& operator=( const CTransformStore& );
+
+
+/////////////////////////////////////
+//	Public interface
+public:
+
+	// Return a block of the given number of contiguous matrices
+	CMatrix4x4* Allocate( TUInt32 numMatrices );
+
+	// Return a block from Allocate to the store, passing the same number of matrices
+	void Free( CMatrix4x4* matrices, TUInt32 numMatrices );
+
+
+/////////////////////////////////////
+//	Private interface
+private:
+
+	// Number of matrices in each chunk (64KB)
+	static const TUInt32 kChunkSize = 1024;
+
+	// Chunks of matrices, the last one is being allocated from
+	vector<CMatrix4x4*> m_Chunks;
+	TUInt32             m_ChunkUsed; // Number of matrices used in the last chunk
+
+	// Free blocks indexed by number of matrices in the block
+	vector< vector<CMatrix4x4*> > m_FreeBlocks;
+};
+
+
+} // namespace gen